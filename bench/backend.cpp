@@ -0,0 +1,241 @@
+// Code generation, function passes and JIT latency.
+
+#include <string>
+
+#include "bench.h"
+#include "driver.h"
+#include "lexer.h"
+#include "parser.h"
+#include "stats.h"
+
+// Nodes of the kind under test in each codegen body.
+static const unsigned codegen_nodes = 200;
+// Definitions in the JIT for the symbol lookup benchmarks.
+static const unsigned lookup_scales[] = {10, 100, 1000};
+
+// Node_kind - A definition made of one kind of node, and what it needs
+// defined first.
+struct Node_kind {
+    const char* name;
+    std::string prelude;
+    std::string body;
+};
+
+// repeat - f(0) sep f(1) sep ... f(n - 1).
+static std::string repeat(unsigned n,
+                          const std::function<std::string(unsigned)>& f,
+                          const char* sep) {
+    std::string s;
+    for (unsigned k = 0; k != n; ++k)
+        s += (k ? sep : "") + f(k);
+    return s;
+}
+
+static std::vector<Node_kind> node_kinds() {
+    unsigned n = codegen_nodes;
+    auto num = [](unsigned k) { return std::to_string(k); };
+    std::vector<Node_kind> kinds;
+
+    kinds.push_back({"binary", "",
+                     "def k(x) " + repeat(n, [&](unsigned k) {
+                         return "x*" + num(k);
+                     }, " + ") + ";"});
+    kinds.push_back({"call", "def leaf(x y) x*y + 1;",
+                     "def k(x) " + repeat(n, [&](unsigned k) {
+                         return "leaf(x, " + num(k) + ")";
+                     }, " + ") + ";"});
+    kinds.push_back({"if", "",
+                     "def k(x) " + repeat(n, [&](unsigned k) {
+                         return "if x < " + num(k) + " then " + num(k);
+                     }, " else ") + " else 0;"});
+    kinds.push_back({"for", "",
+                     "def k(x) " + repeat(n, [&](unsigned k) {
+                         return "(for i = 0, i < x in x*" + num(k) + ")";
+                     }, " + ") + ";"});
+    kinds.push_back({"var", "",
+                     "def k(x) var a0 = x, " + repeat(n, [&](unsigned k) {
+                         return "a" + num(k + 1) + " = a" + num(k) + " + 1";
+                     }, ", ") + " in a" + num(n) + ";"});
+    kinds.push_back({"index", "",
+                     "def k(a: double[], x) " + repeat(n, [&](unsigned k) {
+                         return "a[" + num(k) + "]";
+                     }, " + ") + ";"});
+    kinds.push_back({"unary_op", "def unary~(v) 0 - v;",
+                     "def k(x) " + std::string(n, '~') + "x;"});
+    kinds.push_back({"binary_op",
+                     "def binary| 5 (l r) if l then 1 else if r then 1 else 0;",
+                     "def k(x) " + repeat(n, [&](unsigned k) {
+                         return "x < " + num(k);
+                     }, " | ") + ";"});
+    kinds.push_back({"vector", "",
+                     "def k(x) var v: vec4 = vec4(x) in hsum(" +
+                     repeat(n, [&](unsigned k) {
+                         return "v*" + num(k);
+                     }, " + ") + ");"});
+    kinds.push_back({"parfor", "",
+                     "def k(x) " + repeat(n / 10, [&](unsigned k) {
+                         return "(parfor sum i = 0, 100 in x*" + num(k) + ")";
+                     }, " + ") + ";"});
+    return kinds;
+}
+
+// parse_one - The definition in 'src', read with the session current.
+static std::unique_ptr<Function_AST> parse_one(const std::string& src) {
+    set_lexer_source(src.data(), src.data() + src.size());
+    get_next_token();
+    auto def = parse_definition();
+    if (!def) {
+        fprintf(stderr, "bench: does not parse: %s\n", src.c_str());
+        exit(1);
+    }
+    return def;
+}
+
+// codegen_phases - Generate the definition in 'src' into a module that is
+// then dropped, returning the time of each phase.
+static Item_stats codegen_phases(const std::string& src) {
+    auto def = parse_one(src);
+    Item_stats item;
+    {
+        Item_scope item_scope(&item);
+        if (!def->codegen()) {
+            fprintf(stderr, "bench: codegen failed: %s\n", src.c_str());
+            exit(1);
+        }
+    }
+    initialize_module();
+    return item;
+}
+
+// bench_codegen - AST to IR and the function passes, per kind of node. The
+// phase timers of stats.h split the two.
+static void bench_codegen(Bench& b) {
+    for (auto& kind : node_kinds()) {
+        std::string codegen_name = std::string("codegen/") + kind.name;
+        std::string optimize_name = std::string("optimize/") + kind.name;
+        if (!b.any_selected({codegen_name, optimize_name}))
+            continue;
+
+        Session s(bench_session_options());
+        if (!kind.prelude.empty())
+            compile_or_die(s, kind.prelude);
+        Session_scope scope(s);
+
+        Item_stats counts = codegen_phases(kind.body);
+        unsigned phase_codegen = static_cast<unsigned>(Phase::Codegen);
+        unsigned phase_optimize = static_cast<unsigned>(Phase::Optimize);
+        b.run_timed(codegen_name, [&] {
+            return codegen_phases(kind.body).ms[phase_codegen] * 1e6;
+        }, counts.ast_nodes, "nodes");
+        b.run_timed(optimize_name, [&] {
+            return codegen_phases(kind.body).ms[phase_optimize] * 1e6;
+        }, counts.ast_nodes, "nodes");
+    }
+}
+
+static void bench_initialize_module(Bench& b) {
+    if (!b.selected("module/initialize"))
+        return;
+    Session s(bench_session_options());
+    Session_scope scope(s);
+    b.run("module/initialize", [] { initialize_module(); });
+}
+
+// bench_jit_latency - From a generated module to callable code, one
+// definition at a time: machine code generation in addModule, then linking
+// on the first lookup.
+static void bench_jit_latency(Bench& b) {
+    if (!b.any_selected({"jit/add_module", "jit/first_lookup"}))
+        return;
+    const std::string src =
+            "def lat(x y) var s = 0 in (for i = 0, i < x in "
+            "s = s + (if i < y then i*y else i - y)) + s*0.5;";
+    Session s(bench_session_options());
+    Session_scope scope(s);
+
+    auto generate = [&] {
+        auto def = parse_one(src);
+        if (!def->codegen())
+            exit(1);
+    };
+    b.run_timed("jit/add_module", [&] {
+        generate();
+        double start = now_ns();
+        s.the_jit->addModule(std::move(s.the_module));
+        double t = now_ns() - start;
+        initialize_module();
+        return t;
+    });
+    b.run_timed("jit/first_lookup", [&] {
+        generate();
+        s.the_jit->addModule(std::move(s.the_module));
+        initialize_module();
+        double start = now_ns();
+        auto addr = cantFail(s.the_jit->findSymbol("lat").getAddress());
+        double t = now_ns() - start;
+        do_not_optimize(addr);
+        return t;
+    });
+}
+
+// bench_find_symbol - Lookups among many modules. The JIT keeps the newest
+// definition of each name in a table, so the oldest and the newest should
+// cost the same; a host symbol is searched for in the process after it.
+static void bench_find_symbol(Bench& b) {
+    for (unsigned n : lookup_scales) {
+        std::string suffix = "/" + std::to_string(n);
+        if (!b.any_selected({"jit/find_symbol/oldest" + suffix,
+                             "jit/find_symbol/newest" + suffix,
+                             "jit/find_symbol/host" + suffix}))
+            continue;
+
+        Session s(bench_session_options());
+        std::string src = "extern sin(x);\n";
+        for (unsigned k = 0; k != n; ++k)
+            src += "def s" + std::to_string(k) + "(x) x + " +
+                   std::to_string(k) + ";\n";
+        compile_or_die(s, src);
+        // Link everything up front, only the lookups are measured.
+        for (unsigned k = 0; k != n; ++k)
+            lookup_or_die<double(double)>(s, "s" + std::to_string(k));
+
+        auto lookup = [&](const std::string& name) {
+            return [&s, name] {
+                auto addr = cantFail(s.the_jit->findSymbol(name).getAddress());
+                do_not_optimize(addr);
+            };
+        };
+        b.run("jit/find_symbol/oldest" + suffix, lookup("s0"));
+        b.run("jit/find_symbol/newest" + suffix,
+              lookup("s" + std::to_string(n - 1)));
+        b.run("jit/find_symbol/host" + suffix, lookup("sin"));
+    }
+}
+
+// bench_redefine - Redefining one function over and over, with a caller
+// linked to each version in turn. Superseded versions are reclaimed once
+// the caller moves on, so the JIT memory should stay flat.
+static void bench_redefine(Bench& b) {
+    if (!b.selected("jit/redefine"))
+        return;
+    Session s(bench_session_options());
+    compile_or_die(s, "def f(x) x; def g(x) f(x) + 1;");
+    unsigned version = 0;
+    auto* r = b.run("jit/redefine", [&] {
+        std::string n = std::to_string(++version);
+        compile_or_die(s, "def f(x) x*" + n + "; def g(x) f(x) + " + n +
+                          "; g(1);");
+    }, 1, "redefinitions");
+    if (r) {
+        r->counters["jit_modules"] = s.the_jit->getNumModules();
+        r->counters["jit_kb"] = s.the_jit->getMappedBytes() / 1024.0;
+    }
+}
+
+void backend_benchmarks(Bench& b) {
+    bench_codegen(b);
+    bench_initialize_module(b);
+    bench_jit_latency(b);
+    bench_find_symbol(b);
+    bench_redefine(b);
+}
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+#include "bench.h"
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Longest batch of iterations in one sample.
+static const uint64_t max_iterations = 1000000000;
+
+double Bench_result::min_ns() const {
+    return *std::min_element(samples_ns.begin(), samples_ns.end());
+}
+
+double Bench_result::median_ns() const {
+    std::vector<double> sorted = samples_ns;
+    std::sort(sorted.begin(), sorted.end());
+    size_t n = sorted.size();
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+double Bench_result::mean_ns() const {
+    double sum = 0;
+    for (double t : samples_ns)
+        sum += t;
+    return sum / samples_ns.size();
+}
+
+double Bench_result::stddev_ns() const {
+    double mean = mean_ns(), sum = 0;
+    for (double t : samples_ns)
+        sum += (t - mean) * (t - mean);
+    return samples_ns.size() > 1 ? std::sqrt(sum / (samples_ns.size() - 1))
+                                 : 0;
+}
+
+double now_ns() {
+    std::chrono::duration<double, std::nano> d =
+            std::chrono::steady_clock::now().time_since_epoch();
+    return d.count();
+}
+
+bool Bench::selected(const std::string& name) const {
+    return name.find(options.filter) != std::string::npos;
+}
+
+bool Bench::any_selected(const std::vector<std::string>& names) const {
+    for (auto& name : names)
+        if (selected(name))
+            return true;
+    return false;
+}
+
+Bench_result* Bench::add(const std::string& name, double items,
+                         const char* item_unit) {
+    results.push_back(std::make_unique<Bench_result>());
+    Bench_result* r = results.back().get();
+    r->name = name;
+    r->items = items;
+    if (item_unit)
+        r->item_unit = item_unit;
+    return r;
+}
+
+Bench_result* Bench::run(const std::string& name,
+                         const std::function<void()>& body, double items,
+                         const char* item_unit) {
+    if (!selected(name))
+        return nullptr;
+    Bench_result* r = add(name, items, item_unit);
+
+    // Warm up, and size the batches from it.
+    double start = now_ns();
+    body();
+    double once = std::max(now_ns() - start, 1.0);
+    r->iterations = std::min<uint64_t>(
+            max_iterations,
+            std::max<uint64_t>(1, options.min_sample_ms * 1e6 / once));
+
+    for (unsigned rep = 0; rep != options.repetitions; ++rep) {
+        start = now_ns();
+        for (uint64_t i = 0; i != r->iterations; ++i)
+            body();
+        r->samples_ns.push_back((now_ns() - start) / r->iterations);
+    }
+    print(*r);
+    return r;
+}
+
+Bench_result* Bench::run_timed(const std::string& name,
+                               const std::function<double()>& body,
+                               double items, const char* item_unit) {
+    if (!selected(name))
+        return nullptr;
+    Bench_result* r = add(name, items, item_unit);
+
+    // The setup is not measured, so batches are sized from the wall time.
+    double start = now_ns();
+    body();
+    double once = std::max(now_ns() - start, 1.0);
+    r->iterations = std::min<uint64_t>(
+            max_iterations,
+            std::max<uint64_t>(1, options.min_sample_ms * 1e6 / once));
+
+    for (unsigned rep = 0; rep != options.repetitions; ++rep) {
+        double measured = 0;
+        for (uint64_t i = 0; i != r->iterations; ++i)
+            measured += body();
+        r->samples_ns.push_back(measured / r->iterations);
+    }
+    print(*r);
+    return r;
+}
+
+void Bench::compare(Bench_result* result, const Bench_result* baseline) {
+    if (!result || !baseline)
+        return;
+    result->counters["speedup_vs_" + baseline->name] =
+            baseline->median_ns() / result->median_ns();
+}
+
+void Bench::print(const Bench_result& r) const {
+    double median = r.median_ns();
+    fprintf(stderr, "%-44s %14.1f ns  +- %5.1f%%", r.name.c_str(), median,
+            100 * r.stddev_ns() / r.mean_ns());
+    if (r.items)
+        fprintf(stderr, "  %10.3g %s/s", r.items * 1e9 / median,
+                r.item_unit.c_str());
+    fprintf(stderr, "\n");
+}
+
+static void write_json_result(raw_ostream& os, const Bench_result& r) {
+    os << "    {\"name\": \"" << r.name << "\""
+       << ", \"iterations\": " << r.iterations
+       << ", \"min_ns\": " << format("%.3f", r.min_ns())
+       << ", \"median_ns\": " << format("%.3f", r.median_ns())
+       << ", \"mean_ns\": " << format("%.3f", r.mean_ns())
+       << ", \"stddev_ns\": " << format("%.3f", r.stddev_ns());
+    if (r.items)
+        os << ", \"items_per_second\": "
+           << format("%.6g", r.items * 1e9 / r.median_ns())
+           << ", \"item_unit\": \"" << r.item_unit << "\"";
+    os << ", \"counters\": {";
+    const char* delim = "";
+    for (auto& counter : r.counters) {
+        os << delim << "\"" << counter.first << "\": "
+           << format("%.6g", counter.second);
+        delim = ", ";
+    }
+    os << "}, \"samples_ns\": [";
+    delim = "";
+    for (double t : r.samples_ns) {
+        os << delim << format("%.3f", t);
+        delim = ", ";
+    }
+    os << "]}";
+}
+
+// The report is
+//   {"context": {"commit": ..., "date": ..., ...},
+//    "benchmarks": [{"name": ..., "median_ns": ..., ...}, ...]}
+// Names are stable across commits, so reports can be diffed by name.
+bool Bench::write_json() const {
+    std::error_code ec;
+    std::unique_ptr<raw_fd_ostream> file;
+    if (!options.out_file.empty()) {
+        file = std::make_unique<raw_fd_ostream>(options.out_file, ec,
+                                                sys::fs::OF_None);
+        if (ec) {
+            fprintf(stderr, "bench: could not write %s: %s\n",
+                    options.out_file.c_str(), ec.message().c_str());
+            return false;
+        }
+    }
+    raw_ostream& os = file ? *file : outs();
+
+    const char* commit = getenv("BENCH_COMMIT");
+    char date[32];
+    time_t t = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+
+    os << "{\n  \"context\": {\"commit\": \"" << (commit ? commit : "")
+       << "\", \"date\": \"" << date
+       << "\", \"host_cpus\": " << std::thread::hardware_concurrency()
+       << ", \"repetitions\": " << options.repetitions
+       << ", \"min_sample_ms\": " << format("%g", options.min_sample_ms)
+       << "},\n  \"benchmarks\": [\n";
+    const char* delim = "";
+    for (auto& r : results) {
+        os << delim;
+        write_json_result(os, *r);
+        delim = ",\n";
+    }
+    os << "\n  ]\n}\n";
+    os.flush();
+    return !file || !file->has_error();
+}
+
+Session_options bench_session_options() {
+    Session_options options;
+    options.buffer_diagnostics = true;
+    return options;
+}
+
+void compile_or_die(Session& s, const std::string& source) {
+    if (!s.compile(source)) {
+        fprintf(stderr, "bench: compile error\n%s", s.diagnostics.c_str());
+        exit(1);
+    }
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [--filter=<substring>] [--repetitions=<n>] "
+                    "[--min-sample-ms=<ms>] [--out=<file.json>]\n", argv0);
+}
+
+int main(int argc, char** argv) {
+    Bench_options options;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (!strncmp(arg, "--filter=", 9))
+            options.filter = arg + 9;
+        else if (!strncmp(arg, "--repetitions=", 14))
+            options.repetitions = std::max(1ul, strtoul(arg + 14, nullptr, 10));
+        else if (!strncmp(arg, "--min-sample-ms=", 16))
+            options.min_sample_ms = strtod(arg + 16, nullptr);
+        else if (!strncmp(arg, "--out=", 6))
+            options.out_file = arg + 6;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    Bench b(options);
+    frontend_benchmarks(b);
+    backend_benchmarks(b);
+    kernel_benchmarks(b);
+    scaling_benchmarks(b);
+    return b.write_json() ? 0 : 1;
+}
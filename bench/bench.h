@@ -0,0 +1,114 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "session.h"
+
+// Bench_options - How the suite is run, from the command line.
+struct Bench_options {
+    // Only run benchmarks whose name contains this.
+    std::string filter;
+    // Samples taken of each benchmark, after one warm-up run.
+    unsigned repetitions = 10;
+    // Iterations are batched until a sample takes at least this long.
+    double min_sample_ms = 20;
+    // Write the JSON report here, standard output if empty.
+    std::string out_file;
+};
+
+// Bench_result - One benchmark: nanoseconds per iteration for each sample.
+struct Bench_result {
+    std::string name;
+    std::vector<double> samples_ns;
+    uint64_t iterations = 0; // Per sample.
+    // Work done by one iteration, for throughput, e.g. 1000 "tokens".
+    double items = 0;
+    std::string item_unit;
+    // Derived numbers, like the speedup over a baseline.
+    std::map<std::string, double> counters;
+
+    double min_ns() const;
+    double median_ns() const;
+    double mean_ns() const;
+    double stddev_ns() const;
+};
+
+// Bench - Runs benchmarks and collects their results.
+class Bench {
+public:
+    explicit Bench(const Bench_options& options) : options(options) {}
+
+    // selected - Whether 'name' passes the filter. Benchmarks with expensive
+    // setup check it first.
+    bool selected(const std::string& name) const;
+    bool any_selected(const std::vector<std::string>& names) const;
+
+    // run - Time 'body', calling it in batches long enough to measure.
+    // Returns the result, null if the benchmark is filtered out.
+    Bench_result* run(const std::string& name,
+                      const std::function<void()>& body, double items = 0,
+                      const char* item_unit = nullptr);
+
+    // run_timed - Like run, for bodies with setup of their own: 'body' runs
+    // one iteration and returns the nanoseconds of the part it measured.
+    Bench_result* run_timed(const std::string& name,
+                            const std::function<double()>& body,
+                            double items = 0, const char* item_unit = nullptr);
+
+    // compare - Record the speedup of 'result' over 'baseline' on it, if both
+    // ran.
+    void compare(Bench_result* result, const Bench_result* baseline);
+
+    // write_json - The report of every result, see bench.cpp.
+    bool write_json() const;
+
+    const Bench_options options;
+
+private:
+    Bench_result* add(const std::string& name, double items,
+                      const char* item_unit);
+    void print(const Bench_result& result) const;
+
+    std::vector<std::unique_ptr<Bench_result>> results;
+};
+
+// now_ns - A monotonic clock for run_timed bodies.
+double now_ns();
+
+// bench_session_options - A quiet session that keeps its diagnostics.
+Session_options bench_session_options();
+
+// compile_or_die - Compile 'source' into 's', exiting with its diagnostics
+// on errors. Benchmarks of broken code are meaningless.
+void compile_or_die(Session& s, const std::string& source);
+
+// lookup_or_die - session.lookup<Fn>(name), exiting if it is missing.
+template <typename Fn> Fn* lookup_or_die(Session& s, const std::string& name) {
+    Fn* fn = s.lookup<Fn>(name);
+    if (!fn) {
+        fprintf(stderr, "bench: no definition of %s\n", name.c_str());
+        exit(1);
+    }
+    return fn;
+}
+
+// Benchmark groups, in the order they run.
+void frontend_benchmarks(Bench& b);
+void backend_benchmarks(Bench& b);
+void kernel_benchmarks(Bench& b);
+void scaling_benchmarks(Bench& b);
+
+// do_not_optimize - Keep 'value' from being optimized away.
+template <typename T> inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+#endif // __BENCH_H
@@ -0,0 +1,107 @@
+// Lexer and parser throughput.
+
+#include <string>
+
+#include "bench.h"
+#include "lexer.h"
+#include "parser.h"
+#include "stats.h"
+
+// Definitions in the generated program.
+static const unsigned program_defs = 500;
+// Terms of the wide expression and parentheses of the deep one.
+static const unsigned wide_terms = 4000;
+static const unsigned deep_nesting = 400;
+
+// mixed_program - Definitions mixing every kind of token, the same on
+// every run.
+static std::string mixed_program(unsigned defs) {
+    std::string src;
+    for (unsigned k = 0; k != defs; ++k) {
+        std::string n = std::to_string(k);
+        src += "# definition " + n + "\n";
+        src += "def f" + n + "(x y) if x < " + n + ".5 then x*y + " + n +
+               " else var t = x - 1 in t*f" + n + "(t, y*0.5);\n";
+        src += "def g" + n + "(a: double[], n: int) var s = 0 in (for i: int = 0,"
+               " i < n in s = s + a[i]*" + n + ".25) + s;\n";
+    }
+    return src;
+}
+
+// wide_expression - 'def wide(x) x*1 + x*2 + ... ;', a long operator chain.
+static std::string wide_expression(unsigned terms) {
+    std::string src = "def wide(x) x*0";
+    for (unsigned k = 1; k != terms; ++k)
+        src += (k % 2 ? " + x*" : " - x*") + std::to_string(k);
+    return src + ";";
+}
+
+// deep_expression - 'def deep(x) (1+(2+(...(x)...)));', deeply nested.
+static std::string deep_expression(unsigned nesting) {
+    std::string src = "def deep(x) ";
+    for (unsigned k = 0; k != nesting; ++k)
+        src += "(" + std::to_string(k) + "+";
+    src += "x" + std::string(nesting, ')');
+    return src + ";";
+}
+
+static void bench_lexer(Bench& b, const std::string& src) {
+    unsigned tokens = 0;
+    set_lexer_source(src.data(), src.data() + src.size());
+    while (gettok() != static_cast<int>(Token::TOK_EOF))
+        ++tokens;
+
+    auto* r = b.run("lex/gettok", [&] {
+        set_lexer_source(src.data(), src.data() + src.size());
+        int tok;
+        do
+            tok = gettok();
+        while (tok != static_cast<int>(Token::TOK_EOF));
+    }, tokens, "tokens");
+    if (r)
+        r->counters["bytes_per_token"] = double(src.size()) / tokens;
+}
+
+// bench_parse - Parse every definition in 'src'. The AST nodes counted on
+// the way are the items.
+static void bench_parse(Bench& b, Session& s, const std::string& name,
+                        const std::string& src) {
+    if (!b.selected(name))
+        return;
+    Session_scope scope(s);
+
+    auto parse_all = [&] {
+        set_lexer_source(src.data(), src.data() + src.size());
+        get_next_token();
+        std::vector<std::unique_ptr<Function_AST>> defs;
+        double start = now_ns();
+        while (cur_tok == static_cast<int>(Token::TOK_DEF)) {
+            auto def = parse_definition();
+            if (!def || cur_tok != ';') {
+                fprintf(stderr, "bench: %s does not parse\n", name.c_str());
+                exit(1);
+            }
+            get_next_token(); // Eat ';'.
+            defs.push_back(std::move(def));
+        }
+        // Freeing the trees is not parsing.
+        return now_ns() - start;
+    };
+
+    Item_stats counts;
+    {
+        Item_scope item_scope(&counts);
+        parse_all();
+    }
+    b.run_timed(name, parse_all, counts.ast_nodes, "nodes");
+}
+
+void frontend_benchmarks(Bench& b) {
+    std::string program = mixed_program(program_defs);
+    bench_lexer(b, program);
+
+    Session s(bench_session_options());
+    bench_parse(b, s, "parse/program", program);
+    bench_parse(b, s, "parse/wide", wide_expression(wide_terms));
+    bench_parse(b, s, "parse/deep", deep_expression(deep_nesting));
+}
@@ -0,0 +1,325 @@
+// Execution speed of JIT-ed kernels, and of the features meant to make them
+// faster: fast-math, vectorized math calls, batch evaluation, parfor, vector
+// types and partitioned object emission.
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "generator.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+// Elements of the array kernels.
+static const int64_t array_size = 1 << 16;
+static const int64_t parfor_size = 1 << 22;
+static const size_t batch_rows = 1 << 16;
+// Definitions of the generated program emitted by the object emission
+// benchmarks.
+static const unsigned aot_defs = 50000;
+
+// The sequencing and comparison operators of the tutorial.
+static const char* operators = R"(
+def unary!(v) if v then 0 else 1;
+def binary> 10 (l r) r < l;
+def binary| 5 (l r) if l then 1 else if r then 1 else 0;
+def binary& 6 (l r) if !l then 0 else !!r;
+def binary : 1 (x y) y;
+)";
+
+static const char* classic_kernels = R"(
+def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);
+
+def mandelconverger(real imag iters creal cimag)
+  if iters > 255 | (real*real + imag*imag > 4) then
+    iters
+  else
+    mandelconverger(real*real - imag*imag + creal, 2*real*imag + cimag,
+                    iters + 1, creal, cimag);
+
+def mandelconverge(real imag) mandelconverger(real, imag, 0, real, imag);
+
+def mandelsum(xmin ymin step n)
+  var s = 0 in
+    (for y = 0, y < n in
+      for x = 0, x < n in
+        s = s + mandelconverge(xmin + x*step, ymin + y*step)) : s;
+
+def loopsum(n) var s = 0 in (for i = 0, i < n in s = s + i*0.5) : s;
+
+def opsum(n)
+  var s = 0 in
+    (for i = 0, i < n in
+      s = s + (i > 10 & i < n - 10 | i > n*0.5) * i) : s;
+)";
+
+static const char* array_kernels = R"(
+extern sin(x);
+extern exp(x);
+
+def dot(a: double[], b: double[], n: int)
+  var s = 0 in (for i: int = 0, i < n in s = s + a[i]*b[i]) : s;
+
+def sinmap(a: double[], out: double[], n: int)
+  for i: int = 0, i < n in out[i] = sin(a[i]);
+
+def expmap(a: double[], out: double[], n: int)
+  for i: int = 0, i < n in out[i] = exp(a[i]);
+
+def sinsum(a: double[], b: double[], n: int)
+  var s = 0 in (for i: int = 0, i < n in s = s + sin(a[i])) : s;
+)";
+
+static const char* parallel_kernels = R"(
+def sumsq(a: double[], n: int)
+  var s = 0 in (for i: int = 0, i < n in s = s + a[i]*a[i]) : s;
+
+def parsumsq(a: double[], n: int) parfor sum i = 0, n in a[i]*a[i];
+)";
+
+static const char* vector_kernels = R"(
+def vecloop(n)
+  var acc: vec4 = vec4(0), x: vec4 = vec4(1, 2, 3, 4) in
+    (for i = 0, i < n in acc = acc*0.5 + x) : hsum(acc);
+
+def scalarloop(n)
+  var a = 0, b = 0, c = 0, d = 0 in
+    (for i = 0, i < n in
+      (a = a*0.5 + 1) : (b = b*0.5 + 2) : (c = c*0.5 + 3) :
+      (d = d*0.5 + 4)) : a + b + c + d;
+)";
+
+static std::vector<double> ramp(size_t n, double scale) {
+    std::vector<double> v(n);
+    for (size_t i = 0; i != n; ++i)
+        v[i] = (i % 1000) * scale;
+    return v;
+}
+
+static void bench_classic(Bench& b) {
+    Session s(bench_session_options());
+    compile_or_die(s, std::string(operators) + classic_kernels);
+
+    auto* fib = lookup_or_die<double(double)>(s, "fib");
+    b.run("kernel/fib25", [&] { do_not_optimize(fib(25)); });
+
+    auto* mandel = lookup_or_die<double(double, double, double, double)>(
+            s, "mandelsum");
+    b.run("kernel/mandelbrot64", [&] {
+        do_not_optimize(mandel(-2.0, -1.5, 3.0 / 64, 64));
+    }, 64 * 64, "points");
+
+    auto* loop = lookup_or_die<double(double)>(s, "loopsum");
+    b.run("kernel/loop1m", [&] { do_not_optimize(loop(1e6)); }, 1e6,
+          "iterations");
+
+    auto* ops = lookup_or_die<double(double)>(s, "opsum");
+    b.run("kernel/operators1m", [&] { do_not_optimize(ops(1e6)); }, 1e6,
+          "iterations");
+}
+
+using Array_fn = double(double*, double*, int64_t);
+
+// bench_array_kernels - The array kernels compiled strictly and with every
+// fast-math flag, against the same loop in C++.
+static void bench_array_kernels(Bench& b) {
+    auto a = ramp(array_size, 0.001);
+    auto c = ramp(array_size, 0.002);
+    std::vector<double> out(array_size);
+
+    Session_options fast_options = bench_session_options();
+    fast_options.fast_math.setFast();
+    Session strict(bench_session_options());
+    Session fast(fast_options);
+    compile_or_die(strict, std::string(operators) + array_kernels);
+    compile_or_die(fast, std::string(operators) + array_kernels);
+
+    auto run_kernel = [&](const std::string& name, Session& s,
+                          const char* kernel) -> Bench_result* {
+        if (!b.selected(name))
+            return nullptr;
+        auto* fn = lookup_or_die<Array_fn>(s, kernel);
+        return b.run(name, [&, fn] {
+            do_not_optimize(fn(a.data(), c.data(), array_size));
+        }, array_size, "elements");
+    };
+
+    auto* dot_native = b.run("reduce/dot/native", [&] {
+        double sum = 0;
+        for (int64_t i = 0; i != array_size; ++i)
+            sum += a[i] * c[i];
+        do_not_optimize(sum);
+    }, array_size, "elements");
+    auto* dot_strict = run_kernel("reduce/dot/strict", strict, "dot");
+    auto* dot_fast = run_kernel("reduce/dot/fast", fast, "dot");
+    b.compare(dot_strict, dot_native);
+    b.compare(dot_fast, dot_strict);
+
+    auto* sin_native = b.run("math/sinmap/native", [&] {
+        for (int64_t i = 0; i != array_size; ++i)
+            out[i] = std::sin(a[i]);
+        do_not_optimize(out[0]);
+    }, array_size, "elements");
+    auto* sin_strict = run_kernel("math/sinmap/strict", strict, "sinmap");
+    auto* sin_fast = run_kernel("math/sinmap/fast", fast, "sinmap");
+    b.compare(sin_strict, sin_native);
+    b.compare(sin_fast, sin_native);
+
+    auto* exp_native = b.run("math/expmap/native", [&] {
+        for (int64_t i = 0; i != array_size; ++i)
+            out[i] = std::exp(a[i]);
+        do_not_optimize(out[0]);
+    }, array_size, "elements");
+    auto* exp_strict = run_kernel("math/expmap/strict", strict, "expmap");
+    auto* exp_fast = run_kernel("math/expmap/fast", fast, "expmap");
+    b.compare(exp_strict, exp_native);
+    b.compare(exp_fast, exp_native);
+
+    auto* sinsum_strict = run_kernel("math/sinsum/strict", strict, "sinsum");
+    auto* sinsum_fast = run_kernel("math/sinsum/fast", fast, "sinsum");
+    b.compare(sinsum_fast, sinsum_strict);
+}
+
+// bench_batch - A definition over columns: one call per row through a
+// function pointer, against the vectorized batch loop of batch.h.
+static void bench_batch(Bench& b) {
+    if (!b.any_selected({"batch/poly/scalar", "batch/poly/batch",
+                         "batch/poly/batch_threads"}))
+        return;
+    Session s(bench_session_options());
+    compile_or_die(s, "def poly(x y) x*x*3 + y*2 + x*y - 1;");
+    auto* poly = lookup_or_die<double(double, double)>(s, "poly");
+
+    auto x = ramp(batch_rows, 0.001);
+    auto y = ramp(batch_rows, 0.003);
+    const double* cols[] = {x.data(), y.data()};
+    std::vector<double> out(batch_rows);
+
+    auto* scalar = b.run("batch/poly/scalar", [&] {
+        for (size_t i = 0; i != batch_rows; ++i)
+            out[i] = poly(x[i], y[i]);
+        do_not_optimize(out[0]);
+    }, batch_rows, "rows");
+    auto* batch = b.run("batch/poly/batch", [&] {
+        s.batch_eval("poly", cols, 2, out.data(), batch_rows, 1);
+    }, batch_rows, "rows");
+    auto* threads = b.run("batch/poly/batch_threads", [&] {
+        s.batch_eval("poly", cols, 2, out.data(), batch_rows);
+    }, batch_rows, "rows");
+    b.compare(batch, scalar);
+    b.compare(threads, scalar);
+}
+
+// bench_parfor - A reduction as a serial loop and as a parfor on the
+// work-stealing pool.
+static void bench_parfor(Bench& b) {
+    if (!b.any_selected({"parfor/sumsq/serial", "parfor/sumsq/parfor"}))
+        return;
+    Session s(bench_session_options());
+    compile_or_die(s, std::string(operators) + parallel_kernels);
+    auto* serial = lookup_or_die<double(double*, int64_t)>(s, "sumsq");
+    auto* parallel = lookup_or_die<double(double*, int64_t)>(s, "parsumsq");
+
+    auto a = ramp(parfor_size, 0.001);
+    auto* serial_r = b.run("parfor/sumsq/serial", [&] {
+        do_not_optimize(serial(a.data(), parfor_size));
+    }, parfor_size, "elements");
+    auto* parallel_r = b.run("parfor/sumsq/parfor", [&] {
+        do_not_optimize(parallel(a.data(), parfor_size));
+    }, parfor_size, "elements");
+    b.compare(parallel_r, serial_r);
+}
+
+// bench_vectors - Four independent recurrences in a vec4 and in four
+// scalars.
+static void bench_vectors(Bench& b) {
+    if (!b.any_selected({"vector/scalar4", "vector/vec4"}))
+        return;
+    Session s(bench_session_options());
+    compile_or_die(s, std::string(operators) + vector_kernels);
+    auto* scalar = lookup_or_die<double(double)>(s, "scalarloop");
+    auto* vector = lookup_or_die<double(double)>(s, "vecloop");
+
+    auto* scalar_r = b.run("vector/scalar4", [&] {
+        do_not_optimize(scalar(1e6));
+    }, 1e6, "iterations");
+    auto* vector_r = b.run("vector/vec4", [&] {
+        do_not_optimize(vector(1e6));
+    }, 1e6, "iterations");
+    b.compare(vector_r, scalar_r);
+}
+
+// aot_partitions - 1, 2, 4, ... and every hardware thread.
+static std::vector<unsigned> aot_partitions() {
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> counts;
+    for (unsigned p = 1; p < threads; p *= 2)
+        counts.push_back(p);
+    counts.push_back(threads);
+    return counts;
+}
+
+// bench_aot - Object emission of a generated program split into more and
+// more partitions, up to one per hardware thread, each lowered on a thread
+// of its own. The program is compiled once, every iteration emits a copy of
+// its module.
+static void bench_aot(Bench& b) {
+    std::vector<unsigned> counts = aot_partitions();
+    std::vector<std::string> names;
+    for (unsigned partitions : counts)
+        names.push_back("aot/emit/" + std::to_string(partitions));
+    if (!b.any_selected(names))
+        return;
+
+    Generator_options gen;
+    gen.functions = aot_defs;
+    Session s(bench_session_options());
+    compile_or_die(s, generate_program(gen));
+    std::unique_ptr<Module> program = std::move(s.aot_module);
+
+    SmallString<128> stem;
+    sys::fs::createUniqueDirectory("kaleidoscope-bench", stem);
+    sys::path::append(stem, "aot");
+
+    Bench_result* baseline = nullptr;
+    for (size_t k = 0; k != counts.size(); ++k) {
+        if (!b.selected(names[k]))
+            continue;
+        s.options.aot.partitions = counts[k];
+        s.options.aot.threads = counts[k];
+
+        auto* r = b.run_timed(names[k], [&] {
+            s.aot_module = CloneModule(*program);
+            double start = now_ns();
+            std::string file = s.emit_object_code(stem.str().str());
+            double t = now_ns() - start;
+            if (file.empty()) {
+                fprintf(stderr, "bench: object emission failed\n%s",
+                        s.diagnostics.c_str());
+                exit(1);
+            }
+            sys::fs::remove(file);
+            return t;
+        }, aot_defs, "definitions");
+        if (counts[k] == 1)
+            baseline = r;
+        else
+            b.compare(r, baseline);
+    }
+    sys::fs::remove(sys::path::parent_path(stem));
+}
+
+void kernel_benchmarks(Bench& b) {
+    bench_classic(b);
+    bench_array_kernels(b);
+    bench_batch(b);
+    bench_parfor(b);
+    bench_vectors(b);
+    bench_aot(b);
+}
@@ -0,0 +1,130 @@
+// Time and memory against program size, on programs from generator.h.
+
+#include <string>
+
+#include "bench.h"
+#include "generator.h"
+#include "lexer.h"
+#include "parser.h"
+#include "stats.h"
+
+#include "llvm/Support/Process.h"
+
+// Definitions in each generated program, by a factor of four.
+static const unsigned program_sizes[] = {64, 256, 1024};
+
+// heap_kb - Bytes allocated by malloc and still in use, in KiB.
+static double heap_kb() {
+    return sys::Process::GetMallocUsage() / 1024.0;
+}
+
+static void bench_scale_lexer(Bench& b, const std::string& name,
+                              const std::string& src) {
+    if (!b.selected(name))
+        return;
+    unsigned tokens = 0;
+    set_lexer_source(src.data(), src.data() + src.size());
+    while (gettok() != static_cast<int>(Token::TOK_EOF))
+        ++tokens;
+
+    b.run(name, [&] {
+        set_lexer_source(src.data(), src.data() + src.size());
+        int tok;
+        do
+            tok = gettok();
+        while (tok != static_cast<int>(Token::TOK_EOF));
+    }, tokens, "tokens");
+}
+
+// bench_scale_parser - Parse the whole program into trees that are all kept
+// until the end, measuring the heap they take.
+static void bench_scale_parser(Bench& b, const std::string& name,
+                               const Generator_options& gen,
+                               const std::string& src) {
+    if (!b.selected(name))
+        return;
+    // The operators parse by their precedence, known once they are compiled.
+    Session s(bench_session_options());
+    compile_or_die(s, generate_operators(gen));
+    Session_scope scope(s);
+
+    double heap = 0;
+    auto parse_all = [&] {
+        double heap_before = heap_kb();
+        set_lexer_source(src.data(), src.data() + src.size());
+        get_next_token();
+        std::vector<std::unique_ptr<Function_AST>> defs;
+        double start = now_ns();
+        while (cur_tok == static_cast<int>(Token::TOK_DEF)) {
+            auto def = parse_definition();
+            if (!def || cur_tok != ';') {
+                fprintf(stderr, "bench: %s does not parse\n", name.c_str());
+                exit(1);
+            }
+            get_next_token(); // Eat ';'.
+            defs.push_back(std::move(def));
+        }
+        double t = now_ns() - start;
+        heap = heap_kb() - heap_before;
+        return t;
+    };
+
+    Item_stats counts;
+    {
+        Item_scope item_scope(&counts);
+        parse_all();
+    }
+    auto* r = b.run_timed(name, parse_all, counts.ast_nodes, "nodes");
+    r->counters["heap_kb"] = heap;
+}
+
+// bench_scale_compile - Compile the program into a fresh session: codegen,
+// function passes and the JIT. The phase times and the heap the session
+// holds afterwards go into the counters.
+static void bench_scale_compile(Bench& b, const std::string& name,
+                                unsigned functions, const std::string& src) {
+    if (!b.selected(name))
+        return;
+    Session_options options = bench_session_options();
+    options.stats.summary = true; // Never written, but collected.
+
+    Item_stats total;
+    double heap = 0;
+    auto* r = b.run_timed(name, [&] {
+        double heap_before = heap_kb();
+        Session s(options);
+        double start = now_ns();
+        compile_or_die(s, src);
+        double t = now_ns() - start;
+        heap = heap_kb() - heap_before;
+        total = s.stats->total();
+        // Reset LLVM's pass timers without a report.
+        s.stats->write(Stats_options());
+        return t;
+    }, functions, "definitions");
+
+    for (unsigned p = 0; p != num_phases; ++p)
+        if (total.ms[p])
+            r->counters[std::string(phase_name(static_cast<Phase>(p))) +
+                        "_ms"] = total.ms[p];
+    r->counters["ast_nodes"] = total.ast_nodes;
+    r->counters["ir_instructions"] = total.ir_instructions;
+    r->counters["jit_kb"] = total.jit_bytes / 1024.0;
+    r->counters["heap_kb"] = heap;
+}
+
+void scaling_benchmarks(Bench& b) {
+    for (unsigned n : program_sizes) {
+        std::string suffix = "/" + std::to_string(n);
+        if (!b.any_selected({"scale/lex" + suffix, "scale/parse" + suffix,
+                             "scale/compile" + suffix}))
+            continue;
+
+        Generator_options gen;
+        gen.functions = n;
+        std::string src = generate_program(gen);
+        bench_scale_lexer(b, "scale/lex" + suffix, src);
+        bench_scale_parser(b, "scale/parse" + suffix, gen, src);
+        bench_scale_compile(b, "scale/compile" + suffix, n, src);
+    }
+}
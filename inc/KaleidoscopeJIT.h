@@ -16,8 +16,10 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
@@ -25,58 +27,455 @@
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Memory.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 
 namespace llvm {
 namespace orc {
 
+/// The address ranges of the functions loaded by every KaleidoscopeJIT in the
+/// process, for profilers that need to name a sampled PC. Each range carries
+/// the generations it was loaded and freed in, so an address reused after
+/// removeModule still resolves to the function that was there when sampled,
+/// until the profiler prunes the ranges no pending sample can need.
+class CodeIndex {
+public:
+  struct Range {
+    JITTargetAddress Start;
+    uint64_t Size;
+    std::string Name;
+    uint64_t Loaded;
+    uint64_t Freed;
+  };
+
+  static CodeIndex &get() {
+    static CodeIndex Index;
+    return Index;
+  }
+
+  /// Start recording. Objects loaded before are not indexed.
+  void enable() { Enabled.store(true); }
+  bool isEnabled() const { return Enabled.load(std::memory_order_relaxed); }
+
+  /// The current generation. Lock free, so signal handlers may read it.
+  uint64_t generation() const {
+    return Generation.load(std::memory_order_acquire);
+  }
+
+  void addObject(const void *JIT, VModuleKey K, const object::ObjectFile &Obj,
+                 const RuntimeDyld::LoadedObjectInfo &Info) {
+    // The debug object has the sections at their load addresses.
+    auto DebugObj = Info.getObjectForDebug(Obj);
+    if (!DebugObj.getBinary())
+      return;
+
+    std::lock_guard<std::mutex> Lock(IndexMutex);
+    uint64_t G = Generation.load() + 1;
+    auto &Live = LiveRanges[{JIT, K}];
+    for (const auto &SymSize :
+         object::computeSymbolSizes(*DebugObj.getBinary())) {
+      const object::SymbolRef &Sym = SymSize.first;
+      auto Type = Sym.getType();
+      auto Name = Sym.getName();
+      auto Addr = Sym.getAddress();
+      if (!Type || !Name || !Addr) {
+        consumeError(Type.takeError());
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        continue;
+      }
+      if (*Type != object::SymbolRef::ST_Function || !SymSize.second)
+        continue;
+      Live.push_back(Ranges.insert(
+          {*Addr, Range{*Addr, SymSize.second, Name->str(), G, UINT64_MAX}}));
+      MaxSize = std::max<uint64_t>(MaxSize, SymSize.second);
+    }
+    Generation.store(G, std::memory_order_release);
+  }
+
+  void removeObject(const void *JIT, VModuleKey K) {
+    std::lock_guard<std::mutex> Lock(IndexMutex);
+    auto It = LiveRanges.find({JIT, K});
+    if (It == LiveRanges.end())
+      return;
+    uint64_t G = Generation.load() + 1;
+    for (auto R : It->second) {
+      R->second.Freed = G;
+      FreedRanges.push_back(R);
+    }
+    LiveRanges.erase(It);
+    Generation.store(G, std::memory_order_release);
+  }
+
+  /// Forget the ranges freed in generation G or earlier, once no sample
+  /// taken before G is left to look them up.
+  void prune(uint64_t G) {
+    std::lock_guard<std::mutex> Lock(IndexMutex);
+    while (!FreedRanges.empty() && FreedRanges.front()->second.Freed <= G) {
+      Ranges.erase(FreedRanges.front());
+      FreedRanges.pop_front();
+    }
+  }
+
+  /// The name of the function that contained Addr in generation G. Only
+  /// ranges starting less than the largest size below Addr can contain it.
+  bool find(JITTargetAddress Addr, uint64_t G, std::string &Name) {
+    std::lock_guard<std::mutex> Lock(IndexMutex);
+    for (auto It = Ranges.upper_bound(Addr); It != Ranges.begin();) {
+      const Range &R = (--It)->second;
+      if (Addr - R.Start >= MaxSize)
+        break;
+      if (Addr < R.Start + R.Size && R.Loaded <= G && G < R.Freed) {
+        Name = R.Name;
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  using RangeMap = std::multimap<JITTargetAddress, Range>;
+
+  std::atomic<bool> Enabled{false};
+  std::atomic<uint64_t> Generation{0};
+  RangeMap Ranges;
+  /// The largest size of any range, bounding the scan of find.
+  uint64_t MaxSize = 0;
+  std::map<std::pair<const void *, VModuleKey>, std::vector<RangeMap::iterator>>
+      LiveRanges;
+  /// Freed ranges still in Ranges, oldest first.
+  std::deque<RangeMap::iterator> FreedRanges;
+  std::mutex IndexMutex;
+};
+
+/// Maps the memory of the JIT's section memory managers, counting the bytes
+/// mapped so the resident size of JIT-ed code can be reported.
+class CountingMemoryMapper : public SectionMemoryManager::MemoryMapper {
+public:
+  sys::MemoryBlock
+  allocateMappedMemory(SectionMemoryManager::AllocationPurpose Purpose,
+                       size_t NumBytes, const sys::MemoryBlock *const NearBlock,
+                       unsigned Flags, std::error_code &EC) override {
+    auto MB = sys::Memory::allocateMappedMemory(NumBytes, NearBlock, Flags, EC);
+    if (!EC)
+      Mapped += MB.size();
+    return MB;
+  }
+
+  std::error_code protectMappedMemory(const sys::MemoryBlock &Block,
+                                      unsigned Flags) override {
+    return sys::Memory::protectMappedMemory(Block, Flags);
+  }
+
+  std::error_code releaseMappedMemory(sys::MemoryBlock &M) override {
+    Mapped -= M.size();
+    return sys::Memory::releaseMappedMemory(M);
+  }
+
+  size_t getMappedBytes() const { return Mapped.load(); }
+
+private:
+  std::atomic<size_t> Mapped{0};
+};
+
 class KaleidoscopeJIT {
 public:
   using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
   using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
 
+  /// An object file being compiled on another thread, see addPendingObject.
+  struct PendingObject {
+    std::shared_future<void> Ready;
+    /// Set before Ready, null if compilation failed.
+    std::unique_ptr<MemoryBuffer> Obj;
+    /// Called with the lock held on the first lookup of one of its symbols,
+    /// with the milliseconds that lookup waited for the object.
+    std::function<void(double)> OnFirstLookup;
+    bool Added = false;
+    bool LookedUp = false;
+  };
+
   KaleidoscopeJIT()
-      : Resolver(createLegacyLookupResolver(
-            ES,
-            [this](const std::string &Name) { return findMangledSymbol(Name); },
-            [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+      : TM(selectHostTarget()), DL(TM->createDataLayout()),
         ObjectLayer(AcknowledgeORCv1Deprecation, ES,
-                    [this](VModuleKey) {
+                    [this](VModuleKey K) {
                       return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
+                          std::make_shared<SectionMemoryManager>(&Mapper),
+                          createResolver(K)};
+                    },
+                    [this](VModuleKey K, const object::ObjectFile &Obj,
+                           const RuntimeDyld::LoadedObjectInfo &Info) {
+                      if (CodeIndex::get().isEnabled())
+                        CodeIndex::get().addObject(this, K, Obj, Info);
+                      for (auto *L : EventListeners)
+                        L->notifyObjectLoaded(K, Obj, Info);
+                    },
+                    ObjLayerT::NotifyFinalizedFtor(),
+                    [this](VModuleKey K, const object::ObjectFile &) {
+                      if (CodeIndex::get().isEnabled())
+                        CodeIndex::get().removeObject(this, K);
+                      for (auto *L : EventListeners)
+                        L->notifyFreeingObject(K);
                     }),
         CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
-                     SimpleCompiler(*TM)) {
+                     SimpleCompiler(*TM)),
+        StubsMgr(createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())()) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  /// A target machine for the host CPU and all of its features. The code
+  /// only ever runs in this process, and the cost models and vector math
+  /// mappings of the function passes follow the features.
+  static TargetMachine *selectHostTarget() {
+    SmallVector<std::string, 32> Attrs;
+    StringMap<bool> Features;
+    if (sys::getHostCPUFeatures(Features))
+      for (auto &Feature : Features)
+        Attrs.push_back((Feature.second ? "+" : "-") + Feature.first().str());
+    return EngineBuilder()
+        .setMCPU(sys::getHostCPUName())
+        .setMAttrs(Attrs)
+        .selectTarget();
+  }
+
+  /// Tell L about every object loaded or freed from now on, e.g. for
+  /// profilers. L must outlive the JIT's objects.
+  void addEventListener(JITEventListener *L) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    EventListeners.push_back(L);
+  }
+
   VModuleKey addModule(std::unique_ptr<Module> M) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    std::vector<std::string> Names;
+    for (auto &GV : M->global_values())
+      if (!GV.isDeclarationForLinker() && !GV.hasLocalLinkage())
+        Names.push_back(mangle(GV.getName().str()));
     auto K = ES.allocateVModule();
     cantFail(CompileLayer.addModule(K, std::move(M)));
-    ModuleKeys.push_back(K);
+    addDefinitions(K, Names);
+    return K;
+  }
+
+  /// Add an object file that was compiled outside the JIT, e.g. on a
+  /// background thread with its own TargetMachine.
+  VModuleKey addObject(std::unique_ptr<MemoryBuffer> Obj) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto Names = definedSymbols(Obj->getMemBufferRef());
+    auto K = ES.allocateVModule();
+    cantFail(ObjectLayer.addObject(K, std::move(Obj)));
+    addDefinitions(K, Names);
     return K;
   }
 
+  /// Declare an object defining Names that is still being compiled. Lookups
+  /// of those names wait until it is ready and add it, or it is added
+  /// earlier by addReadyObjects. Pending objects are added in the order they
+  /// were declared, so redefinitions keep shadowing older ones.
+  void addPendingObject(const std::vector<std::string> &Names,
+                        std::shared_ptr<PendingObject> P) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    for (auto &Name : Names)
+      PendingSymbols[mangle(Name)] = P;
+    PendingObjects.push_back(std::move(P));
+  }
+
+  /// Add the pending objects that are ready, without waiting for any.
+  void addReadyObjects() {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    while (!PendingObjects.empty() &&
+           PendingObjects.front()->Ready.wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready)
+      addFrontPending();
+  }
+
+  /// Remove the module K and forget the names it defines, then reclaim the
+  /// modules that only K linked against. Does nothing if K is already gone.
   void removeModule(VModuleKey K) {
-    ModuleKeys.erase(find(ModuleKeys, K));
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto It = Modules.find(K);
+    if (It == Modules.end())
+      return;
+    ModuleInfo Info = std::move(It->second);
+    Modules.erase(It);
+    for (auto &Name : Info.Names) {
+      auto Def = Definitions.find(Name);
+      if (Def != Definitions.end() && Def->second == K)
+        Definitions.erase(Def);
+    }
     cantFail(CompileLayer.removeModule(K));
+
+    for (auto Used : Info.Uses) {
+      auto UsedIt = Modules.find(Used);
+      if (UsedIt == Modules.end())
+        continue;
+      --UsedIt->second.Users;
+      reclaim(Used);
+    }
+  }
+
+  /// Forget the definition of Name. Its module is removed as soon as it
+  /// defines nothing current and no other module is linked against it.
+  /// Returns false if Name has no definition in the JIT.
+  bool removeSymbol(const std::string &Name) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto MangledName = mangle(Name);
+    resolvePending(MangledName);
+    auto It = Definitions.find(MangledName);
+    if (It == Definitions.end())
+      return false;
+    VModuleKey K = It->second;
+    Definitions.erase(It);
+    --Modules[K].Current;
+    reclaim(K);
+    return true;
+  }
+
+  /// Keep the module defining Name for the life of the JIT, because its
+  /// address was handed to code the JIT cannot see, e.g. the host.
+  void pinSymbol(const std::string &Name) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto It = Definitions.find(mangle(Name));
+    if (It != Definitions.end())
+      Modules[It->second].Pinned = true;
+  }
+
+  /// Bytes mapped for JIT-ed code and data, whole pages.
+  size_t getMappedBytes() const { return Mapper.getMappedBytes(); }
+
+  size_t getNumModules() {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    return Modules.size();
+  }
+
+  /// Point the stub Name at Addr, creating it on first use. Callers bound to
+  /// the stub pick up a new body without being relinked.
+  void setStub(const std::string &Name, JITTargetAddress Addr) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto MangledName = mangle(Name);
+    if (StubsMgr->findStub(MangledName, false).getAddress())
+      cantFail(StubsMgr->updatePointer(MangledName, Addr));
+    else
+      cantFail(
+          StubsMgr->createStub(MangledName, Addr, JITSymbolFlags::Exported));
   }
 
   JITSymbol findSymbol(const std::string Name) {
-    return findMangledSymbol(mangle(Name));
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto Sym = findMangledSymbol(mangle(Name));
+    if (!Sym)
+      return Sym;
+
+    // Materialize while holding the lock, linking touches layer state that
+    // another thread may be modifying.
+    auto Addr = Sym.getAddress();
+    if (!Addr)
+      return Addr.takeError();
+    return JITSymbol(*Addr, Sym.getFlags());
   }
 
 private:
+  /// What the JIT knows of one module: the names it defines, and the
+  /// modules its relocations were resolved into.
+  struct ModuleInfo {
+    std::vector<std::string> Names;
+    /// Names for which this module is the newest definition.
+    unsigned Current = 0;
+    std::set<VModuleKey> Uses;
+    /// Modules linked against this one.
+    unsigned Users = 0;
+    bool Pinned = false;
+  };
+
+  /// Resolves the external symbols of module K, recording the modules K is
+  /// linked against so they are kept while K is.
+  std::shared_ptr<SymbolResolver> createResolver(VModuleKey K) {
+    return createLegacyLookupResolver(
+        ES,
+        [this, K](const std::string &Name) {
+          std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+          VModuleKey Definer = K;
+          auto Sym = findMangledSymbol(Name, &Definer);
+          if (Definer != K && Modules[K].Uses.insert(Definer).second)
+            ++Modules[Definer].Users;
+          return Sym;
+        },
+        [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); });
+  }
+
+  /// The global symbols an object file defines.
+  static std::vector<std::string> definedSymbols(MemoryBufferRef Obj) {
+    std::vector<std::string> Names;
+    auto File = object::ObjectFile::createObjectFile(Obj);
+    if (!File) {
+      consumeError(File.takeError());
+      return Names;
+    }
+    for (const auto &Sym : (*File)->symbols()) {
+      uint32_t Flags = Sym.getFlags();
+      if (!(Flags & object::SymbolRef::SF_Global) ||
+          (Flags & object::SymbolRef::SF_Undefined))
+        continue;
+      if (auto Name = Sym.getName())
+        Names.push_back(Name->str());
+      else
+        consumeError(Name.takeError());
+    }
+    return Names;
+  }
+
+  /// Make K the newest definition of Names. Modules left defining nothing
+  /// current are reclaimed.
+  void addDefinitions(VModuleKey K, const std::vector<std::string> &Names) {
+    auto &Info = Modules[K];
+    Info.Names = Names;
+    for (auto &Name : Names) {
+      auto It = Definitions.find(Name);
+      if (It == Definitions.end()) {
+        Definitions[Name] = K;
+        ++Info.Current;
+        continue;
+      }
+      VModuleKey Old = It->second;
+      It->second = K;
+      ++Info.Current;
+      if (Old != K) {
+        --Modules[Old].Current;
+        reclaim(Old);
+      }
+    }
+  }
+
+  /// Remove K if nothing can reach its code any more.
+  void reclaim(VModuleKey K) {
+    auto It = Modules.find(K);
+    if (It == Modules.end())
+      return;
+    const ModuleInfo &Info = It->second;
+    if (!Info.Current && !Info.Users && !Info.Pinned)
+      removeModule(K);
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -86,7 +485,39 @@ private:
     return MangledName;
   }
 
-  JITSymbol findMangledSymbol(const std::string &Name) {
+  void addFrontPending() {
+    auto P = std::move(PendingObjects.front());
+    PendingObjects.pop_front();
+    if (P->Obj)
+      addObject(std::move(P->Obj));
+    P->Added = true;
+  }
+
+  /// Wait for P and everything declared before it, then add them.
+  void resolvePending(const std::string &Name) {
+    auto It = PendingSymbols.find(Name);
+    if (It == PendingSymbols.end())
+      return;
+    auto P = It->second;
+    PendingSymbols.erase(It);
+
+    auto Start = std::chrono::steady_clock::now();
+    while (!P->Added) {
+      PendingObjects.front()->Ready.wait();
+      addFrontPending();
+    }
+    if (!P->LookedUp) {
+      P->LookedUp = true;
+      std::chrono::duration<double, std::milli> Waited =
+          std::chrono::steady_clock::now() - Start;
+      if (P->OnFirstLookup)
+        P->OnFirstLookup(Waited.count());
+    }
+  }
+
+  /// The symbol Name, setting Definer if it is defined by a module.
+  JITSymbol findMangledSymbol(const std::string &Name,
+                              VModuleKey *Definer = nullptr) {
 #ifdef _WIN32
     // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
     // flag to decide whether a symbol will be visible or not, when we call
@@ -100,12 +531,24 @@ private:
     const bool ExportedSymbolsOnly = true;
 #endif
 
-    // Search modules in reverse order: from last added to first added.
-    // This is the opposite of the usual search order for dlsym, but makes more
-    // sense in a REPL where we want to bind to the newest available definition.
-    for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
+    // A definition may still be compiling.
+    resolvePending(Name);
+
+    // Stubs front functions whose body is swapped at run time.
+    auto Stub = StubsMgr->findStub(Name, ExportedSymbolsOnly);
+    if (Stub.getAddress())
+      return JITSymbol(Stub.getAddress(), Stub.getFlags());
+
+    // Bind to the newest definition. This is the opposite of the usual
+    // search order for dlsym, but makes more sense in a REPL.
+    auto Def = Definitions.find(Name);
+    if (Def != Definitions.end())
+      if (auto Sym =
+              CompileLayer.findSymbolIn(Def->second, Name, ExportedSymbolsOnly)) {
+        if (Definer)
+          *Definer = Def->second;
         return Sym;
+      }
 
     // If we can't find the symbol in the JIT, try looking in the host process.
     if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
@@ -125,12 +568,20 @@ private:
   }
 
   ExecutionSession ES;
-  std::shared_ptr<SymbolResolver> Resolver;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
+  /// Outlives the memory managers of the object layer.
+  CountingMemoryMapper Mapper;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
-  std::vector<VModuleKey> ModuleKeys;
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
+  std::map<VModuleKey, ModuleInfo> Modules;
+  /// The module holding the newest definition of each mangled name.
+  std::map<std::string, VModuleKey> Definitions;
+  std::vector<JITEventListener *> EventListeners;
+  std::deque<std::shared_ptr<PendingObject>> PendingObjects;
+  std::map<std::string, std::shared_ptr<PendingObject>> PendingSymbols;
+  std::recursive_mutex JITMutex;
 };
 
 } // end namespace orc
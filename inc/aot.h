@@ -0,0 +1,33 @@
+#ifndef __AOT_H
+#define __AOT_H
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+using namespace llvm;
+
+// Aot_options - Knobs for the ahead-of-time object emission path.
+struct Aot_options {
+    // Number of module partitions, 0 picks one from the module size. Only the
+    // partition count shapes the output, so it is identical for any -j.
+    unsigned partitions = 0;
+    // Number of machine codegen threads, 0 uses every hardware thread.
+    unsigned threads = 0;
+};
+
+using Target_machine_factory = std::function<std::unique_ptr<TargetMachine>()>;
+
+// emit_partitioned - Split the module into partitions and lower them to
+// machine code in parallel. A single partition is written as "<stem>.o",
+// several are bundled into the deterministic archive "<stem>.a". The name of
+// the file written is stored in 'filename'.
+bool emit_partitioned(std::unique_ptr<Module> m,
+                      const Target_machine_factory& create_tm,
+                      const std::string& stem, const Aot_options& options,
+                      std::string& filename);
+
+#endif // __AOT_H
@@ -0,0 +1,38 @@
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Batch_fn - JIT-compiled loop applying a function to rows [begin, end) of its
+// argument columns. 'out' must not overlap any of the columns.
+using Batch_fn = void (*)(const double* const* cols, double* out,
+                          int64_t begin, int64_t end);
+
+// Compiled_batch - A batch loop in the JIT and the definition it was built
+// from, it is rebuilt when the function is redefined.
+struct Compiled_batch {
+    Batch_fn fn;
+    unsigned arity;
+    unsigned serial;
+};
+
+// These operate on the current session.
+
+// compile_batch - Build the loop for the definition 'name' with the function
+// inlined into it, so LLVM can vectorize the rows. Returns null if 'name' has
+// no definition; 'arity' receives the number of columns it expects.
+Batch_fn compile_batch(const std::string& name, unsigned& arity);
+
+// batch_eval - out[i] = name(cols[0][i], cols[1][i], ...) for every row. Large
+// inputs are split into chunks run on 'threads' threads, 0 uses every
+// hardware thread.
+bool batch_eval(const std::string& name, const double* const* cols,
+                unsigned num_cols, double* out, size_t rows,
+                unsigned threads = 0);
+
+// unload_batch - Drop the batch loop of 'name' from the JIT, if there is one.
+void unload_batch(const std::string& name);
+
+#endif // __BATCH_H
@@ -0,0 +1,51 @@
+#ifndef __BOUNDED_QUEUE_H
+#define __BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// Bounded_queue - A FIFO between two threads. push blocks while 'capacity'
+// items are waiting, pop blocks while there are none. Once closed, pop
+// drains the remaining items and then fails.
+template <typename T> class Bounded_queue {
+public:
+    explicit Bounded_queue(size_t capacity) : capacity(capacity ? capacity : 1) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    // pop - The oldest item, false once the queue is closed and empty.
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // close - No more items will be pushed.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+};
+
+#endif // __BOUNDED_QUEUE_H
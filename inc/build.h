@@ -0,0 +1,17 @@
+#ifndef __BUILD_H
+#define __BUILD_H
+
+#include <string>
+#include <vector>
+
+#include "session.h"
+
+// compile_files - Compile every input in a session of its own on a pool of
+// 'jobs' workers (0 uses every hardware thread) and write "<input stem>.o"
+// next to each input, and "<input stem>.ll" if options.ir_file is set.
+// Diagnostics and per-file timings are reported in input
+// order once all files are done. Returns the process exit code.
+int compile_files(const std::vector<std::string>& files,
+                  Session_options options, unsigned jobs);
+
+#endif // __BUILD_H
@@ -1,10 +1,26 @@
 #ifndef __DRIVER_H
 #define __DRIVER_H
 
+#include <functional>
 #include <memory>
+#include <string>
 
+namespace llvm {
+class Function;
+}
+
+// These work on the current session, see session.h.
 void main_loop();
+// pipelined_loop - main_loop with parsing and machine code generation on
+// threads of their own, see Session_options::pipeline_depth. 'prime' runs on
+// the parsing thread to set up its lexer and read the first token.
+void pipelined_loop(const std::function<void()>& prime);
 void initialize_module();
-void emit_object_code();
+// optimize_function - Run the function passes on 'f', and the loop passes
+// when it has loops. Tiered sessions leave loops to the tier-1 pipeline, so
+// cold definitions stay cheap to compile.
+void optimize_function(llvm::Function& f);
+// emit_object_code - Returns the file written, empty on failure.
+std::string emit_object_code(const std::string& stem);
 
 #endif // __DRIVER_H
@@ -0,0 +1,23 @@
+#ifndef __FAST_MATH_H
+#define __FAST_MATH_H
+
+#include <string>
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Operator.h"
+
+using namespace llvm;
+
+// add_fast_math_flag - Set the flag called 'name' in 'fmf': one of "fast",
+// "reassoc", "nnan", "ninf", "nsz", "arcp", "contract" or "afn". Returns
+// false if there is no such flag.
+bool add_fast_math_flag(const std::string& name, FastMathFlags& fmf);
+
+// parse_fast_math - Set every flag of the comma separated list 'spec'.
+bool parse_fast_math(const std::string& spec, FastMathFlags& fmf);
+
+// set_fast_math_attributes - The function attributes matching 'fmf', so the
+// backend makes the same assumptions as the IR passes.
+void set_fast_math_attributes(Function& f, FastMathFlags fmf);
+
+#endif // __FAST_MATH_H
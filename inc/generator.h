@@ -0,0 +1,34 @@
+#ifndef __GENERATOR_H
+#define __GENERATOR_H
+
+#include <cstdint>
+#include <string>
+
+// Generator_options - The shape of a synthetic program. The same options
+// always give the same program.
+struct Generator_options {
+    // Definitions f0 ... f<n-1>, each of two parameters.
+    unsigned functions = 100;
+    // Levels of nested expressions in a body, and operands of each operator
+    // chain, so a body has about width^depth leaves.
+    unsigned depth = 3;
+    unsigned width = 3;
+    // Chance of a leaf being a call to an earlier definition. Definitions
+    // only call earlier ones, so every call terminates.
+    double call_density = 0.2;
+    // Most 'for' and 'var' expressions nested in one another.
+    unsigned loop_nesting = 2;
+    // User defined operators, the first of ':', '|', '>', '&', '!', '~'.
+    // Loops only return their sum with ':' defined.
+    unsigned operators = 6;
+    uint64_t seed = 1;
+};
+
+// generate_operators - The definitions of the operators the program uses.
+std::string generate_operators(const Generator_options& options);
+
+// generate_program - A whole program: a comment with the options, the
+// operators and then the definitions.
+std::string generate_program(const Generator_options& options);
+
+#endif // __GENERATOR_H
@@ -0,0 +1,25 @@
+#ifndef __INLINER_H
+#define __INLINER_H
+
+#include <cstddef>
+
+#include "llvm/IR/Function.h"
+
+using namespace llvm;
+
+// Inline_options - Limits of cross-module inlining.
+struct Inline_options {
+    // Largest callee, in IR instructions, imported for inlining. 0 disables
+    // cross-module inlining.
+    unsigned budget = 32;
+    // Bytes of bitcode the session's Ir_cache may hold, the oldest
+    // definitions are dropped beyond that.
+    size_t max_retained = 64 << 20;
+};
+
+// inline_callees - Inline the calls in 'f' to small functions defined by
+// earlier modules of the current session. Their retained IR is imported into
+// f's module as available_externally, so it is never emitted twice.
+void inline_callees(Function& f);
+
+#endif // __INLINER_H
@@ -0,0 +1,53 @@
+#ifndef __IR_CACHE_H
+#define __IR_CACHE_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+
+// Ir_cache - The optimized IR of the latest definitions, kept as bitcode so
+// later compiles can import it into any context. Once more than 'max_bytes'
+// are held, the oldest definitions are dropped.
+class Ir_cache {
+public:
+    explicit Ir_cache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+    // retain - Remember the module defining 'name'.
+    void retain(const Module& m, const std::string& name);
+
+    // forget - Drop the definition 'name', if it is held.
+    void forget(const std::string& name);
+
+    // serial - Changes whenever 'name' is redefined, 0 if unknown.
+    unsigned serial(const std::string& name);
+
+    // size - Number of IR instructions of the definition 'name', 0 if
+    // unknown.
+    unsigned size(const std::string& name);
+
+    // load - Parse the retained module of 'name' into 'ctx', null if there is
+    // none.
+    std::unique_ptr<Module> load(const std::string& name, LLVMContext& ctx);
+
+private:
+    struct Definition {
+        SmallString<0> bitcode;
+        unsigned serial;
+        unsigned size;
+    };
+
+    std::mutex mutex;
+    std::map<std::string, Definition> definitions;
+    unsigned next_serial = 1;
+    size_t max_bytes;
+    size_t total_bytes = 0;
+};
+
+#endif // __IR_CACHE_H
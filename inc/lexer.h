@@ -18,15 +18,30 @@ enum class Token : int {
     TOK_BINARY = -11,
     TOK_UNARY = -12,
     // Var
-    TOK_VAR = -13
+    TOK_VAR = -13,
+    // Commands, identifiers the driver tells apart at the top level
+    TOK_BATCH = -14,
+    // Parallel loops
+    TOK_PARFOR = -15,
+    TOK_UNLOAD = -16
 };
 
+// The lexer state is per thread, every thread lexes its own input.
 // Filled in if TOK_IDENTIFIER.
-extern std::string identifier_str;
+extern thread_local std::string identifier_str;
 // Filled in if TOK_NUMBER.
-extern double num_val;
+extern thread_local double num_val;
 
-// Return the next token from standard input.
+// set_lexer_source - Lex [begin, end) instead of standard input. The buffer
+// must outlive the lexing.
+void set_lexer_source(const char* begin, const char* end);
+// set_lexer_stdin - Lex standard input again.
+void set_lexer_stdin();
+
+// Return the next token from the current input.
 int gettok();
+// next_is_identifier - Whether the token after the current one starts with a
+// letter. Only skips whitespace, the token is still lexed by gettok.
+bool next_is_identifier();
 
 #endif // __LEXER_H
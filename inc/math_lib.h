@@ -0,0 +1,34 @@
+#ifndef __MATH_LIB_H
+#define __MATH_LIB_H
+
+#include <memory>
+#include <string>
+
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Target/TargetMachine.h"
+
+using namespace llvm;
+
+// math_intrinsic - The intrinsic a call to the C math function 'name' with
+// 'arity' double arguments is lowered to, Intrinsic::not_intrinsic if none.
+Intrinsic::ID math_intrinsic(const std::string& name, unsigned arity);
+
+// create_library_info - Library info for code generated for 'tm': the C
+// library, plus the SIMD variants of glibc's libmvec that 'tm' can call, so
+// vectorized loops call those instead of the scalar functions.
+std::unique_ptr<TargetLibraryInfoImpl>
+create_library_info(const TargetMachine& tm);
+
+// vector_math_function - The libmvec variant of the C math function 'name'
+// on vectors of 'width' doubles that code for 'tm' can call, empty if the
+// width is not native to 'tm' or there is no such variant.
+StringRef vector_math_function(const TargetMachine& tm, StringRef name,
+                               unsigned width);
+
+// vector_abi_features - The target features a caller of the libmvec variant
+// 'name' needs to pass it vectors, e.g. "+avx2" for the AVX2 variants. Empty
+// if x86-64 itself is enough or 'name' is no variant.
+StringRef vector_abi_features(StringRef name);
+
+#endif // __MATH_LIB_H
@@ -0,0 +1,25 @@
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include <cstdint>
+
+// Parfor_body - The outlined body of a parfor loop: runs the iterations
+// [begin, end) with the variables captured in 'env' and returns the sum of
+// their values, or 0 if the loop is not a reduction.
+using Parfor_body = double (*)(void* env, int64_t begin, int64_t end);
+
+// kaleidoscope_parfor - Run 'body' over [begin, end) in chunks of 'grain'
+// iterations (0 picks a size from the range alone) on the work-stealing
+// pool. Returns the sum of the chunk results, added in iteration order so it
+// does not depend on the schedule or the machine. Nested and concurrent loops
+// run on the calling thread. Called from generated code.
+extern "C" double kaleidoscope_parfor(Parfor_body body, void* env,
+                                      int64_t begin, int64_t end,
+                                      int64_t grain);
+
+// set_parfor_threads - Number of threads running parfor loops, the caller
+// included. 0, the default, uses every hardware thread. Only has an effect
+// before the first parfor loop runs.
+void set_parfor_threads(unsigned threads);
+
+#endif // __PARALLEL_H
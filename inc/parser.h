@@ -8,7 +8,8 @@
 // cur_tok/get_next_token - Provide a simple token buffer. cur_tok is the
 // current token the parser is looking a. get_next_token reads another token
 // from the lexer and updates cur_tok with its results.
-extern int cur_tok;
+// Like the lexer state, it is per thread.
+extern thread_local int cur_tok;
 
 int get_next_token();
 
@@ -16,6 +17,8 @@ std::unique_ptr<Function_AST> parse_definition();
 std::unique_ptr<Prototype_AST> parse_extern();
 std::unique_ptr<Function_AST> parse_top_level_expr();
 
-extern std::map<char, int> binop_precedence;
+// default_binop_precedence - The builtin binary operators. Every session
+// starts from this table and adds its user-defined operators.
+std::map<char, int> default_binop_precedence();
 
 #endif // __PARSER_H
@@ -0,0 +1,58 @@
+#ifndef __PERF_JIT_H
+#define __PERF_JIT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+
+using namespace llvm;
+
+// Perf_options - How the JIT describes its code to 'perf'.
+struct Perf_options {
+    // Append "start size name" lines to /tmp/perf-<pid>.map, which perf
+    // report reads directly.
+    bool map = false;
+    // Write jit-<pid>.dump into 'dir' for 'perf inject --jit'. Unlike the
+    // map, its records are timestamped, so code freed and reloaded at the
+    // same addresses is still attributed correctly.
+    bool jitdump = false;
+    std::string dir = "/tmp";
+};
+
+// Perf_listener - Records every function of every object the JIT loads, with
+// its name, address and size.
+class Perf_listener : public JITEventListener {
+public:
+    explicit Perf_listener(const Perf_options& options);
+    ~Perf_listener() override;
+
+    void notifyObjectLoaded(ObjectKey k, const object::ObjectFile& obj,
+                            const RuntimeDyld::LoadedObjectInfo& info) override;
+    void notifyFreeingObject(ObjectKey k) override;
+
+private:
+    struct Code_range {
+        uint64_t addr;
+        uint64_t size;
+    };
+
+    void write_map(const Code_range& code, StringRef name);
+    void write_code_load(const Code_range& code, StringRef name);
+
+    std::mutex mutex;
+    FILE* map_file = nullptr;
+    FILE* dump_file = nullptr;
+    // The executable mapping of the dump that tells perf record about it.
+    void* dump_marker = nullptr;
+    uint64_t code_index = 0;
+};
+
+// perf_listener - The listener of the process, created by the first call
+// with its 'options'. Every session's JIT reports to it, so one map and one
+// dump cover all of them.
+Perf_listener& perf_listener(const Perf_options& options);
+
+#endif // __PERF_JIT_H
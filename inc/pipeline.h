@@ -0,0 +1,23 @@
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <memory>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Target/TargetMachine.h"
+
+using namespace llvm;
+
+// create_host_target_machine - A target machine for the host CPU and all of
+// its features, for code that is worth the extra compile time.
+std::unique_ptr<TargetMachine> create_host_target_machine();
+
+// optimize_aggressive - The -O3 pipeline: inlining, unrolling and both
+// vectorizers, tuned for 'tm'.
+void optimize_aggressive(Module& m, TargetMachine& tm);
+
+// compile_object - Lower the module to an in-memory object file.
+std::unique_ptr<MemoryBuffer> compile_object(Module& m, TargetMachine& tm);
+
+#endif // __PIPELINE_H
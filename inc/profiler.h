@@ -0,0 +1,26 @@
+#ifndef __PROFILER_H
+#define __PROFILER_H
+
+#include <string>
+
+// Profile_options - Settings of the built-in sampling profiler.
+struct Profile_options {
+    bool enabled = false;
+    // Samples per second of CPU time, a prime keeps clear of periodic work.
+    unsigned frequency = 997;
+    // Write folded stacks here for flamegraph.pl, empty writes none.
+    std::string folded_file;
+};
+
+// start_profiler - Sample the running thread of the process on a CPU timer,
+// naming JIT-ed functions through the JIT's code index. JIT-ed code must
+// keep its frame pointers for its callers to show up, see
+// Session_options::frame_pointers. Returns false where sampling is not
+// supported.
+bool start_profiler(const Profile_options& options);
+
+// stop_profiler - Stop sampling, print the flat profile of the Kaleidoscope
+// functions to stderr and write the folded stacks.
+void stop_profiler();
+
+#endif // __PROFILER_H
@@ -0,0 +1,32 @@
+#ifndef __RUNTIME_IO_H
+#define __RUNTIME_IO_H
+
+#include <cstddef>
+#include <string>
+
+// The output of JIT-ed code. putchard and printd append to a buffer of the
+// calling thread, written out when it is full, before a parfor loop or batch
+// hands work to other threads, after every top-level expression, batch and
+// parallel task, and when the thread exits.
+
+// set_runtime_output - Write to 'filename' instead of standard output or the
+// previous file, which is closed. Call it before any code runs and before
+// other threads print, only the caller's buffer is flushed. Returns false if
+// the file cannot be created.
+bool set_runtime_output(const std::string& filename);
+
+// flush_runtime_output - Write out the buffer of the calling thread. Hosts
+// calling JIT-ed functions through Session::lookup call it to see their
+// output early.
+void flush_runtime_output();
+
+// format_double - 'x' as printf("%f") prints it, into 'out' of at least
+// max_double_chars chars. Returns the length, without a terminator.
+const size_t max_double_chars = 320;
+size_t format_double(double x, char* out);
+
+// Called from generated code.
+extern "C" double putchard(double x);
+extern "C" double printd(double x);
+
+#endif // __RUNTIME_IO_H
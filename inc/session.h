@@ -0,0 +1,209 @@
+#ifndef __SESSION_H
+#define __SESSION_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "KaleidoscopeJIT.h"
+#include "aot.h"
+#include "batch.h"
+#include "inliner.h"
+#include "ir_cache.h"
+#include "perf_jit.h"
+#include "speculate.h"
+#include "stats.h"
+#include "tier.h"
+#include "types.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Forward decl.
+class Expr_AST;
+class Prototype_AST;
+
+// Operator_body - A user-defined operator kept as AST, so its uses can be
+// expanded in place instead of calling it.
+struct Operator_body {
+    std::vector<std::string> args;
+    std::vector<Value_type> arg_types;
+    Value_type ret_type = Value_type::Double;
+    std::unique_ptr<Expr_AST> body;
+    // Set while the body is being expanded, recursive uses become calls.
+    bool expanding = false;
+};
+
+// Session_options - Settings of one compiler session.
+struct Session_options {
+    // Print prompts, the IR of every item and top-level results.
+    bool interactive = false;
+    // Where emit_object_code also writes the IR of every definition, as
+    // text. None if empty.
+    std::string ir_file;
+    // Collect diagnostics in Session::diagnostics instead of printing them.
+    bool buffer_diagnostics = false;
+    Aot_options aot;
+    Tier_options tier;
+    Inline_options inlining;
+    // Fast-math flags of every function, definitions may add more.
+    FastMathFlags fast_math;
+    // Parse, generate code and compile to machine code on three threads, with
+    // up to this many items in flight between them. 0 does every item on the
+    // calling thread before reading the next.
+    unsigned pipeline_depth = 0;
+    // Threads compiling definitions to machine code in the background, see
+    // speculate.h. 0 compiles each definition on its first call.
+    unsigned speculate_threads = 0;
+    // Profiler support for JIT-ed code.
+    Perf_options perf;
+    // Per item phase times and counters, see stats.h.
+    Stats_options stats;
+    // Keep frame pointers in JIT-ed code, so profilers can walk its stack.
+    bool frame_pointers = false;
+};
+
+// Value_type_of - The language type of a host type.
+template <typename T> struct Value_type_of;
+template <> struct Value_type_of<double> {
+    static const Value_type value = Value_type::Double;
+};
+template <> struct Value_type_of<float> {
+    static const Value_type value = Value_type::Float;
+};
+template <> struct Value_type_of<int64_t> {
+    static const Value_type value = Value_type::Int;
+};
+template <> struct Value_type_of<double*> {
+    static const Value_type value = Value_type::Double_array;
+};
+template <> struct Value_type_of<float*> {
+    static const Value_type value = Value_type::Float_array;
+};
+template <> struct Value_type_of<int64_t*> {
+    static const Value_type value = Value_type::Int_array;
+};
+
+// Fn_signature - The language types of a host function type.
+template <typename Fn> struct Fn_signature;
+template <typename R, typename... Args> struct Fn_signature<R(Args...)> {
+    static std::vector<Value_type> args() {
+        return {Value_type_of<Args>::value...};
+    }
+    static const Value_type ret = Value_type_of<R>::value;
+};
+
+// Session - An isolated compiler: its own LLVMContext, JIT, symbol tables and
+// user-defined operators. Independent sessions may be used at the same time
+// from different threads, calls into one session are serialized.
+class Session {
+public:
+    explicit Session(const Session_options& opts = Session_options());
+    ~Session();
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    // compile - Parse, generate and JIT every item in 'source' and run its
+    // top-level expressions. Returns false if any item had an error.
+    bool compile(const std::string& source);
+
+    // lookup - The JIT-ed definition 'name' as a function pointer, or null if
+    // there is no definition with exactly these argument and result types.
+    //   auto* f = session.lookup<double(double, double)>("f");
+    //   auto* g = session.lookup<double(double*, int64_t)>("g");
+    template <typename Fn> Fn* lookup(const std::string& name) {
+        auto addr = lookup_address(name, Fn_signature<Fn>::args(),
+                                   Fn_signature<Fn>::ret);
+        return reinterpret_cast<Fn*>(static_cast<intptr_t>(addr));
+    }
+
+    // batch_eval - Apply the definition 'name' to columns, see batch.h.
+    bool batch_eval(const std::string& name, const double* const* cols,
+                    unsigned num_cols, double* out, size_t rows,
+                    unsigned threads = 0);
+
+    // repl - Run the read-eval-print loop on standard input.
+    void repl();
+
+    // emit_object_code - Write every definition to "<stem>.o", or "<stem>.a"
+    // when the module is split into several partitions. Returns the name of
+    // the file written, empty on failure.
+    std::string emit_object_code(const std::string& stem);
+
+    // report - Print a diagnostic, printf style, or append it to diagnostics.
+    // Safe to call from any thread working for the session.
+    void report(const char* fmt, ...);
+    // error - Report a "log_error" and count it.
+    void error(const char* str);
+
+    // Compiler state, used by the parser and the code generator while the
+    // session is current on a thread.
+    Session_options options;
+    LLVMContext the_context;
+    std::unique_ptr<Module> the_module;
+    IRBuilder<> builder;
+    std::map<std::string, AllocaInst*> named_values;
+    // Self tail calls of the function being generated store their arguments
+    // into these allocas and jump back to tail_recurse_bb.
+    BasicBlock* tail_recurse_bb = nullptr;
+    std::vector<AllocaInst*> tail_recurse_args;
+    // The double variable of each counted loop and its integer counter, so
+    // indexing with the variable needs no conversion.
+    std::map<AllocaInst*, AllocaInst*> loop_counters;
+    std::unique_ptr<legacy::FunctionPassManager> the_fpm;
+    // The loop passes, run after the_fpm on functions with loops.
+    std::unique_ptr<legacy::FunctionPassManager> loop_fpm;
+    // Null unless options.stats asks for statistics. It listens to the JIT,
+    // so it outlives it.
+    std::unique_ptr<Stats> stats;
+    std::unique_ptr<KaleidoscopeJIT> the_jit;
+    std::map<std::string, std::unique_ptr<Prototype_AST>> function_protos;
+    std::map<std::string, Operator_body> operator_bodies;
+    // Numbers the outlined bodies of parfor loops.
+    unsigned parfor_count = 0;
+    std::map<char, int> binop_precedence;
+    // Every definition so far, linked together for object emission.
+    std::unique_ptr<Module> aot_module;
+    Ir_cache ir_cache;
+    std::map<std::string, Compiled_batch> batches;
+    std::unique_ptr<Tier_manager> tier;
+    std::unique_ptr<Speculator> speculator;
+    // Number of errors reported so far.
+    unsigned errors = 0;
+    // Diagnostics held back by options.buffer_diagnostics.
+    std::string diagnostics;
+
+private:
+    JITTargetAddress lookup_address(const std::string& name,
+                                    const std::vector<Value_type>& arg_types,
+                                    Value_type ret_type);
+
+    std::mutex mutex;
+    // Guards errors and diagnostics, the pipeline stages report concurrently.
+    std::mutex diagnostics_mutex;
+};
+
+// current_session - The session the calling thread is working for.
+Session& current_session();
+
+// Session_scope - Makes a session current on this thread for its lifetime.
+class Session_scope {
+public:
+    explicit Session_scope(Session& s);
+    ~Session_scope();
+
+private:
+    Session* prev;
+};
+
+#endif // __SESSION_H
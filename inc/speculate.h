@@ -0,0 +1,62 @@
+#ifndef __SPECULATE_H
+#define __SPECULATE_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "KaleidoscopeJIT.h"
+#include "bounded_queue.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Speculation_stats - Latencies of speculatively compiled definitions.
+struct Speculation_stats {
+    unsigned definitions = 0;
+    // From reading a definition to the next prompt.
+    double prompt_ms_total = 0;
+    double prompt_ms_max = 0;
+    // First calls, and how long they waited for machine code.
+    unsigned first_calls = 0;
+    unsigned first_calls_waited = 0;
+    double first_call_wait_ms_total = 0;
+    double first_call_wait_ms_max = 0;
+};
+
+struct Speculative_job;
+
+// Speculator - Compiles definitions to machine code on background threads.
+// The prompt returns once a definition's IR is optimized; its first call
+// waits for the object only if it is not ready yet.
+class Speculator {
+public:
+    Speculator(KaleidoscopeJIT& jit, unsigned threads);
+    ~Speculator();
+
+    // add_definition - Compile 'm', which defines 'name', in the background.
+    void add_definition(std::unique_ptr<Module> m, const std::string& name);
+
+    // record_prompt - Note a definition took 'ms' until the next prompt.
+    void record_prompt(double ms);
+
+    Speculation_stats stats();
+    // print_stats - Write the latencies to stderr.
+    void print_stats();
+
+private:
+    void worker();
+
+    KaleidoscopeJIT& jit;
+    Bounded_queue<std::unique_ptr<Speculative_job>> jobs;
+    std::vector<std::thread> threads;
+
+    std::mutex stats_mutex;
+    Speculation_stats latency;
+};
+
+#endif // __SPECULATE_H
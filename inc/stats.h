@@ -0,0 +1,158 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+
+// Phase - Where the compiler spends its time on a top-level item.
+enum class Phase {
+    Lex,
+    Parse,
+    Codegen,          // AST to IR, including inlining
+    Optimize,         // the function pass pipeline
+    Machine_codegen,  // IR to object code
+    Link,             // loading objects and resolving symbols
+    Execute,
+};
+
+const unsigned num_phases = static_cast<unsigned>(Phase::Execute) + 1;
+
+// phase_name - The name of 'phase' in reports, like "machine_codegen".
+const char* phase_name(Phase phase);
+
+// Item_stats - What one top-level item cost. The time of each phase excludes
+// the phases nested in it.
+struct Item_stats {
+    Item_stats();
+
+    // "def foo", "extern sin", "expr" or "batch foo".
+    std::string label;
+    double ms[num_phases];
+    uint64_t ast_nodes = 0;
+    uint64_t ir_instructions = 0;
+    // Objects loaded by the JIT and the bytes of their sections.
+    uint64_t modules = 0;
+    uint64_t jit_bytes = 0;
+    // Objects the JIT freed, and the bytes it had mapped once the item was
+    // done. The sum of several items keeps the peak.
+    uint64_t modules_freed = 0;
+    uint64_t jit_resident_bytes = 0;
+
+    double total_ms() const;
+    void add(const Item_stats& other);
+};
+
+// Stats_options - Where the statistics of a session go when it is done.
+struct Stats_options {
+    // Print a summary table to stderr.
+    bool summary = false;
+    // Dump every item, the totals and the time of each pass as JSON or CSV.
+    // Pass times are only collected with llvm::TimePassesIsEnabled, set by
+    // the host, and cover every session of the process.
+    std::string json_file;
+    std::string csv_file;
+
+    bool enabled() const {
+        return summary || !json_file.empty() || !csv_file.empty();
+    }
+};
+
+// Stats - The per item statistics of a session. It also listens to the JIT,
+// counting the objects loaded for the item current on the loading thread.
+class Stats : public JITEventListener {
+public:
+    Stats();
+
+    // record - Keep a finished item, called from any thread.
+    void record(const Item_stats& item);
+
+    void notifyObjectLoaded(ObjectKey k, const object::ObjectFile& obj,
+                            const RuntimeDyld::LoadedObjectInfo& info) override;
+    void notifyFreeingObject(ObjectKey k) override;
+
+    // merge - Add the items of 'other', their labels prefixed by 'prefix',
+    // and its background work.
+    void merge(Stats& other, const std::string& prefix);
+
+    // total - The sum of every item recorded so far.
+    Item_stats total();
+
+    // write - Report everything recorded so far as 'options' asks.
+    void write(const Stats_options& options);
+
+private:
+    void write_summary(const Item_stats& total);
+    bool write_json(const std::string& filename, const Item_stats& total);
+    bool write_csv(const std::string& filename, const Item_stats& total);
+
+    std::mutex mutex;
+    std::vector<Item_stats> items;
+    // Objects loaded while no item was current, e.g. by the tier manager or
+    // the speculator.
+    Item_stats background;
+};
+
+// current_item - The item the calling thread works on, null when statistics
+// are off.
+Item_stats* current_item();
+
+// Item_scope - Makes an item current on this thread for its lifetime. A null
+// item turns the timers of this thread off.
+class Item_scope {
+public:
+    explicit Item_scope(Item_stats* item);
+    ~Item_scope();
+
+private:
+    Item_stats* prev;
+};
+
+// Phase_timer - Adds the wall time of its lifetime to 'phase' of the current
+// item, less the time of the timers started inside it. Without a current
+// item it does not read the clock.
+class Phase_timer {
+public:
+    explicit Phase_timer(Phase phase) : item(current_item()), phase(phase) {
+        if (item)
+            start();
+    }
+    ~Phase_timer() {
+        if (item)
+            stop();
+    }
+
+    Phase_timer(const Phase_timer&) = delete;
+    Phase_timer& operator=(const Phase_timer&) = delete;
+
+private:
+    void start();
+    void stop();
+
+    Item_stats* item;
+    Phase phase;
+    Phase_timer* parent = nullptr;
+    std::chrono::steady_clock::time_point start_time;
+    double nested_ms = 0;
+};
+
+// count_ast_node - Count a node of the item being parsed.
+inline void count_ast_node() {
+    if (Item_stats* item = current_item())
+        ++item->ast_nodes;
+}
+
+// count_instructions - Count the IR of 'm' for the current item.
+void count_instructions(const Module& m);
+
+// label_item - Name the current item in reports.
+void label_item(const std::string& label);
+
+#endif // __STATS_H
@@ -0,0 +1,74 @@
+#ifndef __TIER_H
+#define __TIER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "KaleidoscopeJIT.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Tier_options - Controls profile-guided recompilation of hot definitions.
+struct Tier_options {
+    bool enabled = false;
+    // Entry plus loop back-edge count after which a definition is recompiled.
+    uint64_t threshold = 10000;
+    // How often the background thread looks at the counters.
+    unsigned poll_ms = 10;
+};
+
+struct Tier_record;
+
+// Tier_manager - Tiered compilation for one JIT. Definitions run as an
+// instrumented tier-0 build behind a stub. Once their counters cross the
+// threshold, a background thread recompiles the clean IR with the aggressive
+// pipeline and the profile, and repoints the stub.
+class Tier_manager {
+public:
+    Tier_manager(KaleidoscopeJIT& jit, const Tier_options& options);
+    ~Tier_manager();
+
+    // start/stop - Run and join the background recompile thread.
+    void start();
+    void stop();
+
+    // add_definition - JIT the tier-0 build of 'name' from its optimized
+    // module and start profiling it.
+    void add_definition(std::unique_ptr<Module> m, const std::string& name);
+
+    // remove_definition - Stop profiling 'name'. Code loaded earlier may
+    // still call it through its stub, so its bodies stay in the JIT until
+    // 'name' is defined again.
+    void remove_definition(const std::string& name);
+
+private:
+    void loop();
+    void promote(Tier_record& rec, TargetMachine& tm,
+                 std::unique_lock<std::mutex>& lock);
+    void retire(Tier_record* rec);
+
+    KaleidoscopeJIT& jit;
+    Tier_options options;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+    bool stopping = false;
+    unsigned next_generation = 0;
+
+    // Records are freed with their bodies once a redefinition repoints the
+    // stub, so no code writes to their counters any more.
+    std::vector<std::unique_ptr<Tier_record>> records;
+    // Newest record for each name, unloaded ones included.
+    std::map<std::string, Tier_record*> live_records;
+};
+
+#endif // __TIER_H
@@ -5,6 +5,9 @@
 #include <vector>
 
 #include "KaleidoscopeJIT.h"
+#include "session.h"
+#include "stats.h"
+#include "types.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
@@ -22,22 +25,31 @@
 using namespace llvm;
 using namespace llvm::orc;
 
-// Forward decl.
-class Prototype_AST;
-
-extern LLVMContext the_context;
-extern std::unique_ptr<Module> the_module;
-extern IRBuilder<> builder;
-extern std::map<std::string, AllocaInst*> named_values;
-extern std::unique_ptr<legacy::FunctionPassManager> the_fpm;
-extern std::unique_ptr<KaleidoscopeJIT> the_jit;
-extern std::map<std::string, std::unique_ptr<Prototype_AST>> function_protos;
+// The code generator works on the state of current_session().
 
 // ExprAST - Base class for all expr nodes.
 class Expr_AST {
 public:
+    Expr_AST() { count_ast_node(); }
     virtual ~Expr_AST() {}
     virtual Value* codegen() = 0;
+
+    // mark_tail - Called on the expressions whose value is returned from the
+    // function, so calls there can be emitted as tail calls.
+    virtual void mark_tail() {}
+
+    // assigns - Whether the expression may store to the variable 'name'.
+    virtual bool assigns(const std::string& name) const { return false; }
+
+    // as_constant/as_variable/as_less_than - Look through a numeric literal,
+    // a variable reference or an 'a < b', false/null for anything else.
+    virtual bool as_constant(double& val) const { return false; }
+    virtual const std::string* as_variable() const { return nullptr; }
+    virtual bool as_less_than(Expr_AST*& lhs, Expr_AST*& rhs) { return false; }
+
+    // address - Pointer to the storage the expression names, for the left
+    // side of '='. Reports an error if the expression is not assignable.
+    virtual Value* address();
 };
 
 // Number_expr_AST - Expression class for numeric literals like "1.0".
@@ -47,6 +59,10 @@ class Number_expr_AST : public Expr_AST {
 public:
     Number_expr_AST(double val) : val(val) {}
     Value* codegen() override;
+    bool as_constant(double& v) const override {
+        v = val;
+        return true;
+    }
 };
 
 // Variable_expr_AST - Expression class for referencing a variable, like "a".
@@ -58,6 +74,27 @@ public:
     const std::string& get_name() const { return name; }
 
     Value* codegen() override;
+    const std::string* as_variable() const override { return &name; }
+    Value* address() override;
+};
+
+// Index_expr_AST - Expression class for an array element or a vector lane,
+// like "a[i]".
+class Index_expr_AST : public Expr_AST {
+    std::string name;
+    std::unique_ptr<Expr_AST> index;
+
+    Value* codegen_index();
+
+public:
+    Index_expr_AST(const std::string& name, std::unique_ptr<Expr_AST> index)
+        : name(name), index(std::move(index)) {}
+
+    Value* codegen() override;
+    Value* address() override;
+    bool assigns(const std::string& var) const override {
+        return index->assigns(var);
+    }
 };
 
 // Unary_expr_AST - Expression class for a unary operator.
@@ -70,6 +107,9 @@ public:
         : opcode(opcode), operand(std::move(operand)) {}
 
     Value* codegen() override;
+    bool assigns(const std::string& name) const override {
+        return operand->assigns(name);
+    }
 };
 
 // Binary_expr_AST - Expression class for a binary operator.
@@ -83,18 +123,38 @@ public:
                     std::unique_ptr<Expr_AST> rhs)
         : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
     Value* codegen() override;
+    bool assigns(const std::string& name) const override {
+        if (op == '=' && lhs->as_variable() && *lhs->as_variable() == name)
+            return true;
+        return lhs->assigns(name) || rhs->assigns(name);
+    }
+    bool as_less_than(Expr_AST*& l, Expr_AST*& r) override {
+        if (op != '<')
+            return false;
+        l = lhs.get();
+        r = rhs.get();
+        return true;
+    }
 };
 
 // Call_expr_AST - Expression class for function calls.
 class Call_expr_AST : public Expr_AST {
     std::string callee;
     std::vector<std::unique_ptr<Expr_AST>> args;
+    bool is_tail = false;
 
 public:
     Call_expr_AST(const std::string& callee,
                   std::vector<std::unique_ptr<Expr_AST>> args)
         : callee(callee), args(std::move(args)) {}
     Value* codegen() override;
+    void mark_tail() override { is_tail = true; }
+    bool assigns(const std::string& name) const override {
+        for (auto& arg : args)
+            if (arg->assigns(name))
+                return true;
+        return false;
+    }
 };
 
 // If_expr_AST - Expression class for if/then/else.
@@ -109,6 +169,26 @@ public:
         : cond(std::move(cond)), then(std::move(then)), elze(std::move(elze)) {}
 
     Value* codegen() override;
+    void mark_tail() override {
+        then->mark_tail();
+        elze->mark_tail();
+    }
+    bool assigns(const std::string& name) const override {
+        return cond->assigns(name) || then->assigns(name) ||
+               elze->assigns(name);
+    }
+};
+
+// Loop_hints - Optimization hints of a 'for' loop, written in source as
+// 'for [vectorize 4, unroll 8] i = ...'. 0 leaves the choice to the passes.
+struct Loop_hints {
+    // Vector width, 1 disables vectorization.
+    unsigned vectorize = 0;
+    unsigned interleave = 0;
+    // Unroll count, 1 disables unrolling.
+    unsigned unroll = 0;
+    // Iterations per task of a parfor loop.
+    unsigned grain = 0;
 };
 
 // For_expr_AST - Expression class for for/in.
@@ -118,15 +198,60 @@ class For_expr_AST : public Expr_AST {
     std::unique_ptr<Expr_AST> end;
     std::unique_ptr<Expr_AST> step;
     std::unique_ptr<Expr_AST> body;
+    Loop_hints hints;
+    Value_type var_type;
+
+    bool is_counted(double& start_val, double& step_val, Expr_AST*& bound);
 
 public:
     For_expr_AST(const std::string& var_name, std::unique_ptr<Expr_AST> start,
                  std::unique_ptr<Expr_AST> end, std::unique_ptr<Expr_AST> step,
-                 std::unique_ptr<Expr_AST> body)
+                 std::unique_ptr<Expr_AST> body,
+                 const Loop_hints& hints = Loop_hints(),
+                 Value_type var_type = Value_type::Double)
+        : var_name(var_name), start(std::move(start)), end(std::move(end)),
+          step(std::move(step)), body(std::move(body)), hints(hints),
+          var_type(var_type) {}
+
+    Value* codegen() override;
+    bool assigns(const std::string& name) const override {
+        return start->assigns(name) || end->assigns(name) ||
+               (step && step->assigns(name)) || body->assigns(name);
+    }
+};
+
+// Parfor_expr_AST - Expression class for parfor/in. The iterations run in
+// parallel on copies of the variables in scope; a 'sum' loop evaluates to the
+// sum of its body over all of them, any other loop to 0.
+class Parfor_expr_AST : public Expr_AST {
+    std::string var_name;
+    std::unique_ptr<Expr_AST> start;
+    std::unique_ptr<Expr_AST> end;
+    std::unique_ptr<Expr_AST> body;
+    Loop_hints hints;
+    Value_type var_type;
+    bool is_sum;
+
+    Function* outline(StructType* env_type,
+                      const std::vector<std::string>& captured);
+
+public:
+    Parfor_expr_AST(const std::string& var_name,
+                    std::unique_ptr<Expr_AST> start,
+                    std::unique_ptr<Expr_AST> end,
+                    std::unique_ptr<Expr_AST> body,
+                    const Loop_hints& hints = Loop_hints(),
+                    Value_type var_type = Value_type::Int,
+                    bool is_sum = false)
         : var_name(var_name), start(std::move(start)), end(std::move(end)),
-          step(std::move(step)), body(std::move(body)) {}
+          body(std::move(body)), hints(hints), var_type(var_type),
+          is_sum(is_sum) {}
 
     Value* codegen() override;
+    // The body only assigns its own copies.
+    bool assigns(const std::string& name) const override {
+        return start->assigns(name) || end->assigns(name);
+    }
 };
 
 // Prototype_AST - this class represents the "prototype" for a function,
@@ -137,22 +262,47 @@ class Prototype_AST {
     std::vector<std::string> args;
     bool is_operator;
     uint32_t precedence; // If this is a binary op.
+    bool external = false; // Declared by 'extern'.
+    std::vector<Value_type> arg_types; // Doubles if empty.
+    Value_type ret_type;
 
 public:
     Prototype_AST(const std::string& name, std::vector<std::string> args,
-                  bool is_operator = false, uint32_t prec = 0)
+                  bool is_operator = false, uint32_t prec = 0,
+                  std::vector<Value_type> arg_types = std::vector<Value_type>(),
+                  Value_type ret_type = Value_type::Double)
         : name(name), args(std::move(args)), is_operator(is_operator),
-          precedence(prec) {}
+          precedence(prec), arg_types(std::move(arg_types)),
+          ret_type(ret_type) {}
 
     Function* codegen();
     const std::string& get_name() const { return name; }
+    size_t arg_size() const { return args.size(); }
+    const std::vector<std::string>& get_args() const { return args; }
+    Value_type get_arg_type(size_t i) const {
+        return i < arg_types.size() ? arg_types[i] : Value_type::Double;
+    }
+    Value_type get_ret_type() const { return ret_type; }
+
+    // is_all_double - Whether this is an unannotated double(double...).
+    bool is_all_double() const {
+        for (size_t i = 0; i < args.size(); ++i)
+            if (get_arg_type(i) != Value_type::Double)
+                return false;
+        return ret_type == Value_type::Double;
+    }
 
     bool is_unary_op() const { return is_operator && args.size() == 1; }
     bool is_binary_op() const { return is_operator && args.size() == 2; }
 
+    void set_external() { external = true; }
+    bool is_external() const { return external; }
+
+    // The character after "unary" or "binary", overloads carry the operand
+    // types after it.
     char get_operator_name() const {
         assert(is_unary_op() || is_binary_op());
-        return name[name.size() - 1];
+        return name[is_unary_op() ? 5 : 6];
     }
 
     uint32_t get_binary_precedence() const { return precedence; }
@@ -162,25 +312,40 @@ public:
 class Function_AST {
     std::unique_ptr<Prototype_AST> proto;
     std::unique_ptr<Expr_AST> body;
+    FastMathFlags fast_math;
 
 public:
     Function_AST(std::unique_ptr<Prototype_AST> proto,
-                 std::unique_ptr<Expr_AST> body)
-        : proto(std::move(proto)), body(std::move(body)) {}
+                 std::unique_ptr<Expr_AST> body,
+                 FastMathFlags fast_math = FastMathFlags())
+        : proto(std::move(proto)), body(std::move(body)),
+          fast_math(fast_math) {}
     Function* codegen();
+    // get_name - Only valid before codegen, which takes the prototype.
+    const std::string& get_name() const { return proto->get_name(); }
 };
 
 // Var_expr_AST - Expression class for var/in.
 class Var_expr_AST : public Expr_AST {
     std::vector<std::pair<std::string, std::unique_ptr<Expr_AST>>> var_names;
+    std::vector<Value_type> var_types;
     std::unique_ptr<Expr_AST> body;
 
 public:
     Var_expr_AST(std::vector<std::pair<std::string, std::unique_ptr<Expr_AST>>> var_names,
+                 std::vector<Value_type> var_types,
                  std::unique_ptr<Expr_AST> body)
-        : var_names(std::move(var_names)), body(std::move(body)) {}
+        : var_names(std::move(var_names)), var_types(std::move(var_types)),
+          body(std::move(body)) {}
 
     Value* codegen() override;
+    void mark_tail() override { body->mark_tail(); }
+    bool assigns(const std::string& name) const override {
+        for (auto& var : var_names)
+            if (var.second && var.second->assigns(name))
+                return true;
+        return body->assigns(name);
+    }
 };
 
 #endif // __TREE_H
@@ -0,0 +1,58 @@
+#ifndef __TYPES_H
+#define __TYPES_H
+
+#include <string>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Type.h"
+
+using namespace llvm;
+
+// Value_type - The types of the language. Anything without an annotation is
+// a double; 'int' is a 64-bit integer and 'float' is single precision. The
+// array types, written 'double[]' etc., are pointers to buffers the host
+// owns. 'vec2', 'vec4' and 'vec8' are SIMD vectors of doubles.
+enum class Value_type {
+    Double,
+    Float,
+    Int,
+    Double_array,
+    Float_array,
+    Int_array,
+    Vec2,
+    Vec4,
+    Vec8
+};
+
+// type_from_name - The scalar or vector type written as 'name' in an
+// annotation, false if there is no such type.
+bool type_from_name(const std::string& name, Value_type& type);
+
+// type_name - How 'type' is written in an annotation.
+std::string type_name(Value_type type);
+
+// value_type_of - The type whose values have the IR type 'type', false if
+// there is none.
+bool value_type_of(Type* type, Value_type& result);
+
+// array_of - The array type with elements of the scalar 'type'.
+Value_type array_of(Value_type type);
+
+// is_array - Whether 'type' is one of the array types.
+bool is_array(Value_type type);
+
+// is_vector - Whether 'type' is one of the vector types.
+bool is_vector(Value_type type);
+
+// overload_name - The function defining the operator 'name' for operands of
+// 'types'. Operators on vectors are overloaded, so their names carry the
+// operand types: 'binary%.vec4.double'. Other operators keep 'name'.
+std::string overload_name(const std::string& name,
+                          ArrayRef<Value_type> types);
+
+// llvm_type - The IR type values of 'type' have.
+Type* llvm_type(LLVMContext& ctx, Value_type type);
+
+#endif // __TYPES_H
@@ -0,0 +1,140 @@
+#include <algorithm>
+
+#include "aot.h"
+#include "session.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+// Defined functions per partition when the count is picked automatically.
+static const unsigned functions_per_partition = 1024;
+static const unsigned max_auto_partitions = 64;
+
+static unsigned pick_partition_count(const Module& m,
+                                     const Aot_options& options) {
+    if (options.partitions)
+        return options.partitions;
+
+    unsigned defined = 0;
+    for (auto& f : m)
+        if (!f.isDeclaration())
+            ++defined;
+
+    return std::max(1u, std::min(max_auto_partitions,
+                                 defined / functions_per_partition));
+}
+
+// codegen_partition - Lower one bitcode partition to an object file. Every
+// worker parses into a private LLVMContext and builds its own TargetMachine,
+// since neither may be shared between threads.
+static void codegen_partition(StringRef bitcode,
+                              const Target_machine_factory& create_tm,
+                              SmallVectorImpl<char>& object,
+                              std::string& error) {
+    LLVMContext ctx;
+    auto m = parseBitcodeFile(MemoryBufferRef(bitcode, "partition"), ctx);
+    if (!m) {
+        error = toString(m.takeError());
+        return;
+    }
+
+    auto tm = create_tm();
+    (*m)->setDataLayout(tm->createDataLayout());
+
+    raw_svector_ostream dest(object);
+    legacy::PassManager pass;
+    auto file_type = LLVMTargetMachine::CGFT_ObjectFile;
+
+    if (tm->addPassesToEmitFile(pass, dest, nullptr, file_type)) {
+        error = "Can't emit this type of file.";
+        return;
+    }
+
+    pass.run(**m);
+}
+
+static bool write_object(StringRef filename, StringRef object) {
+    std::error_code ec;
+    raw_fd_ostream dest(filename, ec, sys::fs::OF_None);
+
+    if (ec) {
+        current_session().report("Could not open file: %s\n",
+                                 ec.message().c_str());
+        return false;
+    }
+
+    dest << object;
+    return true;
+}
+
+bool emit_partitioned(std::unique_ptr<Module> m,
+                      const Target_machine_factory& create_tm,
+                      const std::string& stem, const Aot_options& options,
+                      std::string& filename) {
+    unsigned partitions = pick_partition_count(*m, options);
+    bool darwin = Triple(m->getTargetTriple()).isOSDarwin();
+
+    // Split on the calling thread and hand each partition over as bitcode, so
+    // the workers never touch the context the module lives in.
+    std::vector<SmallString<0>> bitcode;
+    SplitModule(std::move(m), partitions, [&](std::unique_ptr<Module> part) {
+        bitcode.emplace_back();
+        raw_svector_ostream os(bitcode.back());
+        WriteBitcodeToFile(*part, os);
+    });
+
+    unsigned threads = options.threads ? options.threads
+                                           : heavyweight_hardware_concurrency();
+    threads = std::max(1u, std::min<unsigned>(threads, bitcode.size()));
+
+    std::vector<SmallString<0>> objects(bitcode.size());
+    std::vector<std::string> errors(bitcode.size());
+    {
+        ThreadPool pool(threads);
+        for (size_t i = 0, e = bitcode.size(); i != e; ++i)
+            pool.async([&, i] {
+                codegen_partition(bitcode[i], create_tm, objects[i], errors[i]);
+            });
+        pool.wait();
+    }
+
+    for (auto& error : errors)
+        if (!error.empty()) {
+            current_session().report("%s\n", error.c_str());
+            return false;
+        }
+
+    if (objects.size() == 1) {
+        filename = stem + ".o";
+        return write_object(filename, objects[0]);
+    }
+
+    // Member names and order depend only on the partition index, and the
+    // archive is written without timestamps, so the bytes are reproducible.
+    std::vector<std::string> names;
+    for (size_t i = 0, e = objects.size(); i != e; ++i)
+        names.push_back(stem + ".part" + std::to_string(i) + ".o");
+
+    std::vector<NewArchiveMember> members;
+    for (size_t i = 0, e = objects.size(); i != e; ++i)
+        members.emplace_back(MemoryBufferRef(objects[i], names[i]));
+
+    filename = stem + ".a";
+    auto kind = darwin ? object::Archive::K_DARWIN : object::Archive::K_GNU;
+    if (auto err = writeArchive(filename, members, true, kind, true, false)) {
+        current_session().report("Could not write archive: %s\n",
+                                 toString(std::move(err)).c_str());
+        return false;
+    }
+    return true;
+}
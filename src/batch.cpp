@@ -0,0 +1,170 @@
+#include <algorithm>
+
+#include "batch.h"
+#include "pipeline.h"
+#include "runtime_io.h"
+#include "session.h"
+
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+
+// Rows handed to one thread at a time.
+static const size_t batch_chunk_rows = 1 << 16;
+
+static std::string wrapper_name(const std::string& name, unsigned serial) {
+    return name + ".batch." + std::to_string(serial);
+}
+
+// build_wrapper - Emit
+//   void wrapper(double** cols, double* noalias out, i64 begin, i64 end)
+// calling 'f' on one row per iteration.
+static void build_wrapper(Module& m, Function& f, const std::string& name) {
+    LLVMContext& ctx = m.getContext();
+    Type* double_ty = Type::getDoubleTy(ctx);
+    Type* column_ty = double_ty->getPointerTo();
+    Type* index_ty = Type::getInt64Ty(ctx);
+
+    FunctionType* ft = FunctionType::get(
+            Type::getVoidTy(ctx),
+            { column_ty->getPointerTo(), column_ty, index_ty, index_ty }, false);
+    Function* w = Function::Create(ft, Function::ExternalLinkage, name, &m);
+    w->addParamAttr(1, Attribute::NoAlias);
+
+    auto arg = w->arg_begin();
+    Value* cols = &*arg++;
+    Value* out = &*arg++;
+    Value* begin = &*arg++;
+    Value* end = &*arg++;
+
+    BasicBlock* entry_bb = BasicBlock::Create(ctx, "entry", w);
+    BasicBlock* loop_bb = BasicBlock::Create(ctx, "loop", w);
+    BasicBlock* exit_bb = BasicBlock::Create(ctx, "exit", w);
+    IRBuilder<> b(entry_bb);
+
+    // Load the column pointers once, outside the loop.
+    std::vector<Value*> columns;
+    for (uint32_t k = 0, e = f.arg_size(); k != e; ++k)
+        columns.push_back(b.CreateLoad(b.CreateConstGEP1_64(cols, k), "col"));
+    b.CreateCondBr(b.CreateICmpSLT(begin, end), loop_bb, exit_bb);
+
+    b.SetInsertPoint(loop_bb);
+    PHINode* i = b.CreatePHI(index_ty, 2, "i");
+    i->addIncoming(begin, entry_bb);
+
+    std::vector<Value*> args;
+    for (auto* column : columns)
+        args.push_back(b.CreateLoad(b.CreateGEP(column, i), "arg"));
+    Value* result = b.CreateCall(&f, args, "row");
+    b.CreateStore(result, b.CreateGEP(out, i));
+
+    Value* next = b.CreateAdd(i, b.getInt64(1), "next", true, true);
+    i->addIncoming(next, loop_bb);
+    b.CreateCondBr(b.CreateICmpSLT(next, end), loop_bb, exit_bb);
+
+    b.SetInsertPoint(exit_bb);
+    b.CreateRetVoid();
+}
+
+Batch_fn compile_batch(const std::string& name, unsigned& arity) {
+    Session& s = current_session();
+    unsigned serial = s.ir_cache.serial(name);
+    if (!serial)
+        return nullptr;
+
+    auto cached = s.batches.find(name);
+    if (cached != s.batches.end() && cached->second.serial == serial) {
+        arity = cached->second.arity;
+        return cached->second.fn;
+    }
+    // Built from an older definition, nothing else calls it.
+    unload_batch(name);
+
+    // Build in a private context with the host target machine, like tier-1
+    // code: vectorizing is the point of the wrapper.
+    LLVMContext ctx;
+    auto m = s.ir_cache.load(name, ctx);
+    if (!m)
+        return nullptr;
+
+    auto tm = create_host_target_machine();
+    m->setDataLayout(tm->createDataLayout());
+
+    // Columns are doubles, so is every argument and the result.
+    Function* f = m->getFunction(name);
+    if (!f->getReturnType()->isDoubleTy())
+        return nullptr;
+    for (auto& arg : f->args())
+        if (!arg.getType()->isDoubleTy())
+            return nullptr;
+
+    // Make the function a private copy that must disappear into the loop.
+    f->setLinkage(GlobalValue::InternalLinkage);
+    f->addFnAttr(Attribute::AlwaysInline);
+    arity = f->arg_size();
+
+    std::string wrapper = wrapper_name(name, serial);
+    build_wrapper(*m, *f, wrapper);
+    if (s.options.frame_pointers)
+        m->getFunction(wrapper)->addFnAttr("frame-pointer", "all");
+
+    optimize_aggressive(*m, *tm);
+    auto object = compile_object(*m, *tm);
+    if (!object)
+        return nullptr;
+
+    s.the_jit->addObject(std::move(object));
+    auto addr = cantFail(s.the_jit->findSymbol(wrapper).getAddress());
+
+    auto fn = reinterpret_cast<Batch_fn>(static_cast<intptr_t>(addr));
+    s.batches[name] = Compiled_batch{ fn, arity, serial };
+    return fn;
+}
+
+bool batch_eval(const std::string& name, const double* const* cols,
+                unsigned num_cols, double* out, size_t rows,
+                unsigned threads) {
+    unsigned arity;
+    Batch_fn fn = compile_batch(name, arity);
+    if (!fn) {
+        current_session().error("Unknown function referenced.");
+        return false;
+    }
+    if (arity != num_cols) {
+        current_session().error("Incorrect number of columns passed.");
+        return false;
+    }
+
+    size_t chunks = (rows + batch_chunk_rows - 1) / batch_chunk_rows;
+    if (!threads)
+        threads = heavyweight_hardware_concurrency();
+    threads = std::max<size_t>(1, std::min<size_t>(threads, chunks));
+
+    if (threads == 1) {
+        fn(cols, out, 0, rows);
+        flush_runtime_output();
+        return true;
+    }
+
+    // What this thread printed before goes out before what the chunks print.
+    flush_runtime_output();
+    ThreadPool pool(threads);
+    for (size_t c = 0; c != chunks; ++c) {
+        int64_t begin = c * batch_chunk_rows;
+        int64_t end = std::min(rows, (c + 1) * batch_chunk_rows);
+        pool.async([=] {
+            fn(cols, out, begin, end);
+            flush_runtime_output();
+        });
+    }
+    pool.wait();
+    return true;
+}
+
+void unload_batch(const std::string& name) {
+    Session& s = current_session();
+    auto cached = s.batches.find(name);
+    if (cached == s.batches.end())
+        return;
+    s.the_jit->removeSymbol(wrapper_name(name, cached->second.serial));
+    s.batches.erase(cached);
+}
@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <chrono>
+
+#include "build.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+
+namespace {
+
+// File_result - What compiling one input produced.
+struct File_result {
+    bool ok = false;
+    std::string diagnostics;
+    std::string output;
+    double compile_ms = 0;
+    double emit_ms = 0;
+    // The statistics of the file's session, if asked for.
+    std::unique_ptr<Stats> stats;
+};
+
+} // end anonymous namespace
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double, std::milli> d =
+            std::chrono::steady_clock::now() - start;
+    return d.count();
+}
+
+static std::string output_stem(const std::string& path) {
+    SmallString<128> stem(path);
+    sys::path::replace_extension(stem, "");
+    return stem.str().str();
+}
+
+static void compile_file(const std::string& path,
+                         const Session_options& options, File_result& result) {
+    auto buffer = MemoryBuffer::getFile(path);
+    if (!buffer) {
+        result.diagnostics = "Could not open file: " +
+                             buffer.getError().message() + "\n";
+        return;
+    }
+
+    Session_options file_options = options;
+    if (!options.ir_file.empty())
+        file_options.ir_file = output_stem(path) + ".ll";
+    Session session(file_options);
+
+    auto start = std::chrono::steady_clock::now();
+    result.ok = session.compile((*buffer)->getBuffer().str());
+    result.compile_ms = elapsed_ms(start);
+
+    start = std::chrono::steady_clock::now();
+    result.output = session.emit_object_code(output_stem(path));
+    result.emit_ms = elapsed_ms(start);
+
+    result.ok = result.ok && !result.output.empty();
+    result.diagnostics = std::move(session.diagnostics);
+    // The JIT may still report freeing objects to it, results outlive the
+    // session.
+    result.stats = std::move(session.stats);
+}
+
+int compile_files(const std::vector<std::string>& files,
+                  Session_options options, unsigned jobs) {
+    options.interactive = false;
+    options.buffer_diagnostics = true;
+    // Files are the unit of parallelism, each one is lowered on its worker.
+    options.aot.threads = 1;
+
+    if (!jobs)
+        jobs = heavyweight_hardware_concurrency();
+    jobs = std::max<size_t>(1, std::min<size_t>(jobs, files.size()));
+
+    std::vector<File_result> results(files.size());
+    auto start = std::chrono::steady_clock::now();
+    {
+        ThreadPool pool(jobs);
+        for (size_t i = 0, e = files.size(); i != e; ++i)
+            pool.async([&, i] { compile_file(files[i], options, results[i]); });
+        pool.wait();
+    }
+    double wall_ms = elapsed_ms(start);
+
+    // Report in input order, whatever order the workers finished in.
+    unsigned failed = 0;
+    double total_ms = 0;
+    for (size_t i = 0, e = files.size(); i != e; ++i) {
+        const File_result& r = results[i];
+        fputs(r.diagnostics.c_str(), stderr);
+        fprintf(stderr, "%s: %s, compile %.3f ms, emit %.3f ms\n",
+                files[i].c_str(),
+                r.ok ? ("wrote " + r.output).c_str() : "failed",
+                r.compile_ms, r.emit_ms);
+
+        failed += !r.ok;
+        total_ms += r.compile_ms + r.emit_ms;
+    }
+
+    fprintf(stderr, "%zu files, %u failed: %.3f ms wall, %.3f ms summed, "
+                    "%u jobs\n", files.size(), failed, wall_ms, total_ms, jobs);
+
+    // One report for all files, their items labelled with the file.
+    if (options.stats.enabled()) {
+        Stats all;
+        for (size_t i = 0, e = files.size(); i != e; ++i)
+            if (results[i].stats)
+                all.merge(*results[i].stats, files[i] + ": ");
+        all.write(options.stats);
+    }
+    return failed ? 1 : 0;
+}
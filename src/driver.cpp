@@ -1,10 +1,29 @@
 #include <cassert>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
 
+#include "aot.h"
+#include "batch.h"
+#include "bounded_queue.h"
 #include "driver.h"
 #include "lexer.h"
+#include "math_lib.h"
 #include "parser.h"
+#include "pipeline.h"
+#include "runtime_io.h"
+#include "stats.h"
 
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
@@ -15,36 +34,173 @@
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Vectorize.h"
 
 void initialize_module() {
+    Session& s = current_session();
+
     // Open a new module.
-    the_module = std::make_unique<Module>("my jit", the_context);
-    the_module->setDataLayout(the_jit->getTargetMachine().createDataLayout());
+    s.the_module = std::make_unique<Module>("my jit", s.the_context);
+    s.the_module->setDataLayout(s.the_jit->getTargetMachine().createDataLayout());
 
     // Create a new pass manager attached to the module.
-    the_fpm = std::make_unique<legacy::FunctionPassManager>(the_module.get());
+    s.the_fpm = std::make_unique<legacy::FunctionPassManager>(s.the_module.get());
+
+    // Cost models of the loop passes for the JIT's target, and the math
+    // library its vectorized loops may call.
+    TargetMachine& tm = s.the_jit->getTargetMachine();
+    s.the_fpm->add(createTargetTransformInfoWrapperPass(tm.getTargetIRAnalysis()));
+    s.the_fpm->add(new TargetLibraryInfoWrapperPass(*create_library_info(tm)));
 
-    // Promote allocas to registers.
-    the_fpm->add(createPromoteMemoryToRegisterPass());
+    // Promote allocas to registers, splitting those of vector variables whose
+    // lanes are assigned.
+    s.the_fpm->add(createSROAPass());
     // Do simple "peephole" optimizations and bit-twiddling optzns.
-    the_fpm->add(createInstructionCombiningPass());
+    s.the_fpm->add(createInstructionCombiningPass());
     // Reassociate expressions.
-    the_fpm->add(createReassociatePass());
+    s.the_fpm->add(createReassociatePass());
     // CSE.
-    the_fpm->add(createGVNPass());
+    s.the_fpm->add(createGVNPass());
+    // Turn the remaining tail recursion into loops.
+    s.the_fpm->add(createTailCallEliminationPass());
     // Simplify the control flow graph (deleting unreachable blocks, etc).
-    the_fpm->add(createCFGSimplificationPass());
+    s.the_fpm->add(createCFGSimplificationPass());
+    s.the_fpm->doInitialization();
+
+    // Only functions with loops pay for these, see optimize_function: hoist
+    // invariants, canonicalize induction variables, then vectorize and
+    // unroll, honoring the hints of 'for' loops.
+    s.loop_fpm = std::make_unique<legacy::FunctionPassManager>(s.the_module.get());
+    s.loop_fpm->add(createTargetTransformInfoWrapperPass(tm.getTargetIRAnalysis()));
+    s.loop_fpm->add(new TargetLibraryInfoWrapperPass(*create_library_info(tm)));
+    s.loop_fpm->add(createLICMPass());
+    s.loop_fpm->add(createIndVarSimplifyPass());
+    s.loop_fpm->add(createLoopVectorizePass());
+    s.loop_fpm->add(createLoopUnrollPass());
+    // Clean up after them.
+    s.loop_fpm->add(createInstructionCombiningPass());
+    s.loop_fpm->add(createCFGSimplificationPass());
+    s.loop_fpm->doInitialization();
+}
+
+// has_loops - Whether 'f' still has a loop after the function passes.
+static bool has_loops(Function& f) {
+    DominatorTree dt(f);
+    LoopInfo li(dt);
+    return !li.empty();
+}
 
-    the_fpm->doInitialization();
+void optimize_function(Function& f) {
+    Session& s = current_session();
+    s.the_fpm->run(f);
+    if (!s.tier && has_loops(f))
+        s.loop_fpm->run(f);
+}
+
+// require_vector_abi - Give 'f' the features of the wide libmvec variants it
+// calls. The JIT picks them for the host, object emission targets a generic
+// CPU, which would pass their vector arguments in halves.
+static void require_vector_abi(Function& f) {
+    std::string features =
+            f.getFnAttribute("target-features").getValueAsString().str();
+    bool changed = false;
+    for (auto& bb : f)
+        for (auto& inst : bb) {
+            auto* call = dyn_cast<CallInst>(&inst);
+            Function* callee = call ? call->getCalledFunction() : nullptr;
+            if (!callee)
+                continue;
+            StringRef needed = vector_abi_features(callee->getName());
+            if (needed.empty() ||
+                features.find(needed.str()) != std::string::npos)
+                continue;
+            if (!features.empty())
+                features += ",";
+            features += needed.str();
+            changed = true;
+        }
+    if (changed)
+        f.addFnAttr("target-features", features);
+}
+
+// retain_for_aot - Link a copy of the module into the session's aot_module.
+// Later definitions of a function shadow the earlier ones, like in the JIT.
+static void retain_for_aot(const Module& m) {
+    Session& s = current_session();
+    if (!s.aot_module) {
+        s.aot_module = std::make_unique<Module>("aot", s.the_context);
+        s.aot_module->setDataLayout(m.getDataLayout());
+    }
+
+    // Imported copies would override the real definitions, keep them as
+    // declarations.
+    auto copy = CloneModule(m);
+    for (auto& f : *copy)
+        if (f.hasAvailableExternallyLinkage())
+            f.deleteBody();
+        else
+            require_vector_abi(f);
+
+    if (Linker::linkModules(*s.aot_module, std::move(copy),
+                            Linker::Flags::OverrideFromSrc))
+        s.report("Could not record definition for object emission.\n");
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double, std::milli> d =
+            std::chrono::steady_clock::now() - start;
+    return d.count();
+}
+
+// print_read - Show the IR of an item read in interactive mode. It is
+// formatted first, errs() would write it piecemeal.
+static void print_read(const char* what, const Function& f) {
+    SmallString<256> ir;
+    raw_svector_ostream os(ir);
+    f.print(os);
+    fprintf(stderr, "Read %s: %s\n", what, ir.c_str());
+}
+
+// codegen_definition - Generate 'fn_ast' into the current module and keep
+// it for object emission and inlining. Returns the function, null on error.
+static Function* codegen_definition(Function_AST& fn_ast) {
+    Session& s = current_session();
+    Phase_timer timer(Phase::Codegen);
+    auto* fn_ir = fn_ast.codegen();
+    if (!fn_ir)
+        return nullptr;
+
+    if (s.options.interactive)
+        print_read("function definition", *fn_ir);
+    retain_for_aot(*s.the_module);
+    s.ir_cache.retain(*s.the_module, fn_ir->getName());
+    count_instructions(*s.the_module);
+    return fn_ir;
 }
 
 static void handle_definition() {
-    if (auto fn_ast = parse_definition()) {
-        if (auto* fn_ir = fn_ast->codegen()) {
-            fprintf(stderr, "Read function definition: ");
-            fn_ir->print(errs());
-            fprintf(stderr, "\n");
-            the_jit->addModule(std::move(the_module));
+    Session& s = current_session();
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<Function_AST> fn_ast;
+    {
+        Phase_timer timer(Phase::Parse);
+        fn_ast = parse_definition();
+    }
+    if (fn_ast) {
+        label_item("def " + fn_ast->get_name());
+        if (auto* fn_ir = codegen_definition(*fn_ast)) {
+            Phase_timer timer(Phase::Machine_codegen);
+            if (s.tier)
+                s.tier->add_definition(std::move(s.the_module), fn_ir->getName());
+            else if (s.speculator) {
+                // Machine code is generated in the background, the prompt
+                // returns now.
+                s.speculator->add_definition(std::move(s.the_module),
+                                             fn_ir->getName());
+                s.speculator->record_prompt(elapsed_ms(start));
+            } else
+                s.the_jit->addModule(std::move(s.the_module));
             initialize_module();
         }
     } else
@@ -52,51 +208,327 @@ static void handle_definition() {
         get_next_token();
 }
 
+static void codegen_extern(std::unique_ptr<Prototype_AST> proto_ast) {
+    Session& s = current_session();
+    Phase_timer timer(Phase::Codegen);
+    if (auto* fn_ir = proto_ast->codegen()) {
+        if (s.options.interactive)
+            print_read("extern", *fn_ir);
+        s.function_protos[proto_ast->get_name()] = std::move(proto_ast);
+    }
+}
+
 static void handle_extern() {
-    if (auto proto_ast = parse_extern()) {
-        if (auto* fn_ir = proto_ast->codegen()) {
-            fprintf(stderr, "Read extern: ");
-            fn_ir->print(errs());
-            fprintf(stderr, "\n");
-            function_protos[proto_ast->get_name()] = std::move(proto_ast);
-        }
+    std::unique_ptr<Prototype_AST> proto_ast;
+    {
+        Phase_timer timer(Phase::Parse);
+        proto_ast = parse_extern();
+    }
+    if (proto_ast) {
+        label_item("extern " + proto_ast->get_name());
+        codegen_extern(std::move(proto_ast));
     } else
         // Skip token for error recovery.
         get_next_token();
 }
 
+// run_top_level - Run the anonymous expression of the module 'h' in the JIT,
+// then delete the module.
+static void run_top_level(VModuleKey h) {
+    Session& s = current_session();
+    double (*fp)();
+    {
+        Phase_timer timer(Phase::Link);
+        // Search the JIT for the __anon expr symbol.
+        auto expr_symbol = s.the_jit->findSymbol("__anon_expr");
+        assert(expr_symbol && "Function not found.");
+
+        // Get the symbol's address and cast it to the right type (takes no
+        // arguments, returns a double) so we can call it as a native function.
+        fp = (double (*)())(intptr_t)cantFail(expr_symbol.getAddress());
+    }
+
+    double result;
+    {
+        Phase_timer timer(Phase::Execute);
+        result = fp();
+        flush_runtime_output();
+    }
+    if (s.options.interactive)
+        fprintf(stderr, "Evaluated to %f\n", result);
+
+    // Delete the anonymous expression module from the JIT.
+    s.the_jit->removeModule(h);
+}
+
+// codegen_expression - Generate the anonymous function of a top-level
+// expression into the current module.
+static bool codegen_expression(Function_AST& fn_ast) {
+    Phase_timer timer(Phase::Codegen);
+    if (!fn_ast.codegen())
+        return false;
+    count_instructions(*current_session().the_module);
+    return true;
+}
+
 static void handle_top_level_expression() {
+    Session& s = current_session();
     // Evaluate a top-level expression into an anonymous function.
-    if (auto fn_ast = parse_top_level_expr()) {
-        if (fn_ast->codegen()) {
+    std::unique_ptr<Function_AST> fn_ast;
+    {
+        Phase_timer timer(Phase::Parse);
+        fn_ast = parse_top_level_expr();
+    }
+    if (fn_ast) {
+        label_item("expr");
+        if (codegen_expression(*fn_ast)) {
             // JIT the module containing the anonymous expression, keeping a
             // handle so we can free it later.
-            auto h = the_jit->addModule(std::move(the_module));
+            VModuleKey h;
+            {
+                Phase_timer timer(Phase::Machine_codegen);
+                h = s.the_jit->addModule(std::move(s.the_module));
+            }
             initialize_module();
-
-            // Search the JIT for the __anon expr symbol.
-            auto expr_symbol = the_jit->findSymbol("__anon_expr");
-            assert(expr_symbol && "Function not found.");
-
-            // Get the symbol's address and cast it to the right type (takes no
-            // arguments, returns a double) so we can call it as a native
-            // function.
-            double (*fp)() = (double (*)())(intptr_t)cantFail(expr_symbol.getAddress());
-            fprintf(stderr, "Evaluated to %f\n", fp());
-
-            // Delete the anonymous expression module from the JIT.
-            the_jit->removeModule(h);
+            run_top_level(h);
         }
     } else
         // Skip token for error recovery.
         get_next_token();
 }
 
-// top ::= definition | external | expression | ';'
+// scalar_eval - The one call per row baseline for the batch command. It
+// calls the batch loop for one row at a time, which works for any arity; the
+// function is inlined there, so this measures the per-call overhead.
+static void scalar_eval(Batch_fn fn, const std::vector<const double*>& cols,
+                        double* out, size_t rows) {
+    for (size_t i = 0; i != rows; ++i)
+        fn(cols.data(), out, i, i + 1);
+}
+
+// batch ::= 'batch' identifier number
+static bool parse_batch(std::string& name, size_t& rows) {
+    get_next_token(); // Eat 'batch'.
+
+    if (cur_tok != static_cast<int>(Token::TOK_IDENTIFIER)) {
+        current_session().error("Expected function name after 'batch'.");
+        return false;
+    }
+    name = identifier_str;
+    get_next_token(); // Eat the identifier.
+
+    if (cur_tok != static_cast<int>(Token::TOK_NUMBER) || num_val < 1) {
+        current_session().error("Expected row count after function name.");
+        return false;
+    }
+    rows = static_cast<size_t>(num_val);
+    get_next_token(); // Eat the row count.
+    return true;
+}
+
+// run_batch - Evaluate a function over generated columns, once through the
+// batch loop and once through one call per row, and report both timings.
+static void run_batch(const std::string& name, size_t rows) {
+    unsigned arity;
+    Batch_fn fn;
+    {
+        Phase_timer timer(Phase::Machine_codegen);
+        fn = compile_batch(name, arity);
+    }
+    if (!fn) {
+        current_session().error("Unknown function referenced.");
+        return;
+    }
+
+    std::vector<std::vector<double>> columns(arity, std::vector<double>(rows));
+    std::vector<const double*> cols;
+    for (unsigned k = 0; k != arity; ++k) {
+        for (size_t i = 0; i != rows; ++i)
+            columns[k][i] = k + (i % 1000) * 0.001;
+        cols.push_back(columns[k].data());
+    }
+
+    Phase_timer timer(Phase::Execute);
+    std::vector<double> out(rows);
+    auto start = std::chrono::steady_clock::now();
+    batch_eval(name, cols.data(), arity, out.data(), rows);
+    double batch_ms = elapsed_ms(start);
+
+    double sum = 0;
+    for (double v : out)
+        sum += v;
+    fprintf(stderr, "Batch %s over %zu rows: %.3f ms, sum %f\n", name.c_str(),
+            rows, batch_ms, sum);
+
+    start = std::chrono::steady_clock::now();
+    scalar_eval(fn, cols, out.data(), rows);
+    flush_runtime_output();
+    double scalar_ms = elapsed_ms(start);
+    fprintf(stderr, "Scalar calls: %.3f ms (%.1fx)\n", scalar_ms,
+            scalar_ms / batch_ms);
+}
+
+// unload ::= 'unload' (identifier | 'unary' LETTER | 'binary' LETTER)
+static bool parse_unload(std::string& name) {
+    get_next_token(); // Eat 'unload'.
+
+    switch (cur_tok) {
+    case static_cast<int>(Token::TOK_IDENTIFIER):
+        name = identifier_str;
+        break;
+    case static_cast<int>(Token::TOK_UNARY):
+    case static_cast<int>(Token::TOK_BINARY):
+        name = cur_tok == static_cast<int>(Token::TOK_UNARY) ? "unary"
+                                                             : "binary";
+        get_next_token();
+        if (!isascii(cur_tok)) {
+            current_session().error(
+                    ("Expected operator after 'unload " + name + "'.").c_str());
+            return false;
+        }
+        name += static_cast<char>(cur_tok);
+        break;
+    default:
+        current_session().error("Expected function name after 'unload'.");
+        return false;
+    }
+    get_next_token(); // Eat the name.
+
+    // The parser owns the precedences, see parse_definition. A builtin
+    // operator keeps its own.
+    if (name.size() == 7 && name.compare(0, 6, "binary") == 0) {
+        auto defaults = default_binop_precedence();
+        auto builtin = defaults.find(name[6]);
+        if (builtin != defaults.end())
+            current_session().binop_precedence[name[6]] = builtin->second;
+        else
+            current_session().binop_precedence.erase(name[6]);
+    }
+    return true;
+}
+
+// called_by_others - Whether a function other than 'f' uses it.
+static bool called_by_others(Function& f) {
+    for (User* u : f.users()) {
+        auto* inst = dyn_cast<Instruction>(u);
+        if (!inst || inst->getFunction() != &f)
+            return true;
+    }
+    return false;
+}
+
+// unload_definition - Forget the function 'name', or the operator 'name' with
+// its overloads for vector operands. Later code can no longer call it, and
+// the JIT frees its machine code once no code that is still loaded calls it.
+static void unload_definition(const std::string& name) {
+    Session& s = current_session();
+    std::vector<std::string> names;
+    for (auto& proto : s.function_protos)
+        if (proto.first == name ||
+            ((proto.second->is_unary_op() || proto.second->is_binary_op()) &&
+             proto.first.compare(0, name.size() + 1, name + ".") == 0))
+            names.push_back(proto.first);
+    if (names.empty()) {
+        s.error("Unknown function referenced.");
+        return;
+    }
+
+    // Object files link every definition together, one that others still
+    // call cannot go.
+    if (s.aot_module)
+        for (auto& n : names) {
+            Function* f = s.aot_module->getFunction(n);
+            if (f && !f->isDeclaration() && called_by_others(*f)) {
+                s.error(("Cannot unload " + n + ", other definitions for " +
+                         "the object file call it.").c_str());
+                return;
+            }
+        }
+
+    for (auto& n : names) {
+        bool external = s.function_protos[n]->is_external();
+        s.function_protos.erase(n);
+        s.operator_bodies.erase(n);
+        s.ir_cache.forget(n);
+        unload_batch(n);
+        // Tiered definitions are called through a stub, which keeps their
+        // code until 'n' is defined again.
+        if (s.tier)
+            s.tier->remove_definition(n);
+        else if (!external)
+            s.the_jit->removeSymbol(n);
+
+        if (s.aot_module)
+            if (Function* f = s.aot_module->getFunction(n)) {
+                f->deleteBody();
+                if (f->use_empty())
+                    f->eraseFromParent();
+            }
+    }
+
+    if (s.options.interactive)
+        fprintf(stderr, "Unloaded %s, JIT: %zu modules in %zu KiB\n",
+                name.c_str(), s.the_jit->getNumModules(),
+                s.the_jit->getMappedBytes() / 1024);
+}
+
+static void handle_unload() {
+    std::string name;
+    bool parsed;
+    {
+        Phase_timer timer(Phase::Parse);
+        parsed = parse_unload(name);
+    }
+    if (parsed) {
+        label_item("unload " + name);
+        unload_definition(name);
+    }
+}
+
+// record_item - Keep the statistics of a finished item, with the memory the
+// JIT holds after it.
+static void record_item(Item_stats& item) {
+    Session& s = current_session();
+    item.jit_resident_bytes = s.the_jit->getMappedBytes();
+    s.stats->record(item);
+}
+
+static void handle_batch() {
+    std::string name;
+    size_t rows;
+    bool parsed;
+    {
+        Phase_timer timer(Phase::Parse);
+        parsed = parse_batch(name, rows);
+    }
+    if (parsed) {
+        label_item("batch " + name);
+        run_batch(name, rows);
+    }
+}
+
+// top_level_token - cur_tok, or TOK_BATCH or TOK_UNLOAD for a command. The
+// commands are identifiers followed by a name, so functions can still be
+// called 'batch' or 'unload'.
+static int top_level_token() {
+    if (cur_tok == static_cast<int>(Token::TOK_IDENTIFIER) &&
+        (identifier_str == "batch" || identifier_str == "unload") &&
+        next_is_identifier())
+        return static_cast<int>(identifier_str == "batch" ? Token::TOK_BATCH
+                                                          : Token::TOK_UNLOAD);
+    return cur_tok;
+}
+
+// top ::= definition | external | expression | batch | unload | ';'
 void main_loop() {
+    Session& s = current_session();
+    bool interactive = s.options.interactive;
     while (true) {
-        fprintf(stderr, "ready> ");
-        switch (cur_tok) {
+        if (interactive)
+            fprintf(stderr, "ready> ");
+        Item_stats item;
+        Item_scope item_scope(s.stats ? &item : nullptr);
+        switch (top_level_token()) {
         case static_cast<int>(Token::TOK_EOF):
             return;
         case ';': // Ignore top-level semicolons.
@@ -108,30 +540,280 @@ void main_loop() {
         case static_cast<int>(Token::TOK_EXTERN):
             handle_extern();
             break;
+        case static_cast<int>(Token::TOK_BATCH):
+            handle_batch();
+            break;
+        case static_cast<int>(Token::TOK_UNLOAD):
+            handle_unload();
+            break;
         default:
             handle_top_level_expression();
             break;
         }
+        // Semicolons and items that did not parse are not reported.
+        if (s.stats && !item.label.empty())
+            record_item(item);
+    }
+}
+
+namespace {
+
+// Parsed_item - A top-level item on its way from the parser to codegen.
+struct Parsed_item {
+    // TOK_DEF, TOK_EXTERN, TOK_BATCH, TOK_UNLOAD or 0 for an expression.
+    int kind = 0;
+    std::unique_ptr<Function_AST> function;
+    std::unique_ptr<Prototype_AST> proto;
+    // The function named by a batch or unload command.
+    std::string command_name;
+    size_t batch_rows = 0;
+    Item_stats stats;
+};
+
+// Compiled_item - A module on its way from codegen to the backend. It travels
+// as bitcode, so the backend can compile it in a context of its own while
+// codegen goes on in the session's.
+struct Compiled_item {
+    SmallString<0> bitcode;
+    bool is_expression = false;
+    // Recorded once the backend is done with the item.
+    Item_stats stats;
+    // A barrier instead of a module: fulfilled once the backend has added
+    // everything before it to the JIT.
+    std::shared_ptr<std::promise<void>> barrier;
+};
+
+} // end anonymous namespace
+
+// parse_stage - Parse items into 'out' until the end of the input.
+static void parse_stage(Session& s, const std::function<void()>& prime,
+                        Bounded_queue<Parsed_item>& out) {
+    Session_scope scope(s);
+    prime();
+    while (true) {
+        if (s.options.interactive)
+            fprintf(stderr, "ready> ");
+
+        Parsed_item item;
+        Item_scope item_scope(s.stats ? &item.stats : nullptr);
+        {
+            Phase_timer timer(Phase::Parse);
+            item.kind = top_level_token();
+            switch (item.kind) {
+            case static_cast<int>(Token::TOK_EOF):
+                out.close();
+                return;
+            case ';': // Ignore top-level semicolons.
+                get_next_token();
+                continue;
+            case static_cast<int>(Token::TOK_DEF):
+                item.function = parse_definition();
+                if (!item.function) {
+                    // Skip token for error recovery.
+                    get_next_token();
+                    continue;
+                }
+                item.stats.label = "def " + item.function->get_name();
+                break;
+            case static_cast<int>(Token::TOK_EXTERN):
+                item.proto = parse_extern();
+                if (!item.proto) {
+                    get_next_token();
+                    continue;
+                }
+                item.stats.label = "extern " + item.proto->get_name();
+                break;
+            case static_cast<int>(Token::TOK_BATCH):
+                if (!parse_batch(item.command_name, item.batch_rows))
+                    continue;
+                item.stats.label = "batch " + item.command_name;
+                break;
+            case static_cast<int>(Token::TOK_UNLOAD):
+                if (!parse_unload(item.command_name))
+                    continue;
+                item.stats.label = "unload " + item.command_name;
+                break;
+            default:
+                item.kind = 0;
+                item.function = parse_top_level_expr();
+                if (!item.function) {
+                    get_next_token();
+                    continue;
+                }
+                item.stats.label = "expr";
+                break;
+            }
+        }
+        out.push(std::move(item));
+    }
+}
+
+// backend_stage - Compile the modules from 'in' to machine code, add them to
+// the JIT and run the top-level expressions, in order.
+static void backend_stage(Session& s, Bounded_queue<Compiled_item>& in) {
+    Session_scope scope(s);
+    auto tm = create_host_target_machine();
+
+    Compiled_item item;
+    while (in.pop(item)) {
+        if (item.barrier) {
+            item.barrier->set_value();
+            continue;
+        }
+
+        Item_scope item_scope(s.stats ? &item.stats : nullptr);
+        std::unique_ptr<MemoryBuffer> object;
+        {
+            Phase_timer timer(Phase::Machine_codegen);
+            LLVMContext ctx;
+            auto m = parseBitcodeFile(
+                    MemoryBufferRef(item.bitcode, "pipeline"), ctx);
+            if (!m) {
+                logAllUnhandledErrors(m.takeError(), errs(), "pipeline: ");
+                continue;
+            }
+            (*m)->setDataLayout(tm->createDataLayout());
+            object = compile_object(**m, *tm);
+        }
+        if (!object)
+            continue;
+
+        VModuleKey h;
+        {
+            Phase_timer timer(Phase::Link);
+            h = s.the_jit->addObject(std::move(object));
+        }
+        if (item.is_expression)
+            run_top_level(h);
+        if (s.stats)
+            record_item(item.stats);
+    }
+}
+
+// send_module - Pass the current module on to the backend and start a new
+// one.
+static void send_module(Bounded_queue<Compiled_item>& out,
+                        bool is_expression, const Item_stats& stats) {
+    Session& s = current_session();
+    Compiled_item item;
+    item.is_expression = is_expression;
+    item.stats = stats;
+    raw_svector_ostream os(item.bitcode);
+    WriteBitcodeToFile(*s.the_module, os);
+    out.push(std::move(item));
+    initialize_module();
+}
+
+// drain - Wait until the backend has added every module sent so far to the
+// JIT.
+static void drain(Bounded_queue<Compiled_item>& out) {
+    Compiled_item item;
+    item.barrier = std::make_shared<std::promise<void>>();
+    auto done = item.barrier->get_future();
+    out.push(std::move(item));
+    done.wait();
+}
+
+void pipelined_loop(const std::function<void()>& prime) {
+    Session& s = current_session();
+    Bounded_queue<Parsed_item> parsed(s.options.pipeline_depth);
+    Bounded_queue<Compiled_item> compiled(s.options.pipeline_depth);
+
+    std::thread parser(parse_stage, std::ref(s), std::cref(prime),
+                       std::ref(parsed));
+    std::thread backend(backend_stage, std::ref(s), std::ref(compiled));
+
+    // Code generation stays on this thread, it owns the session's context.
+    Parsed_item item;
+    while (parsed.pop(item)) {
+        Item_scope item_scope(s.stats ? &item.stats : nullptr);
+        // Whether the backend records the item.
+        bool sent = false;
+        switch (item.kind) {
+        case static_cast<int>(Token::TOK_DEF):
+            if (auto* fn_ir = codegen_definition(*item.function)) {
+                if (s.tier) {
+                    // The tier-0 build is linked right away, against the
+                    // definitions still in the backend.
+                    drain(compiled);
+                    Phase_timer timer(Phase::Machine_codegen);
+                    s.tier->add_definition(std::move(s.the_module),
+                                           fn_ir->getName());
+                    initialize_module();
+                } else {
+                    send_module(compiled, false, item.stats);
+                    sent = true;
+                }
+            }
+            break;
+        case static_cast<int>(Token::TOK_EXTERN):
+            codegen_extern(std::move(item.proto));
+            break;
+        case static_cast<int>(Token::TOK_BATCH):
+            drain(compiled);
+            run_batch(item.command_name, item.batch_rows);
+            break;
+        case static_cast<int>(Token::TOK_UNLOAD):
+            drain(compiled);
+            unload_definition(item.command_name);
+            break;
+        default:
+            if (codegen_expression(*item.function)) {
+                send_module(compiled, true, item.stats);
+                sent = true;
+            }
+            break;
+        }
+        if (s.stats && !sent)
+            record_item(item.stats);
     }
+
+    compiled.close();
+    backend.join();
+    parser.join();
 }
 
-void emit_object_code() {
+static std::once_flag all_targets_once;
+
+// write_ir - Print 'm' to 'filename' as text.
+static bool write_ir(const Module& m, const std::string& filename) {
+    std::error_code ec;
+    raw_fd_ostream os(filename, ec, sys::fs::OF_Text);
+    if (!ec) {
+        m.print(os, nullptr);
+        os.close();
+        ec = os.error();
+    }
+    if (ec)
+        current_session().report("Could not write %s: %s\n", filename.c_str(),
+                                 ec.message().c_str());
+    return !ec;
+}
+
+std::string emit_object_code(const std::string& stem) {
+    Session& s = current_session();
+
     // Initialize the target registry etc.
-    InitializeAllTargetInfos();
-    InitializeAllTargets();
-    InitializeAllTargetMCs();
-    InitializeAllAsmParsers();
-    InitializeAllAsmPrinters();
+    std::call_once(all_targets_once, [] {
+        InitializeAllTargetInfos();
+        InitializeAllTargets();
+        InitializeAllTargetMCs();
+        InitializeAllAsmParsers();
+        InitializeAllAsmPrinters();
+    });
+
+    if (!s.aot_module)
+        s.aot_module = std::make_unique<Module>("aot", s.the_context);
 
     auto target_triple = sys::getDefaultTargetTriple();
-    the_module->setTargetTriple(target_triple);
+    s.aot_module->setTargetTriple(target_triple);
 
     std::string error;
     auto target = TargetRegistry::lookupTarget(target_triple, error);
 
     if (!target) {
-        errs() << error;
-        return;
+        s.report("%s\n", error.c_str());
+        return "";
     }
 
     auto cpu = "generic";
@@ -139,32 +821,22 @@ void emit_object_code() {
 
     TargetOptions opt;
     auto rm = Optional<Reloc::Model>();
-    auto the_target_machine =
-            target->createTargetMachine(target_triple, cpu, features, opt, rm);
 
-    the_module->setDataLayout(the_target_machine->createDataLayout());
-
-    auto filename = "output.o";
-    std::error_code ec;
-    raw_fd_ostream dest(filename, ec, sys::fs::OF_None);
-
-    if (ec) {
-        errs() << "Could not open file: " << ec.message();
-        return;
-    }
-
-    legacy::PassManager pass;
-    auto file_type = LLVMTargetMachine::CGFT_ObjectFile;
-
-    if (the_target_machine->addPassesToEmitFile(pass, dest, nullptr, file_type)) {
-        errs() << "Can't emit this type of file.";
-        return;
-    }
+    // Each codegen thread needs a target machine of its own.
+    auto create_tm = [&]() {
+        return std::unique_ptr<TargetMachine>(
+                target->createTargetMachine(target_triple, cpu, features, opt,
+                                            rm));
+    };
 
-    pass.run(*the_module);
-    dest.flush();
+    s.aot_module->setDataLayout(create_tm()->createDataLayout());
 
-    outs() << "Wrote " << filename << "\n";
+    if (!s.options.ir_file.empty() && !write_ir(*s.aot_module, s.options.ir_file))
+        return "";
 
-    return;
+    std::string filename;
+    if (!emit_partitioned(std::move(s.aot_module), create_tm, stem,
+                          s.options.aot, filename))
+        return "";
+    return filename;
 }
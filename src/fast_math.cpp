@@ -0,0 +1,47 @@
+#include "fast_math.h"
+
+bool add_fast_math_flag(const std::string& name, FastMathFlags& fmf) {
+    if (name == "fast")
+        fmf.setFast();
+    else if (name == "reassoc")
+        fmf.setAllowReassoc();
+    else if (name == "nnan")
+        fmf.setNoNaNs();
+    else if (name == "ninf")
+        fmf.setNoInfs();
+    else if (name == "nsz")
+        fmf.setNoSignedZeros();
+    else if (name == "arcp")
+        fmf.setAllowReciprocal();
+    else if (name == "contract")
+        fmf.setAllowContract(true);
+    else if (name == "afn")
+        fmf.setApproxFunc();
+    else
+        return false;
+    return true;
+}
+
+bool parse_fast_math(const std::string& spec, FastMathFlags& fmf) {
+    size_t begin = 0;
+    while (begin <= spec.size()) {
+        size_t end = spec.find(',', begin);
+        if (end == std::string::npos)
+            end = spec.size();
+        if (!add_fast_math_flag(spec.substr(begin, end - begin), fmf))
+            return false;
+        begin = end + 1;
+    }
+    return true;
+}
+
+void set_fast_math_attributes(Function& f, FastMathFlags fmf) {
+    if (fmf.isFast())
+        f.addFnAttr("unsafe-fp-math", "true");
+    if (fmf.noNaNs())
+        f.addFnAttr("no-nans-fp-math", "true");
+    if (fmf.noInfs())
+        f.addFnAttr("no-infs-fp-math", "true");
+    if (fmf.noSignedZeros())
+        f.addFnAttr("no-signed-zeros-fp-math", "true");
+}
@@ -0,0 +1,184 @@
+#include <cstdio>
+#include <vector>
+
+#include "generator.h"
+
+// Operator - A user defined operator of the tutorial.
+struct Operator {
+    const char* name;
+    bool binary;
+    const char* definition;
+};
+
+static const Operator operator_pool[] = {
+    {":", true, "def binary : 1 (x y) y;"},
+    {"|", true, "def binary| 5 (l r) if l then 1 else if r then 1 else 0;"},
+    {">", true, "def binary> 10 (l r) r < l;"},
+    {"&", true, "def binary& 6 (l r) if l then (if r then 1 else 0) else 0;"},
+    {"!", false, "def unary!(v) if v then 0 else 1;"},
+    {"~", false, "def unary~(v) 0 - v;"},
+};
+
+static const unsigned pool_size = sizeof(operator_pool) / sizeof(Operator);
+
+static unsigned num_operators(const Generator_options& options) {
+    return options.operators < pool_size ? options.operators : pool_size;
+}
+
+// Program_generator - Writes one program. Randomness comes from splitmix64
+// rather than <random>, whose distributions differ between libraries.
+class Program_generator {
+public:
+    explicit Program_generator(const Generator_options& options)
+        : options(options), state(options.seed) {
+        for (unsigned k = 0; k != num_operators(options); ++k) {
+            const Operator& op = operator_pool[k];
+            (op.binary ? binary_ops : unary_ops).push_back(op.name);
+        }
+        sequence = num_operators(options) > 0;
+    }
+
+    std::string definition(unsigned index);
+
+private:
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+    unsigned below(unsigned n) { return n ? next() % n : 0; }
+    bool chance(double p) { return (next() >> 11) / 9007199254740992.0 < p; }
+
+    std::string expression(unsigned depth, unsigned loops);
+    std::string operand(unsigned depth, unsigned loops);
+    std::string chain(unsigned depth, unsigned loops);
+    std::string loop(unsigned depth, unsigned loops);
+    std::string var(unsigned depth, unsigned loops);
+    std::string leaf(bool calls);
+    std::string fresh(const char* prefix);
+
+    const Generator_options& options;
+    uint64_t state;
+    std::vector<const char*> binary_ops;
+    std::vector<const char*> unary_ops;
+    bool sequence; // ':' is defined
+    // The definition being written and the names visible in it.
+    unsigned function = 0;
+    std::vector<std::string> scope;
+    unsigned names = 0;
+};
+
+std::string Program_generator::definition(unsigned index) {
+    function = index;
+    scope = {"x", "y"};
+    names = 0;
+    return "def f" + std::to_string(index) + "(x y)\n  " +
+           expression(options.depth, 0) + ";\n";
+}
+
+std::string Program_generator::fresh(const char* prefix) {
+    return prefix + std::to_string(names++);
+}
+
+// leaf - A number, a visible name or, if 'calls', maybe a call to an earlier
+// definition with leaves for arguments.
+std::string Program_generator::leaf(bool calls) {
+    if (calls && function && chance(options.call_density))
+        return "f" + std::to_string(below(function)) + "(" + leaf(false) +
+               ", " + leaf(false) + ")";
+    if (chance(0.3))
+        return std::to_string(below(100)) + (chance(0.5) ? ".5" : "");
+    return scope[below(scope.size())];
+}
+
+std::string Program_generator::expression(unsigned depth, unsigned loops) {
+    if (!depth)
+        return leaf(true);
+
+    bool can_loop = loops < options.loop_nesting;
+    unsigned pick = below(10);
+    if (pick < 5)
+        return chain(depth, loops);
+    if (pick < 6)
+        return "if " + operand(depth - 1, loops) + " then " +
+               operand(depth - 1, loops) + " else " + operand(depth - 1, loops);
+    if (pick < 7 && !unary_ops.empty())
+        return unary_ops[below(unary_ops.size())] + operand(depth - 1, loops);
+    if (pick < 8 && can_loop)
+        return loop(depth, loops);
+    if (pick < 9 && can_loop)
+        return var(depth, loops);
+    return chain(depth, loops);
+}
+
+// operand - An expression that can stand next to any operator.
+std::string Program_generator::operand(unsigned depth, unsigned loops) {
+    if (!depth)
+        return leaf(true);
+    return "(" + expression(depth, loops) + ")";
+}
+
+std::string Program_generator::chain(unsigned depth, unsigned loops) {
+    static const char* builtin_ops[] = {"+", "-", "*", "<"};
+    std::string s = operand(depth - 1, loops);
+    for (unsigned k = 1; k < options.width; ++k) {
+        unsigned op = below(4 + binary_ops.size());
+        s += " ";
+        s += op < 4 ? builtin_ops[op] : binary_ops[op - 4];
+        s += " " + operand(depth - 1, loops);
+    }
+    return s;
+}
+
+// loop - A short 'for', summing its body when ':' can return the sum.
+std::string Program_generator::loop(unsigned depth, unsigned loops) {
+    std::string i = fresh("i");
+    std::string head = "for " + i + " = 0, " + i + " < " +
+                       std::to_string(1 + below(4)) + " in ";
+    scope.push_back(i);
+    std::string s;
+    if (sequence) {
+        std::string sum = fresh("s");
+        scope.push_back(sum);
+        s = "var " + sum + " = 0 in (" + head + sum + " = " + sum + " + " +
+            operand(depth - 1, loops + 1) + ") : " + sum;
+        scope.pop_back();
+    } else
+        s = head + operand(depth - 1, loops + 1);
+    scope.pop_back();
+    return s;
+}
+
+std::string Program_generator::var(unsigned depth, unsigned loops) {
+    std::string v = fresh("v");
+    std::string init = operand(depth - 1, loops);
+    scope.push_back(v);
+    std::string s = "var " + v + " = " + init + " in " +
+                    operand(depth - 1, loops + 1);
+    scope.pop_back();
+    return s;
+}
+
+std::string generate_operators(const Generator_options& options) {
+    std::string s;
+    for (unsigned k = 0; k != num_operators(options); ++k)
+        s += std::string(operator_pool[k].definition) + "\n";
+    return s;
+}
+
+std::string generate_program(const Generator_options& options) {
+    char header[256];
+    snprintf(header, sizeof(header),
+             "# kaleidoscope_gen --functions=%u --depth=%u --width=%u "
+             "--call-density=%g --loop-nesting=%u --operators=%u --seed=%llu\n",
+             options.functions, options.depth, options.width,
+             options.call_density, options.loop_nesting, options.operators,
+             (unsigned long long)options.seed);
+
+    std::string s = header + generate_operators(options);
+    Program_generator gen(options);
+    for (unsigned k = 0; k != options.functions; ++k)
+        s += gen.definition(k);
+    return s;
+}
@@ -0,0 +1,70 @@
+#include <vector>
+
+#include "inliner.h"
+#include "session.h"
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+// import_definition - Turn the declaration of 'name' in 'm' into an
+// available_externally copy of its retained definition. Returns false if it
+// is unknown or over the inlining budget.
+static bool import_definition(Module& m, const std::string& name) {
+    Session& s = current_session();
+    unsigned size = s.ir_cache.size(name);
+    if (!size || size > s.options.inlining.budget)
+        return false;
+
+    auto src = s.ir_cache.load(name, m.getContext());
+    if (!src)
+        return false;
+
+    // Bring over the definition only, not the copies that were imported into
+    // its own module.
+    for (auto& f : *src)
+        if (f.getName() != name && !f.isDeclaration())
+            f.deleteBody();
+
+    if (Linker::linkModules(m, std::move(src)))
+        return false;
+
+    Function* f = m.getFunction(name);
+    if (!f || f->isDeclaration())
+        return false;
+    f->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    return true;
+}
+
+void inline_callees(Function& f) {
+    Session& s = current_session();
+    if (!s.options.inlining.budget)
+        return;
+
+    // Collect the call sites first, inlining changes the blocks.
+    std::vector<CallInst*> calls;
+    for (auto& bb : f)
+        for (auto& inst : bb)
+            if (auto* call = dyn_cast<CallInst>(&inst)) {
+                Function* callee = call->getCalledFunction();
+                if (callee && callee != &f && !callee->isIntrinsic())
+                    calls.push_back(call);
+            }
+
+    // One level is enough: retained definitions already had their own small
+    // callees inlined when they were compiled.
+    Module& m = *f.getParent();
+    for (CallInst* call : calls) {
+        if (call->getCalledFunction()->isDeclaration() &&
+            !import_definition(m, call->getCalledFunction()->getName()))
+            continue;
+
+        // Linking replaces the declaration, look the callee up again.
+        Function* callee = call->getCalledFunction();
+        if (!callee || !callee->hasAvailableExternallyLinkage())
+            continue;
+
+        InlineFunctionInfo ifi;
+        InlineFunction(call, ifi);
+    }
+}
@@ -0,0 +1,65 @@
+#include "ir_cache.h"
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/raw_ostream.h"
+
+void Ir_cache::retain(const Module& m, const std::string& name) {
+    Definition def;
+    raw_svector_ostream os(def.bitcode);
+    WriteBitcodeToFile(m, os);
+    const Function* f = m.getFunction(name);
+    def.size = f ? f->getInstructionCount() : 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    def.serial = next_serial++;
+    auto& slot = definitions[name];
+    total_bytes += def.bitcode.size() - slot.bitcode.size();
+    slot = std::move(def);
+
+    // Drop the oldest definitions until under the cap.
+    while (total_bytes > max_bytes && !definitions.empty()) {
+        auto oldest = definitions.begin();
+        for (auto it = definitions.begin(); it != definitions.end(); ++it)
+            if (it->second.serial < oldest->second.serial)
+                oldest = it;
+        total_bytes -= oldest->second.bitcode.size();
+        definitions.erase(oldest);
+    }
+}
+
+void Ir_cache::forget(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = definitions.find(name);
+    if (it == definitions.end())
+        return;
+    total_bytes -= it->second.bitcode.size();
+    definitions.erase(it);
+}
+
+unsigned Ir_cache::serial(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = definitions.find(name);
+    return it == definitions.end() ? 0 : it->second.serial;
+}
+
+unsigned Ir_cache::size(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = definitions.find(name);
+    return it == definitions.end() ? 0 : it->second.size;
+}
+
+std::unique_ptr<Module> Ir_cache::load(const std::string& name,
+                                       LLVMContext& ctx) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = definitions.find(name);
+    if (it == definitions.end())
+        return nullptr;
+
+    auto m = parseBitcodeFile(MemoryBufferRef(it->second.bitcode, name), ctx);
+    if (!m) {
+        logAllUnhandledErrors(m.takeError(), errs(), "ir_cache: ");
+        return nullptr;
+    }
+    return std::move(*m);
+}
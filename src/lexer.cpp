@@ -4,20 +4,49 @@
 
 #include "lexer.h"
 
-std::string identifier_str;
-double num_val;
+thread_local std::string identifier_str;
+thread_local double num_val;
 
-// Return the next token from standard input.
-int gettok() {
-    static int last_char = ' ';
+static thread_local int last_char = ' ';
+// Input buffer, unused while lexing standard input.
+static thread_local bool from_stdin = true;
+static thread_local const char* source_pos;
+static thread_local const char* source_end;
+
+void set_lexer_source(const char* begin, const char* end) {
+    from_stdin = false;
+    source_pos = begin;
+    source_end = end;
+    last_char = ' ';
+}
 
+void set_lexer_stdin() {
+    from_stdin = true;
+    last_char = ' ';
+}
+
+static int next_char() {
+    if (from_stdin)
+        return getchar();
+    return source_pos != source_end ? static_cast<unsigned char>(*source_pos++)
+                                    : EOF;
+}
+
+bool next_is_identifier() {
+    while (isspace(last_char))
+        last_char = next_char();
+    return isalpha(last_char);
+}
+
+// Return the next token from the current input.
+int gettok() {
     // Skip any whitespace.
     while (isspace(last_char))
-        last_char = getchar();
+        last_char = next_char();
 
     if (isalpha(last_char)) {
         identifier_str = last_char;
-        while (isalnum((last_char = getchar())))
+        while (isalnum((last_char = next_char())))
             identifier_str += last_char;
 
         if (identifier_str == "def")
@@ -40,6 +69,8 @@ int gettok() {
             return static_cast<int>(Token::TOK_UNARY);
         if (identifier_str == "var")
             return static_cast<int>(Token::TOK_VAR);
+        if (identifier_str == "parfor")
+            return static_cast<int>(Token::TOK_PARFOR);
         return static_cast<int>(Token::TOK_IDENTIFIER);
     }
 
@@ -47,7 +78,7 @@ int gettok() {
         std::string num_str;
         do {
             num_str += last_char;
-            last_char = getchar();
+            last_char = next_char();
         } while (isdigit(last_char) || last_char == '.');
 
         num_val = strtod(num_str.c_str(), 0);
@@ -57,7 +88,7 @@ int gettok() {
     if (last_char == '#') {
         // Comment until EOL.
         do
-            last_char = getchar();
+            last_char = next_char();
         while (last_char != EOF && last_char != '\n' && last_char != '\r');
 
         if (last_char != EOF)
@@ -70,6 +101,6 @@ int gettok() {
 
     // Otherwise, just return the character as its ascii value.
     int this_char = last_char;
-    last_char = getchar();
+    last_char = next_char();
     return this_char;
 }
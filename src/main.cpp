@@ -1,27 +1,159 @@
-#include "driver.h"
-#include "lexer.h"
-#include "parser.h"
+#include <cstdlib>
+#include <cstring>
 
-#include "llvm/Support/TargetSelect.h"
-#include "llvm/Target/TargetMachine.h"
+#include "build.h"
+#include "fast_math.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "runtime_io.h"
+#include "session.h"
 
-int main() {
-    InitializeNativeTarget();
-    InitializeNativeTargetAsmPrinter();
-    InitializeNativeTargetAsmParser();
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
 
-    // Prime the first token.
-    fprintf(stderr, "ready> ");
-    get_next_token();
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-q] [--emit-ir[=<file>]] [-j<threads>] "
+                    "[--partitions=<n>] [--tier] "
+                    "[--tier-threshold=<n>] [--inline-budget=<n>] "
+                    "[--fast-math[=<flag>,...]] [--parfor-threads=<n>] "
+                    "[--pipeline[=<depth>]] [--speculate[=<threads>]] "
+                    "[--program-output=<file>] "
+                    "[--perf-map] [--jitdump[=<dir>]] [--stats] "
+                    "[--stats-json=<file>] [--stats-csv=<file>] "
+                    "[--profile[=<hz>]] [--profile-folded=<file>] [file...]\n",
+            argv0);
+}
+
+// parse_args - Read the command line options, returns false on bad usage.
+static bool parse_args(int argc, char** argv, Session_options& options,
+                       Profile_options& profile,
+                       std::vector<std::string>& files) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+
+        if (!strcmp(arg, "-q") || !strcmp(arg, "--quiet")) {
+            options.interactive = false;
+            options.buffer_diagnostics = true;
+        }
+        else if (!strcmp(arg, "--emit-ir"))
+            options.ir_file = "output.ll";
+        else if (!strncmp(arg, "--emit-ir=", 10))
+            options.ir_file = arg + 10;
+        else if (!strncmp(arg, "-j", 2) && arg[2])
+            options.aot.threads = strtoul(arg + 2, nullptr, 10);
+        else if (!strncmp(arg, "--partitions=", 13))
+            options.aot.partitions = strtoul(arg + 13, nullptr, 10);
+        else if (!strcmp(arg, "--tier"))
+            options.tier.enabled = true;
+        else if (!strncmp(arg, "--tier-threshold=", 17))
+            options.tier.threshold = strtoull(arg + 17, nullptr, 10);
+        else if (!strncmp(arg, "--inline-budget=", 16))
+            options.inlining.budget = strtoul(arg + 16, nullptr, 10);
+        else if (!strcmp(arg, "--fast-math"))
+            options.fast_math.setFast();
+        else if (!strncmp(arg, "--fast-math=", 12)) {
+            if (!parse_fast_math(arg + 12, options.fast_math))
+                return false;
+        }
+        else if (!strcmp(arg, "--pipeline"))
+            options.pipeline_depth = 16;
+        else if (!strncmp(arg, "--pipeline=", 11))
+            options.pipeline_depth = strtoul(arg + 11, nullptr, 10);
+        else if (!strcmp(arg, "--speculate"))
+            options.speculate_threads = 2;
+        else if (!strncmp(arg, "--speculate=", 12))
+            options.speculate_threads = strtoul(arg + 12, nullptr, 10);
+        else if (!strcmp(arg, "--perf-map"))
+            options.perf.map = true;
+        else if (!strcmp(arg, "--jitdump"))
+            options.perf.jitdump = true;
+        else if (!strncmp(arg, "--jitdump=", 10)) {
+            options.perf.jitdump = true;
+            options.perf.dir = arg + 10;
+        }
+        else if (!strcmp(arg, "--stats"))
+            options.stats.summary = true;
+        else if (!strncmp(arg, "--stats-json=", 13))
+            options.stats.json_file = arg + 13;
+        else if (!strncmp(arg, "--stats-csv=", 12))
+            options.stats.csv_file = arg + 12;
+        else if (!strcmp(arg, "--profile"))
+            profile.enabled = true;
+        else if (!strncmp(arg, "--profile=", 10)) {
+            profile.enabled = true;
+            profile.frequency = strtoul(arg + 10, nullptr, 10);
+        }
+        else if (!strncmp(arg, "--profile-folded=", 17)) {
+            profile.enabled = true;
+            profile.folded_file = arg + 17;
+        }
+        else if (!strncmp(arg, "--parfor-threads=", 17))
+            set_parfor_threads(strtoul(arg + 17, nullptr, 10));
+        else if (!strncmp(arg, "--program-output=", 17)) {
+            if (!set_runtime_output(arg + 17)) {
+                fprintf(stderr, "Could not write %s\n", arg + 17);
+                return false;
+            }
+        }
+        else if (arg[0] != '-')
+            files.push_back(arg);
+        else
+            return false;
+    }
+    return true;
+}
 
-    the_jit = std::make_unique<KaleidoscopeJIT>();
-    initialize_module();
+// run_repl - The interpreter loop, then object emission of its definitions.
+static int run_repl(const Session_options& options) {
+    Session session(options);
 
     // Run the interpreter loop.
-    main_loop();
+    session.repl();
+    if (session.speculator)
+        session.speculator->print_stats();
+    if (session.stats)
+        session.stats->write(options.stats);
 
     // Emit the object code
-    emit_object_code();
+    auto filename = session.emit_object_code("output");
+    if (!filename.empty() && options.interactive)
+        outs() << "Wrote " << filename << "\n";
+
+    // Quiet runs held their diagnostics back until now, and fail on them.
+    fputs(session.diagnostics.c_str(), stderr);
+    return !options.interactive && session.errors ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    Session_options options;
+    options.interactive = true;
+    Profile_options profile;
+    std::vector<std::string> files;
+
+    if (!parse_args(argc, argv, options, profile, files)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // The pass managers time every pass into one table for the process, so
+    // it is switched on here rather than by each session.
+    TimePassesIsEnabled = options.stats.enabled();
+
+    // Samples of JIT-ed code are only attributed to its callers through its
+    // frame pointers.
+    if (profile.enabled) {
+        options.frame_pointers = true;
+        start_profiler(profile);
+    }
+
+    // With input files, compile them all concurrently. -j then counts files
+    // in flight rather than codegen threads.
+    int status;
+    if (!files.empty())
+        status = compile_files(files, options, options.aot.threads);
+    else
+        status = run_repl(options);
 
-    return 0;
+    stop_profiler();
+    return status;
 }
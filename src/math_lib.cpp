@@ -0,0 +1,143 @@
+#include <mutex>
+#include <vector>
+
+#include "math_lib.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/DynamicLibrary.h"
+
+namespace {
+
+struct Math_function {
+    const char* name;
+    unsigned arity;
+    Intrinsic::ID id;
+};
+
+} // end anonymous namespace
+
+static const Math_function math_functions[] = {
+    {"sqrt", 1, Intrinsic::sqrt},
+    {"sin", 1, Intrinsic::sin},
+    {"cos", 1, Intrinsic::cos},
+    {"exp", 1, Intrinsic::exp},
+    {"exp2", 1, Intrinsic::exp2},
+    {"log", 1, Intrinsic::log},
+    {"log2", 1, Intrinsic::log2},
+    {"log10", 1, Intrinsic::log10},
+    {"fabs", 1, Intrinsic::fabs},
+    {"floor", 1, Intrinsic::floor},
+    {"ceil", 1, Intrinsic::ceil},
+    {"trunc", 1, Intrinsic::trunc},
+    {"round", 1, Intrinsic::round},
+    {"rint", 1, Intrinsic::rint},
+    {"nearbyint", 1, Intrinsic::nearbyint},
+    {"pow", 2, Intrinsic::pow},
+    {"copysign", 2, Intrinsic::copysign},
+    {"fmin", 2, Intrinsic::minnum},
+    {"fmax", 2, Intrinsic::maxnum},
+    {"fma", 3, Intrinsic::fma},
+};
+
+// The x86-64 variants of libmvec, by vector ABI: SSE ('b') always, AVX2
+// ('d') and AVX-512 ('e') when the target has them. Both the C function and
+// the intrinsic it is lowered to are mapped.
+static const VecDesc sse_functions[] = {
+    {"sin", "_ZGVbN2v_sin", 2},
+    {"llvm.sin.f64", "_ZGVbN2v_sin", 2},
+    {"cos", "_ZGVbN2v_cos", 2},
+    {"llvm.cos.f64", "_ZGVbN2v_cos", 2},
+    {"exp", "_ZGVbN2v_exp", 2},
+    {"llvm.exp.f64", "_ZGVbN2v_exp", 2},
+    {"log", "_ZGVbN2v_log", 2},
+    {"llvm.log.f64", "_ZGVbN2v_log", 2},
+    {"pow", "_ZGVbN2vv_pow", 2},
+    {"llvm.pow.f64", "_ZGVbN2vv_pow", 2},
+};
+
+static const VecDesc avx2_functions[] = {
+    {"sin", "_ZGVdN4v_sin", 4},
+    {"llvm.sin.f64", "_ZGVdN4v_sin", 4},
+    {"cos", "_ZGVdN4v_cos", 4},
+    {"llvm.cos.f64", "_ZGVdN4v_cos", 4},
+    {"exp", "_ZGVdN4v_exp", 4},
+    {"llvm.exp.f64", "_ZGVdN4v_exp", 4},
+    {"log", "_ZGVdN4v_log", 4},
+    {"llvm.log.f64", "_ZGVdN4v_log", 4},
+    {"pow", "_ZGVdN4vv_pow", 4},
+    {"llvm.pow.f64", "_ZGVdN4vv_pow", 4},
+};
+
+static const VecDesc avx512_functions[] = {
+    {"sin", "_ZGVeN8v_sin", 8},
+    {"llvm.sin.f64", "_ZGVeN8v_sin", 8},
+    {"cos", "_ZGVeN8v_cos", 8},
+    {"llvm.cos.f64", "_ZGVeN8v_cos", 8},
+    {"exp", "_ZGVeN8v_exp", 8},
+    {"llvm.exp.f64", "_ZGVeN8v_exp", 8},
+    {"log", "_ZGVeN8v_log", 8},
+    {"llvm.log.f64", "_ZGVeN8v_log", 8},
+    {"pow", "_ZGVeN8vv_pow", 8},
+    {"llvm.pow.f64", "_ZGVeN8vv_pow", 8},
+};
+
+static std::once_flag libmvec_once;
+static bool have_libmvec = false;
+
+Intrinsic::ID math_intrinsic(const std::string& name, unsigned arity) {
+    for (auto& fn : math_functions)
+        if (fn.arity == arity && name == fn.name)
+            return fn.id;
+    return Intrinsic::not_intrinsic;
+}
+
+// libmvec_functions - The variant tables code for 'tm' can use, none if
+// libmvec is not available.
+static std::vector<ArrayRef<VecDesc>>
+libmvec_functions(const TargetMachine& tm) {
+    const Triple& triple = tm.getTargetTriple();
+    if (triple.getArch() != Triple::x86_64 || !triple.isOSLinux())
+        return {};
+
+    // JIT-ed code finds the variants in the process, so libmvec must be
+    // loaded. Objects written for the AOT path are linked with -lmvec.
+    std::call_once(libmvec_once, [] {
+        have_libmvec =
+                !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+    });
+    if (!have_libmvec)
+        return {};
+
+    std::string features = tm.getTargetFeatureString();
+    std::vector<ArrayRef<VecDesc>> tables = {sse_functions};
+    if (features.find("+avx2") != std::string::npos)
+        tables.push_back(avx2_functions);
+    if (features.find("+avx512f") != std::string::npos)
+        tables.push_back(avx512_functions);
+    return tables;
+}
+
+std::unique_ptr<TargetLibraryInfoImpl>
+create_library_info(const TargetMachine& tm) {
+    auto tlii = std::make_unique<TargetLibraryInfoImpl>(tm.getTargetTriple());
+    for (ArrayRef<VecDesc> table : libmvec_functions(tm))
+        tlii->addVectorizableFunctions(table);
+    return tlii;
+}
+
+StringRef vector_abi_features(StringRef name) {
+    if (name.startswith("_ZGVd"))
+        return "+avx2";
+    if (name.startswith("_ZGVe"))
+        return "+avx512f";
+    return StringRef();
+}
+
+StringRef vector_math_function(const TargetMachine& tm, StringRef name,
+                               unsigned width) {
+    for (ArrayRef<VecDesc> table : libmvec_functions(tm))
+        for (const VecDesc& fn : table)
+            if (fn.VectorizationFactor == width && fn.ScalarFnName == name)
+                return fn.VectorFnName;
+    return StringRef();
+}
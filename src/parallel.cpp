@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+#include "runtime_io.h"
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+namespace {
+
+// Chunk_range - The chunks [lo, hi) a participant of a loop still has to
+// run. The owner takes chunks from the front, idle participants steal the
+// back half.
+struct Chunk_range {
+    std::mutex mutex;
+    int64_t lo = 0;
+    int64_t hi = 0;
+};
+
+// Loop - One parfor call being run by the pool.
+struct Loop {
+    Parfor_body body;
+    void* env;
+    int64_t begin;
+    int64_t end;
+    int64_t grain;
+    // Result of every chunk.
+    std::vector<double> partial;
+    // One range per participant, the caller is participant 0.
+    std::unique_ptr<Chunk_range[]> ranges;
+    unsigned participants;
+};
+
+// Pool - The threads that run parfor loops with the caller, one loop at a
+// time.
+class Pool {
+public:
+    explicit Pool(unsigned threads);
+    ~Pool();
+
+    // run - Run every chunk of 'loop' and return once all are done.
+    void run(Loop& loop);
+
+private:
+    void worker(unsigned index);
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    Loop* loop = nullptr;
+    uint64_t generation = 0;
+    unsigned active = 0;
+    bool stopping = false;
+};
+
+} // end anonymous namespace
+
+static unsigned parfor_threads = 0;
+
+// Chunks of a loop without a grain. It is the same on every machine and
+// thread count, so is the order in which a reduction adds up.
+static const int64_t default_chunks = 256;
+
+// thread_count - Threads running a parfor loop, the caller included.
+static unsigned thread_count() {
+    if (parfor_threads)
+        return parfor_threads;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Set while a thread runs chunks, a parfor loop inside runs serially.
+static thread_local bool in_parfor = false;
+
+// take_chunk - Next chunk for participant 'index': from its own range, or
+// else stolen from another participant. False when no chunk is left.
+static bool take_chunk(Loop& loop, unsigned index, int64_t& chunk) {
+    Chunk_range& own = loop.ranges[index];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (own.lo < own.hi) {
+            chunk = own.lo++;
+            return true;
+        }
+    }
+
+    for (unsigned k = 1; k < loop.participants; ++k) {
+        Chunk_range& victim = loop.ranges[(index + k) % loop.participants];
+        int64_t lo, hi;
+        {
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            int64_t left = victim.hi - victim.lo;
+            if (left <= 0)
+                continue;
+            hi = victim.hi;
+            lo = hi - (left + 1) / 2;
+            victim.hi = lo;
+        }
+
+        std::lock_guard<std::mutex> lock(own.mutex);
+        own.lo = lo + 1;
+        own.hi = hi;
+        chunk = lo;
+        return true;
+    }
+    return false;
+}
+
+// run_chunks - Run chunks of 'loop' until there are none left.
+static void run_chunks(Loop& loop, unsigned index) {
+    in_parfor = true;
+    int64_t chunk;
+    while (take_chunk(loop, index, chunk)) {
+        int64_t begin = loop.begin + chunk * loop.grain;
+        int64_t end = std::min(begin + loop.grain, loop.end);
+        loop.partial[chunk] = loop.body(loop.env, begin, end);
+    }
+    in_parfor = false;
+}
+
+Pool::Pool(unsigned count) {
+    for (unsigned i = 1; i < count; ++i)
+        threads.emplace_back(&Pool::worker, this, i);
+}
+
+Pool::~Pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void Pool::run(Loop& l) {
+    l.participants = threads.size() + 1;
+    l.ranges.reset(new Chunk_range[l.participants]);
+    int64_t chunks = l.partial.size();
+    for (unsigned i = 0; i < l.participants; ++i) {
+        l.ranges[i].lo = chunks * i / l.participants;
+        l.ranges[i].hi = chunks * (i + 1) / l.participants;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        loop = &l;
+        ++generation;
+    }
+    wake.notify_all();
+
+    run_chunks(l, 0);
+
+    // Chunks the workers took may still be running.
+    std::unique_lock<std::mutex> lock(mutex);
+    loop = nullptr;
+    done.wait(lock, [this] { return active == 0; });
+}
+
+void Pool::worker(unsigned index) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [&] { return stopping || (loop && generation != seen); });
+        if (stopping)
+            return;
+        seen = generation;
+        Loop* l = loop;
+        ++active;
+
+        // What the chunks printed goes out before the loop returns.
+        lock.unlock();
+        run_chunks(*l, index);
+        flush_runtime_output();
+        lock.lock();
+
+        if (--active == 0)
+            done.notify_all();
+    }
+}
+
+void set_parfor_threads(unsigned threads) {
+    parfor_threads = threads;
+}
+
+extern "C" DLLEXPORT double kaleidoscope_parfor(Parfor_body body, void* env,
+                                                int64_t begin, int64_t end,
+                                                int64_t grain) {
+    static Pool pool(thread_count());
+    static std::mutex pool_mutex;
+
+    int64_t n = end - begin;
+    if (n <= 0)
+        return 0;
+    if (grain <= 0)
+        grain = (n + default_chunks - 1) / default_chunks;
+
+    Loop loop;
+    loop.body = body;
+    loop.env = env;
+    loop.begin = begin;
+    loop.end = end;
+    loop.grain = grain;
+    loop.partial.assign((n + grain - 1) / grain, 0.0);
+
+    // The pool runs one loop at a time, anything else runs here. Chunks are
+    // the same either way, so are the sums.
+    std::unique_lock<std::mutex> lock(pool_mutex, std::try_to_lock);
+    if (in_parfor || loop.partial.size() == 1 || !lock) {
+        for (size_t chunk = 0; chunk < loop.partial.size(); ++chunk) {
+            int64_t b = begin + chunk * grain;
+            loop.partial[chunk] = body(env, b, std::min(b + grain, end));
+        }
+    } else {
+        // What this thread printed before the loop goes out before what the
+        // workers print in it.
+        flush_runtime_output();
+        pool.run(loop);
+    }
+
+    double sum = 0;
+    for (double partial : loop.partial)
+        sum += partial;
+    return sum;
+}
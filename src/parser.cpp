@@ -2,33 +2,37 @@
 #include <cstdio>
 #include <memory>
 
+#include "fast_math.h"
 #include "lexer.h"
 #include "parser.h"
 
 // cur_tok/get_next_token - Provide a simple token buffer. cur_tok is the
 // current token the parser is looking a. get_next_token reads another token
 // from the lexer and updates cur_tok with its results.
-int cur_tok;
+thread_local int cur_tok;
 
 static std::unique_ptr<Expr_AST> parse_expression();
 
-// binop_precedence - This holds the precedence for each binary operator that is
-// defined.
-std::map<char, int> binop_precedence {
-    std::pair<char, int>('=', 2),
-    std::pair<char, int>('<', 10),
-    std::pair<char, int>('+', 20),
-    std::pair<char, int>('-', 20),
-    std::pair<char, int>('*', 40),
-};
+// default_binop_precedence - The precedence of the builtin binary operators.
+// A session's binop_precedence holds every operator that is defined.
+std::map<char, int> default_binop_precedence() {
+    return {
+        std::pair<char, int>('=', 2),
+        std::pair<char, int>('<', 10),
+        std::pair<char, int>('+', 20),
+        std::pair<char, int>('-', 20),
+        std::pair<char, int>('*', 40),
+    };
+}
 
 int get_next_token() {
+    Phase_timer timer(Phase::Lex);
     return cur_tok = gettok();
 }
 
 // log_error* - There are little helper functions for error handling.
 static std::unique_ptr<Expr_AST> log_error(const char* str) {
-    fprintf(stderr, "log_error: %s\n", str);
+    current_session().error(str);
     return nullptr;
 }
 
@@ -37,6 +41,40 @@ static std::unique_ptr<Prototype_AST> log_error_p(const char* str) {
     return nullptr;
 }
 
+// name_error - 'str', or that the name in its place is the reserved word
+// 'parfor'.
+static const char* name_error(const char* str) {
+    if (cur_tok == static_cast<int>(Token::TOK_PARFOR))
+        return "'parfor' is a reserved word.";
+    return str;
+}
+
+// typeannotation ::= ':' ('double' | 'float' | 'int') ('[' ']')?
+static bool parse_type_annotation(Value_type& type) {
+    get_next_token(); // Eat ':'.
+    if (cur_tok != static_cast<int>(Token::TOK_IDENTIFIER) ||
+        !type_from_name(identifier_str, type)) {
+        log_error("Expected type after ':'.");
+        return false;
+    }
+    get_next_token(); // Eat the type.
+
+    if (cur_tok == '[') {
+        if (is_vector(type)) {
+            log_error("Arrays of vectors are not supported.");
+            return false;
+        }
+        get_next_token(); // Eat '['.
+        if (cur_tok != ']') {
+            log_error("Expected ']' in array type.");
+            return false;
+        }
+        get_next_token(); // Eat ']'.
+        type = array_of(type);
+    }
+    return true;
+}
+
 // numberexpr ::= number
 static std::unique_ptr<Expr_AST> parse_number_expr() {
     auto result = std::make_unique<Number_expr_AST>(num_val);
@@ -59,12 +97,24 @@ static std::unique_ptr<Expr_AST> parse_paren_expr() {
 
 // identifierexpr
 //      ::= identifier
+//      ::= identifier '[' expression ']'
 //      ::= identifier '(' expression* ')'
 static std::unique_ptr<Expr_AST> parse_identifier_expr() {
     std::string id_name = identifier_str;
 
     get_next_token(); // Eat identifier.
 
+    if (cur_tok == '[') { // Array element.
+        get_next_token(); // Eat '['.
+        auto index = parse_expression();
+        if (!index)
+            return nullptr;
+        if (cur_tok != ']')
+            return log_error("Expected ']' after index.");
+        get_next_token(); // Eat ']'.
+        return std::make_unique<Index_expr_AST>(id_name, std::move(index));
+    }
+
     if (cur_tok != '(') // Simple variable ref.
         return std::make_unique<Variable_expr_AST>(id_name);
 
@@ -122,16 +172,77 @@ static std::unique_ptr<Expr_AST> parse_if_expr() {
                                          std::move(elze));
 }
 
-// forexpr ::= 'for' indentifier '=' expr (',' expr)? 'in' expression
+// loophints ::= '[' (hint ','?)* ']'
+// hint ::= ('vectorize' | 'interleave' | 'unroll' | 'grain') number
+//      ::= 'novectorize' | 'nounroll'
+// Only parfor loops take 'grain'.
+static bool parse_loop_hints(Loop_hints& hints, bool parfor) {
+    get_next_token(); // Eat '['.
+    while (cur_tok != ']') {
+        if (cur_tok != static_cast<int>(Token::TOK_IDENTIFIER)) {
+            log_error("Expected loop hint or ']'.");
+            return false;
+        }
+        std::string hint = identifier_str;
+        get_next_token();
+        if (hint == "grain" && !parfor) {
+            log_error("Only parfor loops take a grain.");
+            return false;
+        }
+
+        if (hint == "novectorize")
+            hints.vectorize = 1;
+        else if (hint == "nounroll")
+            hints.unroll = 1;
+        else if (hint == "vectorize" || hint == "interleave" ||
+                 hint == "unroll" || hint == "grain") {
+            if (cur_tok != static_cast<int>(Token::TOK_NUMBER) || num_val < 1) {
+                log_error("Expected count after loop hint.");
+                return false;
+            }
+            unsigned count = static_cast<unsigned>(num_val);
+            get_next_token();
+            if (hint == "vectorize")
+                hints.vectorize = count;
+            else if (hint == "interleave")
+                hints.interleave = count;
+            else if (hint == "grain")
+                hints.grain = count;
+            else
+                hints.unroll = count;
+        } else {
+            log_error("Unknown loop hint.");
+            return false;
+        }
+
+        if (cur_tok == ',')
+            get_next_token();
+    }
+    get_next_token(); // Eat ']'.
+    return true;
+}
+
+// forexpr ::= 'for' loophints? indentifier typeannotation? '=' expr
+//              (',' expr)? 'in' expression
 static std::unique_ptr<Expr_AST> parse_for_expr() {
     get_next_token(); // Eat the 'for'.
 
+    Loop_hints hints;
+    if (cur_tok == '[' && !parse_loop_hints(hints, false))
+        return nullptr;
+
     if (cur_tok != static_cast<int>(Token::TOK_IDENTIFIER))
-        return log_error("Expected identifier after for.");
+        return log_error(name_error("Expected identifier after for."));
 
     std::string id_name = identifier_str;
     get_next_token(); // Eat the identifier.
 
+    Value_type var_type = Value_type::Double;
+    if (cur_tok == ':' && !parse_type_annotation(var_type))
+        return nullptr;
+    if (is_array(var_type) || is_vector(var_type))
+        return log_error("Loop variable must be a scalar.");
+
     if (cur_tok != '=')
         return log_error("Expected '=' after 'for'.");
     get_next_token(); // Eat the '='.
@@ -166,24 +277,91 @@ static std::unique_ptr<Expr_AST> parse_for_expr() {
 
     return std::make_unique<For_expr_AST>(id_name, std::move(start),
                                           std::move(end), std::move(step),
-                                          std::move(body));
+                                          std::move(body), hints, var_type);
+}
+
+// parforexpr ::= 'parfor' loophints? 'sum'? identifier typeannotation? '='
+//                 expr ',' expr 'in' expression
+static std::unique_ptr<Expr_AST> parse_parfor_expr() {
+    get_next_token(); // Eat the 'parfor'.
+
+    Loop_hints hints;
+    if (cur_tok == '[' && !parse_loop_hints(hints, true))
+        return nullptr;
+
+    if (cur_tok != static_cast<int>(Token::TOK_IDENTIFIER))
+        return log_error(name_error("Expected identifier after parfor."));
+
+    std::string id_name = identifier_str;
+    get_next_token(); // Eat the identifier.
+
+    // 'sum' followed by the variable makes the loop a reduction.
+    bool is_sum = false;
+    if (id_name == "sum" &&
+        cur_tok == static_cast<int>(Token::TOK_IDENTIFIER)) {
+        is_sum = true;
+        id_name = identifier_str;
+        get_next_token();
+    }
+
+    // The iterations are whole numbers, so the variable defaults to int.
+    Value_type var_type = Value_type::Int;
+    if (cur_tok == ':' && !parse_type_annotation(var_type))
+        return nullptr;
+    if (is_array(var_type) || is_vector(var_type))
+        return log_error("Loop variable must be a scalar.");
+
+    if (cur_tok != '=')
+        return log_error("Expected '=' after 'parfor'.");
+    get_next_token(); // Eat the '='.
+
+    auto start = parse_expression();
+    if (!start)
+        return nullptr;
+    if (cur_tok != ',')
+        return log_error("Expected ',' after parfor start value.");
+    get_next_token();
+
+    auto end = parse_expression();
+    if (!end)
+        return nullptr;
+
+    if (cur_tok != static_cast<int>(Token::TOK_IN))
+        return log_error("Expected 'in' after parfor.");
+    get_next_token(); // Eat the 'in'.
+
+    auto body = parse_expression();
+    if (!body)
+        return nullptr;
+
+    return std::make_unique<Parfor_expr_AST>(id_name, std::move(start),
+                                             std::move(end), std::move(body),
+                                             hints, var_type, is_sum);
 }
 
-// varexpr ::= 'var' identifier ('=' expression)?
-//                      (',' identifier ('=' expression)?)* 'in' expression
+// varexpr ::= 'var' identifier typeannotation? ('=' expression)?
+//                      (',' identifier typeannotation? ('=' expression)?)*
+//                      'in' expression
 static std::unique_ptr<Expr_AST> parse_var_expr() {
     get_next_token(); // Eat the 'var'.
 
     std::vector<std::pair<std::string, std::unique_ptr<Expr_AST>>> var_names;
+    std::vector<Value_type> var_types;
 
     // At least one variable is required.
     if (cur_tok != static_cast<int>(Token::TOK_IDENTIFIER))
-        return log_error("Expected identifier after 'var'.");
+        return log_error(name_error("Expected identifier after 'var'."));
 
     while (true) {
         std::string name = identifier_str;
         get_next_token(); // Eat identifier.
 
+        // Read the optional type.
+        Value_type type = Value_type::Double;
+        if (cur_tok == ':' && !parse_type_annotation(type))
+            return nullptr;
+        var_types.push_back(type);
+
         // Read the optional initializer.
         std::unique_ptr<Expr_AST> init;
         if (cur_tok == '=') {
@@ -202,7 +380,8 @@ static std::unique_ptr<Expr_AST> parse_var_expr() {
         get_next_token();
 
         if (cur_tok != static_cast<int>(Token::TOK_IDENTIFIER))
-            return log_error("Expected identifier list after 'var'.");
+            return log_error(
+                    name_error("Expected identifier list after 'var'."));
     }
 
     // At this point, we have to have 'in'.
@@ -215,6 +394,7 @@ static std::unique_ptr<Expr_AST> parse_var_expr() {
         return nullptr;
 
     return std::make_unique<Var_expr_AST>(std::move(var_names),
+                                          std::move(var_types),
                                           std::move(body));
 }
 
@@ -239,6 +419,8 @@ static std::unique_ptr<Expr_AST> parse_primary() {
         return parse_for_expr();
     case static_cast<int>(Token::TOK_VAR):
         return parse_var_expr();
+    case static_cast<int>(Token::TOK_PARFOR):
+        return parse_parfor_expr();
     }
 }
 
@@ -248,7 +430,7 @@ static int get_tok_precedence() {
         return -1;
 
     // Make sure it's a declared binop.
-    int tok_prec = binop_precedence[cur_tok];
+    int tok_prec = current_session().binop_precedence[cur_tok];
     if (tok_prec <= 0)
         return -1;
     return tok_prec;
@@ -308,9 +490,10 @@ static std::unique_ptr<Expr_AST> parse_binop_rhs(int expr_prec,
 }
 
 // prototype
-//      ::= id '(' id* ')
-//      ::= binary LETTER number? (id, id)
-//      ::= unary LETTER (id)
+//      ::= id '(' arg* ')' typeannotation?
+//      ::= binary LETTER number? (arg, arg) typeannotation?
+//      ::= unary LETTER (arg) typeannotation?
+// arg ::= id typeannotation?
 static std::unique_ptr<Prototype_AST> parse_prototype() {
     std::string fn_name;
 
@@ -319,7 +502,8 @@ static std::unique_ptr<Prototype_AST> parse_prototype() {
 
     switch (cur_tok) {
     default:
-        return log_error_p("Expected function name in prototype.");
+        return log_error_p(
+                name_error("Expected function name in prototype."));
     case static_cast<int>(Token::TOK_IDENTIFIER):
         fn_name = identifier_str;
         kind = 0;
@@ -356,40 +540,88 @@ static std::unique_ptr<Prototype_AST> parse_prototype() {
     if (cur_tok != '(')
         return log_error_p("Expected '(' in prototype.");
 
-    // Read the list of argument names.
+    // Read the list of argument names and types.
     std::vector<std::string> arg_names;
-    while (get_next_token() == static_cast<int>(Token::TOK_IDENTIFIER))
+    std::vector<Value_type> arg_types;
+    get_next_token(); // Eat '('.
+    while (cur_tok == static_cast<int>(Token::TOK_IDENTIFIER)) {
         arg_names.push_back(identifier_str);
+        arg_types.push_back(Value_type::Double);
+        get_next_token();
+        if (cur_tok == ':' && !parse_type_annotation(arg_types.back()))
+            return nullptr;
+    }
     if (cur_tok != ')')
-        return log_error_p("Expected ')' in prototype.");
+        return log_error_p(name_error("Expected ')' in prototype."));
 
     // Success.
     get_next_token(); // Eat ')'.
 
+    Value_type ret_type = Value_type::Double;
+    if (cur_tok == ':' && !parse_type_annotation(ret_type))
+        return nullptr;
+
     // Verify right number of names for operator.
     if (kind && arg_names.size() != kind)
         return log_error_p("Invalid number of operands for operator.");
+    if (kind)
+        fn_name = overload_name(fn_name, arg_types);
 
     return std::make_unique<Prototype_AST>(fn_name, std::move(arg_names),
-                                           kind != 0, binary_precedence);
+                                           kind != 0, binary_precedence,
+                                           std::move(arg_types), ret_type);
 }
 
-// definition ::= 'def' prototype exptression
+// fastmath ::= '[' (identifier ','?)* ']'
+static bool parse_fast_math_flags(FastMathFlags& fmf) {
+    get_next_token(); // Eat '['.
+    while (cur_tok != ']') {
+        if (cur_tok != static_cast<int>(Token::TOK_IDENTIFIER)) {
+            log_error("Expected fast-math flag or ']'.");
+            return false;
+        }
+        if (!add_fast_math_flag(identifier_str, fmf)) {
+            log_error("Unknown fast-math flag.");
+            return false;
+        }
+        get_next_token();
+        if (cur_tok == ',')
+            get_next_token();
+    }
+    get_next_token(); // Eat ']'.
+    return true;
+}
+
+// definition ::= 'def' fastmath? prototype exptression
 std::unique_ptr<Function_AST> parse_definition() {
     get_next_token();
+    FastMathFlags fmf = current_session().options.fast_math;
+    if (cur_tok == '[' && !parse_fast_math_flags(fmf))
+        return nullptr;
+
     auto proto = parse_prototype();
     if (!proto)
         return nullptr;
 
+    // If this is an operator, install it. This happens here rather than in
+    // codegen, which may still be behind the parser.
+    if (proto->is_binary_op())
+        current_session().binop_precedence[proto->get_operator_name()] =
+                proto->get_binary_precedence();
+
     if (auto e = parse_expression())
-        return std::make_unique<Function_AST>(std::move(proto), std::move(e));
+        return std::make_unique<Function_AST>(std::move(proto), std::move(e),
+                                              fmf);
     return nullptr;
 }
 
 // external ::= 'extern' prototype
 std::unique_ptr<Prototype_AST> parse_extern() {
     get_next_token(); // Eat 'extern'.
-    return parse_prototype();
+    auto proto = parse_prototype();
+    if (proto)
+        proto->set_external();
+    return proto;
 }
 
 // toplevelexpr ::= expression
@@ -397,7 +629,8 @@ std::unique_ptr<Function_AST> parse_top_level_expr() {
     if (auto e = parse_expression()) {
         // Make an anonymous prototype.
         auto proto = std::make_unique<Prototype_AST>("__anon_expr", std::vector<std::string>());
-        return std::make_unique<Function_AST>(std::move(proto), std::move(e));
+        return std::make_unique<Function_AST>(std::move(proto), std::move(e),
+                                              current_session().options.fast_math);
     }
     return nullptr;
 }
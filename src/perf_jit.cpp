@@ -0,0 +1,207 @@
+#include <ctime>
+
+#include "perf_jit.h"
+
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/raw_ostream.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// The jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+// in the Linux sources.
+namespace {
+
+struct Jitdump_header {
+    uint32_t magic = 0x4A695444; // "JiTD"
+    uint32_t version = 1;
+    uint32_t total_size = sizeof(Jitdump_header);
+    uint32_t elf_mach;
+    uint32_t pad1 = 0;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags = 0;
+};
+
+enum Jitdump_record_id : uint32_t {
+    JIT_CODE_LOAD = 0,
+    JIT_CODE_CLOSE = 3,
+};
+
+struct Jitdump_record {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+// Followed by the name, with its nul, and the code.
+struct Jitdump_code_load {
+    Jitdump_record record;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+} // end anonymous namespace
+
+// timestamp - The clock perf record uses with -k mono.
+static uint64_t timestamp() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t elf_machine() {
+#if defined(__x86_64__)
+    return 62; // EM_X86_64
+#elif defined(__aarch64__)
+    return 183; // EM_AARCH64
+#else
+    return 0;
+#endif
+}
+
+Perf_listener::Perf_listener(const Perf_options& options) {
+#ifdef __linux__
+    if (options.map) {
+        std::string name = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        map_file = fopen(name.c_str(), "a");
+        if (!map_file)
+            errs() << "perf: cannot open " << name << ": "
+                   << sys::StrError() << "\n";
+    }
+
+    if (options.jitdump) {
+        std::string name = options.dir + "/jit-" + std::to_string(getpid()) +
+                           ".dump";
+        dump_file = fopen(name.c_str(), "w+");
+        if (!dump_file) {
+            errs() << "perf: cannot open " << name << ": "
+                   << sys::StrError() << "\n";
+            return;
+        }
+
+        // perf record notices the dump through this executable mapping.
+        long page = sysconf(_SC_PAGESIZE);
+        dump_marker = mmap(nullptr, page, PROT_READ | PROT_EXEC, MAP_PRIVATE,
+                           fileno(dump_file), 0);
+        if (dump_marker == MAP_FAILED)
+            dump_marker = nullptr;
+
+        Jitdump_header header;
+        header.elf_mach = elf_machine();
+        header.pid = getpid();
+        header.timestamp = timestamp();
+        fwrite(&header, sizeof(header), 1, dump_file);
+        fflush(dump_file);
+    }
+#else
+    (void)options;
+#endif
+}
+
+Perf_listener::~Perf_listener() {
+#ifdef __linux__
+    if (dump_file) {
+        Jitdump_record close = {JIT_CODE_CLOSE, sizeof(Jitdump_record),
+                                timestamp()};
+        fwrite(&close, sizeof(close), 1, dump_file);
+        if (dump_marker)
+            munmap(dump_marker, sysconf(_SC_PAGESIZE));
+        fclose(dump_file);
+    }
+    if (map_file)
+        fclose(map_file);
+#endif
+}
+
+void Perf_listener::write_map(const Code_range& code, StringRef name) {
+    if (!map_file)
+        return;
+    fprintf(map_file, "%llx %llx %.*s\n",
+            static_cast<unsigned long long>(code.addr),
+            static_cast<unsigned long long>(code.size),
+            static_cast<int>(name.size()), name.data());
+    fflush(map_file);
+}
+
+void Perf_listener::write_code_load(const Code_range& code, StringRef name) {
+#ifdef __linux__
+    if (!dump_file)
+        return;
+    Jitdump_code_load load;
+    load.record.id = JIT_CODE_LOAD;
+    load.record.total_size = sizeof(load) + name.size() + 1 + code.size;
+    load.record.timestamp = timestamp();
+    load.pid = getpid();
+    load.tid = syscall(SYS_gettid);
+    load.vma = code.addr;
+    load.code_addr = code.addr;
+    load.code_size = code.size;
+    load.code_index = code_index++;
+
+    fwrite(&load, sizeof(load), 1, dump_file);
+    fwrite(name.data(), name.size(), 1, dump_file);
+    fputc('\0', dump_file);
+    fwrite(reinterpret_cast<const void*>(code.addr), code.size, 1, dump_file);
+    fflush(dump_file);
+#endif
+}
+
+void Perf_listener::notifyObjectLoaded(ObjectKey k,
+                                       const object::ObjectFile& obj,
+                                       const RuntimeDyld::LoadedObjectInfo& info) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!map_file && !dump_file)
+        return;
+
+    // The debug object has the sections at their load addresses.
+    object::OwningBinary<object::ObjectFile> debug_owner =
+            info.getObjectForDebug(obj);
+    const object::ObjectFile* debug_obj = debug_owner.getBinary();
+    if (!debug_obj)
+        return;
+
+    for (const auto& sym_size : object::computeSymbolSizes(*debug_obj)) {
+        const object::SymbolRef& sym = sym_size.first;
+        auto type = sym.getType();
+        if (!type) {
+            consumeError(type.takeError());
+            continue;
+        }
+        if (*type != object::SymbolRef::ST_Function || !sym_size.second)
+            continue;
+
+        auto name = sym.getName();
+        auto addr = sym.getAddress();
+        if (!name || !addr) {
+            if (!name)
+                consumeError(name.takeError());
+            if (!addr)
+                consumeError(addr.takeError());
+            continue;
+        }
+
+        Code_range code = {*addr, sym_size.second};
+        write_map(code, *name);
+        write_code_load(code, *name);
+    }
+}
+
+void Perf_listener::notifyFreeingObject(ObjectKey) {
+    // Neither format retracts code. Samples taken before the free still need
+    // the names; for addresses reused afterwards, perf takes the newer map
+    // line, and the dump is ordered by time.
+}
+
+Perf_listener& perf_listener(const Perf_options& options) {
+    static Perf_listener listener(options);
+    return listener;
+}
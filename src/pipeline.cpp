@@ -0,0 +1,54 @@
+#include "math_lib.h"
+#include "pipeline.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+std::unique_ptr<TargetMachine> create_host_target_machine() {
+    SmallVector<std::string, 32> attrs;
+    StringMap<bool> features;
+    if (sys::getHostCPUFeatures(features))
+        for (auto& feature : features)
+            attrs.push_back((feature.second ? "+" : "-") + feature.first().str());
+
+    return std::unique_ptr<TargetMachine>(
+            EngineBuilder()
+                    .setMCPU(sys::getHostCPUName())
+                    .setMAttrs(attrs)
+                    .setOptLevel(CodeGenOpt::Aggressive)
+                    .selectTarget());
+}
+
+void optimize_aggressive(Module& m, TargetMachine& tm) {
+    PassManagerBuilder pmb;
+    pmb.OptLevel = 3;
+    pmb.Inliner = createFunctionInliningPass(3, 0, false);
+    pmb.LoopVectorize = true;
+    pmb.SLPVectorize = true;
+    pmb.LibraryInfo = create_library_info(tm).release();
+    tm.adjustPassManager(pmb);
+
+    legacy::FunctionPassManager fpm(&m);
+    legacy::PassManager mpm;
+    fpm.add(createTargetTransformInfoWrapperPass(tm.getTargetIRAnalysis()));
+    mpm.add(createTargetTransformInfoWrapperPass(tm.getTargetIRAnalysis()));
+    pmb.populateFunctionPassManager(fpm);
+    pmb.populateModulePassManager(mpm);
+
+    fpm.doInitialization();
+    for (auto& f : m)
+        fpm.run(f);
+    fpm.doFinalization();
+
+    mpm.run(m);
+}
+
+std::unique_ptr<MemoryBuffer> compile_object(Module& m, TargetMachine& tm) {
+    return orc::SimpleCompiler(tm)(m);
+}
@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "KaleidoscopeJIT.h"
+#include "profiler.h"
+
+#include "llvm/Demangle/Demangle.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define PROFILER_SUPPORTED 1
+#endif
+
+namespace {
+
+const unsigned max_frames = 64;
+// Samples in flight between the signal handler and the collector.
+const unsigned num_slots = 4096;
+// How often the collector empties the slots.
+const std::chrono::milliseconds collect_interval(20);
+// Frame records are only followed this far above the stack pointer.
+const uintptr_t max_stack_bytes = 64 << 20;
+// Rows of the flat profile.
+const size_t profile_rows = 40;
+
+enum Slot_state { Slot_free, Slot_writing, Slot_full };
+
+// Sample - One interrupted thread: its PC, the return addresses of its
+// frame records, and the word on top of its stack, which is the return
+// address while the PC is in a function that has not set up a frame.
+struct Sample {
+    std::atomic<int> state{Slot_free};
+    uint64_t generation;
+    uintptr_t top_of_stack;
+    unsigned depth;
+    uintptr_t pcs[max_frames];
+};
+
+// Function_counts - Samples in a Kaleidoscope function and in it or its
+// callees. Native code called from a function counts as its own.
+struct Function_counts {
+    uint64_t self = 0;
+    uint64_t total = 0;
+};
+
+struct Profiler {
+    Profile_options options;
+    Sample slots[num_slots];
+    std::atomic<unsigned> next_slot{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> sampling{false};
+    // Writing from an unreadable address fails with EFAULT instead of
+    // faulting, so the handler probes frame records through this pipe.
+    int probe[2] = {-1, -1};
+
+    std::thread collector;
+    std::mutex collector_mutex;
+    std::condition_variable collector_cv;
+    bool stopping = false;
+
+    // Only touched by the collector, and after it stopped.
+    uint64_t samples = 0;
+    uint64_t jit_samples = 0;
+    std::map<std::string, Function_counts> functions;
+    std::map<std::string, uint64_t> folded;
+    std::map<uintptr_t, std::string> native_names;
+    // The code index generation when the previous collection started.
+    uint64_t last_collect_generation = 0;
+
+    void run_collector();
+    void collect();
+    void add_sample(const Sample& s);
+    const std::string& native_name(uintptr_t pc);
+    void report();
+};
+
+} // end anonymous namespace
+
+// Never freed, a late signal may still look at it.
+static Profiler* profiler = nullptr;
+
+#ifdef PROFILER_SUPPORTED
+
+static bool readable(const Profiler& p, uintptr_t addr, size_t size) {
+    if (write(p.probe[1], reinterpret_cast<const void*>(addr), size) !=
+        static_cast<ssize_t>(size))
+        return false;
+    char sink[2 * sizeof(uintptr_t)];
+    if (read(p.probe[0], sink, size) < 0)
+        return false;
+    return true;
+}
+
+static void registers(void* context, uintptr_t& pc, uintptr_t& fp,
+                      uintptr_t& sp) {
+    auto* uc = static_cast<ucontext_t*>(context);
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+    sp = uc->uc_mcontext.gregs[REG_RSP];
+#else
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+    sp = uc->uc_mcontext.sp;
+#endif
+}
+
+// on_sigprof - Record the interrupted thread into a free slot. Only async
+// signal safe calls from here on.
+static void on_sigprof(int, siginfo_t*, void* context) {
+    Profiler* p = profiler;
+    if (!p || !p->sampling.load(std::memory_order_relaxed))
+        return;
+    int saved_errno = errno;
+
+    Sample& s = p->slots[p->next_slot.fetch_add(1, std::memory_order_relaxed) %
+                         num_slots];
+    int expected = Slot_free;
+    if (!s.state.compare_exchange_strong(expected, Slot_writing,
+                                         std::memory_order_acquire)) {
+        p->dropped.fetch_add(1, std::memory_order_relaxed);
+        errno = saved_errno;
+        return;
+    }
+
+    uintptr_t pc, fp, sp;
+    registers(context, pc, fp, sp);
+    s.generation = CodeIndex::get().generation();
+    s.pcs[0] = pc;
+    s.depth = 1;
+    s.top_of_stack = 0;
+    if (readable(*p, sp, sizeof(uintptr_t)))
+        s.top_of_stack = *reinterpret_cast<const uintptr_t*>(sp);
+
+    // Each frame record holds the caller's frame pointer and the return
+    // address, and records only move up the stack.
+    while (s.depth < max_frames && fp % sizeof(uintptr_t) == 0 && fp >= sp &&
+           fp - sp < max_stack_bytes &&
+           readable(*p, fp, 2 * sizeof(uintptr_t))) {
+        auto* record = reinterpret_cast<const uintptr_t*>(fp);
+        if (!record[1])
+            break;
+        s.pcs[s.depth++] = record[1];
+        if (record[0] <= fp)
+            break;
+        fp = record[0];
+    }
+
+    s.state.store(Slot_full, std::memory_order_release);
+    errno = saved_errno;
+}
+
+#endif // PROFILER_SUPPORTED
+
+void Profiler::run_collector() {
+    std::unique_lock<std::mutex> lock(collector_mutex);
+    while (!stopping) {
+        collector_cv.wait_for(lock, collect_interval);
+        collect();
+    }
+}
+
+void Profiler::collect() {
+    CodeIndex& index = CodeIndex::get();
+    uint64_t generation = index.generation();
+    for (auto& s : slots) {
+        if (s.state.load(std::memory_order_acquire) != Slot_full)
+            continue;
+        add_sample(s);
+        s.state.store(Slot_free, std::memory_order_release);
+    }
+
+    // A sample taken before the previous collection started was written
+    // long ago and has now been added, so code freed by then can go.
+    index.prune(last_collect_generation);
+    last_collect_generation = generation;
+}
+
+const std::string& Profiler::native_name(uintptr_t pc) {
+    auto it = native_names.find(pc);
+    if (it != native_names.end())
+        return it->second;
+
+    std::string name = "[unknown]";
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void*>(pc), &info)) {
+        if (info.dli_sname) {
+            int status;
+            char* demangled =
+                    itaniumDemangle(info.dli_sname, nullptr, nullptr, &status);
+            name = demangled ? demangled : info.dli_sname;
+            free(demangled);
+        } else if (info.dli_fname) {
+            std::string file = info.dli_fname;
+            name = "[" + file.substr(file.rfind('/') + 1) + "]";
+        }
+    }
+    return native_names[pc] = name;
+}
+
+void Profiler::add_sample(const Sample& s) {
+    CodeIndex& index = CodeIndex::get();
+
+    // Leaf first. Return addresses point after the call, look up the call.
+    std::vector<std::string> frames;
+    std::vector<bool> jit;
+    for (unsigned i = 0; i != s.depth; ++i) {
+        uintptr_t pc = i ? s.pcs[i] - 1 : s.pcs[i];
+        std::string name;
+        bool in_jit = index.find(pc, s.generation, name);
+        frames.push_back(in_jit ? name : native_name(pc));
+        jit.push_back(in_jit);
+    }
+
+    // Native leaves without a frame, like most of libm, hide their JIT-ed
+    // caller from the frame records, but not from the top of the stack.
+    std::string caller;
+    if (!jit[0] && s.top_of_stack &&
+        index.find(s.top_of_stack - 1, s.generation, caller) &&
+        (frames.size() < 2 || frames[1] != caller)) {
+        frames.insert(frames.begin() + 1, caller);
+        jit.insert(jit.begin() + 1, true);
+    }
+
+    ++samples;
+    auto innermost = std::find(jit.begin(), jit.end(), true);
+    if (innermost != jit.end()) {
+        ++jit_samples;
+        ++functions[frames[innermost - jit.begin()]].self;
+        std::vector<std::string> seen;
+        for (size_t i = 0; i != frames.size(); ++i) {
+            if (!jit[i] ||
+                std::find(seen.begin(), seen.end(), frames[i]) != seen.end())
+                continue;
+            seen.push_back(frames[i]);
+            ++functions[frames[i]].total;
+        }
+    }
+
+    if (options.folded_file.empty())
+        return;
+    std::string stack;
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+        if (!stack.empty())
+            stack += ';';
+        std::string frame = *it;
+        std::replace(frame.begin(), frame.end(), ';', ':');
+        stack += frame;
+    }
+    ++folded[stack];
+}
+
+static double percent(uint64_t n, uint64_t total) {
+    return total ? 100.0 * n / total : 0;
+}
+
+void Profiler::report() {
+    fprintf(stderr,
+            "\nProfile: %llu samples at %u Hz, %llu in JIT-ed code, %llu "
+            "dropped\n",
+            (unsigned long long)samples, options.frequency,
+            (unsigned long long)jit_samples,
+            (unsigned long long)dropped.load());
+
+    std::vector<std::pair<std::string, Function_counts>> rows(
+            functions.begin(), functions.end());
+    std::stable_sort(rows.begin(), rows.end(),
+                     [](const std::pair<std::string, Function_counts>& a,
+                        const std::pair<std::string, Function_counts>& b) {
+                         return a.second.self > b.second.self;
+                     });
+    if (rows.size() > profile_rows)
+        rows.resize(profile_rows);
+
+    if (!rows.empty())
+        fprintf(stderr, "%10s %7s %10s %7s  %s\n", "self", "%", "total", "%",
+                "function");
+    for (auto& row : rows)
+        fprintf(stderr, "%10llu %6.2f%% %10llu %6.2f%%  %s\n",
+                (unsigned long long)row.second.self,
+                percent(row.second.self, samples),
+                (unsigned long long)row.second.total,
+                percent(row.second.total, samples), row.first.c_str());
+
+    if (options.folded_file.empty())
+        return;
+    FILE* f = fopen(options.folded_file.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "Could not write %s\n", options.folded_file.c_str());
+        return;
+    }
+    for (auto& stack : folded)
+        fprintf(f, "%s %llu\n", stack.first.c_str(),
+                (unsigned long long)stack.second);
+    fclose(f);
+}
+
+bool start_profiler(const Profile_options& options) {
+#ifndef PROFILER_SUPPORTED
+    fprintf(stderr, "The profiler is not supported on this platform.\n");
+    return false;
+#else
+    if (profiler || !options.frequency)
+        return false;
+
+    auto* p = new Profiler;
+    p->options = options;
+    if (pipe2(p->probe, O_NONBLOCK | O_CLOEXEC)) {
+        perror("profiler");
+        delete p;
+        return false;
+    }
+
+    // Name the code loaded from now on.
+    CodeIndex::get().enable();
+    profiler = p;
+    p->sampling = true;
+
+    struct sigaction action = {};
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    p->collector = std::thread([p] { p->run_collector(); });
+
+    // The timer runs on the CPU time of all threads, the signal goes to one
+    // that is running.
+    itimerval timer = {};
+    timer.it_interval.tv_usec = std::max(1u, 1000000u / options.frequency);
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    return true;
+#endif
+}
+
+void stop_profiler() {
+    Profiler* p = profiler;
+    if (!p || !p->sampling)
+        return;
+
+    itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    p->sampling = false;
+
+    {
+        std::lock_guard<std::mutex> lock(p->collector_mutex);
+        p->stopping = true;
+    }
+    p->collector_cv.notify_one();
+    p->collector.join();
+    p->collect();
+    p->report();
+
+    close(p->probe[0]);
+    close(p->probe[1]);
+}
@@ -0,0 +1,134 @@
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "runtime_io.h"
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "extern'd" from user code.
+//===----------------------------------------------------------------------===//
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+// Bytes held per thread before they are written.
+static const size_t output_buffer_size = 1 << 16;
+
+static FILE* destination = stdout;
+// Threads holding an Output_buffer, set_runtime_output checks it is only the
+// caller.
+static std::atomic<unsigned> live_buffers(0);
+
+namespace {
+
+// Output_buffer - What one thread printed and has not written yet.
+struct Output_buffer {
+    char data[output_buffer_size];
+    size_t size = 0;
+
+    Output_buffer() { ++live_buffers; }
+    ~Output_buffer() {
+        flush();
+        --live_buffers;
+    }
+
+    void flush() {
+        if (!size)
+            return;
+        fwrite(data, 1, size, destination);
+        fflush(destination);
+        size = 0;
+    }
+
+    // reserve - Room for 'n' more bytes, n <= output_buffer_size.
+    char* reserve(size_t n) {
+        if (size + n > output_buffer_size)
+            flush();
+        return data + size;
+    }
+};
+
+} // end anonymous namespace
+
+static thread_local Output_buffer output;
+
+bool set_runtime_output(const std::string& filename) {
+    FILE* file = fopen(filename.c_str(), "w");
+    if (!file)
+        return false;
+    // Buffers of other threads would go to the wrong destination, or to a
+    // closed one.
+    output.flush();
+    assert(live_buffers == 1 && "Output redirected while other threads print.");
+    if (destination != stdout)
+        fclose(destination);
+    destination = file;
+    return true;
+}
+
+void flush_runtime_output() {
+    output.flush();
+}
+
+// write_digits - 'v' in decimal, at least 'min_digits' long, ending at 'end'.
+// Returns where the digits start.
+static char* write_digits(uint64_t v, unsigned min_digits, char* end) {
+    char* p = end;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v || end - p < min_digits);
+    return p;
+}
+
+size_t format_double(double x, char* out) {
+    // Below 2^53 / 10^6 the scaled value and its integer part are exact
+    // enough in a double. Rounding only needs printf when the product is
+    // within an ulp of a tie, its own rounding could have moved it across.
+    double a = std::fabs(x);
+    if (!(a < 9e9))
+        return snprintf(out, max_double_chars, "%f", x);
+    double scaled = a * 1e6;
+    double whole = std::floor(scaled);
+    double frac = scaled - whole;
+    double ulp = scaled ? std::ldexp(1.0, std::ilogb(scaled) - 52) : 0;
+    if (std::fabs(frac - 0.5) <= ulp)
+        return snprintf(out, max_double_chars, "%f", x);
+
+    uint64_t v = static_cast<uint64_t>(whole) + (frac > 0.5);
+    char digits[32];
+    char* end = digits + sizeof(digits);
+    char* fraction = write_digits(v % 1000000, 6, end);
+    char* integer = write_digits(v / 1000000, 1, fraction);
+
+    size_t n = 0;
+    if (std::signbit(x))
+        out[n++] = '-';
+    memcpy(out + n, integer, fraction - integer);
+    n += fraction - integer;
+    out[n++] = '.';
+    memcpy(out + n, fraction, end - fraction);
+    return n + (end - fraction);
+}
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+  *output.reserve(1) = (char)X;
+  ++output.size;
+  return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" DLLEXPORT double printd(double X) {
+  char *P = output.reserve(max_double_chars + 1);
+  size_t N = format_double(X, P);
+  P[N] = '\n';
+  output.size += N + 1;
+  return 0;
+}
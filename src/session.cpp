@@ -0,0 +1,190 @@
+#include <cassert>
+#include <cstdarg>
+
+#include "driver.h"
+#include "lexer.h"
+#include "parallel.h"
+#include "parser.h"
+#include "session.h"
+
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/TargetSelect.h"
+
+static thread_local Session* cur_session = nullptr;
+
+Session& current_session() {
+    assert(cur_session && "No session is current on this thread.");
+    return *cur_session;
+}
+
+Session_scope::Session_scope(Session& s) : prev(cur_session) {
+    cur_session = &s;
+}
+
+Session_scope::~Session_scope() {
+    cur_session = prev;
+}
+
+static std::once_flag native_target_once;
+
+Session::Session(const Session_options& opts)
+    : options(opts), builder(the_context),
+      binop_precedence(default_binop_precedence()),
+      ir_cache(opts.inlining.max_retained) {
+    std::call_once(native_target_once, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+        // Generated code calls the runtime by name only. Registering it links
+        // it into every program with a session, whether or not the archive
+        // member holding it was otherwise needed, and -rdynamic or not.
+        sys::DynamicLibrary::AddSymbol("kaleidoscope_parfor",
+                reinterpret_cast<void*>(&kaleidoscope_parfor));
+    });
+
+#ifdef NDEBUG
+    // Release builds drop the names of values, "addtmp", "calltmp" and so
+    // on, unless someone reads the IR.
+    the_context.setDiscardValueNames(!options.interactive &&
+                                     options.ir_file.empty());
+#endif
+
+    the_jit = std::make_unique<KaleidoscopeJIT>();
+    if (options.perf.map || options.perf.jitdump)
+        the_jit->addEventListener(&perf_listener(options.perf));
+    if (options.stats.enabled()) {
+        stats = std::make_unique<Stats>();
+        the_jit->addEventListener(stats.get());
+    }
+
+    Session_scope scope(*this);
+    initialize_module();
+
+    if (options.tier.enabled) {
+        tier = std::make_unique<Tier_manager>(*the_jit, options.tier);
+        tier->start();
+    } else if (options.speculate_threads)
+        speculator = std::make_unique<Speculator>(*the_jit,
+                                                  options.speculate_threads);
+}
+
+// Out of line, Prototype_AST is incomplete in the header.
+Session::~Session() {}
+
+bool Session::compile(const std::string& source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Session_scope scope(*this);
+    unsigned errors_before = errors;
+
+    auto prime = [&] {
+        set_lexer_source(source.data(), source.data() + source.size());
+        get_next_token();
+    };
+    if (options.pipeline_depth)
+        pipelined_loop(prime);
+    else {
+        prime();
+        main_loop();
+    }
+    set_lexer_stdin();
+
+    return errors == errors_before;
+}
+
+bool Session::batch_eval(const std::string& name, const double* const* cols,
+                         unsigned num_cols, double* out, size_t rows,
+                         unsigned threads) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Session_scope scope(*this);
+    return ::batch_eval(name, cols, num_cols, out, rows, threads);
+}
+
+void Session::repl() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Session_scope scope(*this);
+
+    // Prime the first token.
+    auto prime = [&] {
+        set_lexer_stdin();
+        if (options.interactive)
+            fprintf(stderr, "ready> ");
+        get_next_token();
+    };
+    if (options.pipeline_depth)
+        pipelined_loop(prime);
+    else {
+        prime();
+        main_loop();
+    }
+}
+
+std::string Session::emit_object_code(const std::string& stem) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Session_scope scope(*this);
+    return ::emit_object_code(stem);
+}
+
+void Session::report(const char* fmt, ...) {
+    std::lock_guard<std::mutex> lock(diagnostics_mutex);
+    va_list args;
+    va_start(args, fmt);
+    if (!options.buffer_diagnostics) {
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+        return;
+    }
+
+    va_list size_args;
+    va_copy(size_args, args);
+    int size = vsnprintf(nullptr, 0, fmt, size_args);
+    va_end(size_args);
+
+    if (size > 0) {
+        size_t old_size = diagnostics.size();
+        diagnostics.resize(old_size + size + 1);
+        vsnprintf(&diagnostics[old_size], size + 1, fmt, args);
+        diagnostics.resize(old_size + size);
+    }
+    va_end(args);
+}
+
+void Session::error(const char* str) {
+    {
+        std::lock_guard<std::mutex> lock(diagnostics_mutex);
+        ++errors;
+    }
+    report("log_error: %s\n", str);
+}
+
+JITTargetAddress Session::lookup_address(const std::string& name,
+                                         const std::vector<Value_type>& arg_types,
+                                         Value_type ret_type) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto proto = function_protos.find(name);
+    if (proto == function_protos.end())
+        return 0;
+    const Prototype_AST& p = *proto->second;
+    if (p.arg_size() != arg_types.size() || p.get_ret_type() != ret_type)
+        return 0;
+    for (size_t i = 0; i < arg_types.size(); ++i)
+        if (p.get_arg_type(i) != arg_types[i])
+            return 0;
+
+    auto sym = the_jit->findSymbol(name);
+    if (auto err = sym.takeError()) {
+        consumeError(std::move(err));
+        return 0;
+    }
+    if (!sym)
+        return 0;
+
+    auto addr = sym.getAddress();
+    if (!addr) {
+        consumeError(addr.takeError());
+        return 0;
+    }
+    // The caller keeps the pointer, so the code must never be reclaimed.
+    the_jit->pinSymbol(name);
+    return *addr;
+}
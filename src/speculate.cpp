@@ -0,0 +1,104 @@
+#include <algorithm>
+
+#include "pipeline.h"
+#include "speculate.h"
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Speculative_job - One definition to compile, as bitcode so it can be read
+// into a private context.
+struct Speculative_job {
+    SmallString<0> bitcode;
+    std::string name;
+    std::promise<void> ready;
+    std::shared_ptr<KaleidoscopeJIT::PendingObject> pending;
+};
+
+Speculator::Speculator(KaleidoscopeJIT& jit, unsigned threads)
+    : jit(jit), jobs(64) {
+    for (unsigned i = 0; i < std::max(threads, 1u); ++i)
+        this->threads.emplace_back(&Speculator::worker, this);
+}
+
+Speculator::~Speculator() {
+    jobs.close();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void Speculator::add_definition(std::unique_ptr<Module> m,
+                                const std::string& name) {
+    auto job = std::make_unique<Speculative_job>();
+    job->name = name;
+    raw_svector_ostream os(job->bitcode);
+    WriteBitcodeToFile(*m, os);
+
+    job->pending = std::make_shared<KaleidoscopeJIT::PendingObject>();
+    job->pending->Ready = job->ready.get_future().share();
+    job->pending->OnFirstLookup = [this](double waited_ms) {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        ++latency.first_calls;
+        if (waited_ms > 0.01)
+            ++latency.first_calls_waited;
+        latency.first_call_wait_ms_total += waited_ms;
+        latency.first_call_wait_ms_max =
+                std::max(latency.first_call_wait_ms_max, waited_ms);
+    };
+
+    // Everything the module defines waits for the object. Bodies imported
+    // by the inliner stay defined by the modules they came from.
+    std::vector<std::string> names;
+    for (auto& f : *m)
+        if (!f.isDeclarationForLinker() && !f.hasLocalLinkage())
+            names.push_back(f.getName());
+    jit.addPendingObject(names, job->pending);
+
+    jobs.push(std::move(job));
+}
+
+void Speculator::worker() {
+    auto tm = create_host_target_machine();
+
+    std::unique_ptr<Speculative_job> job;
+    while (jobs.pop(job)) {
+        LLVMContext ctx;
+        auto m = parseBitcodeFile(MemoryBufferRef(job->bitcode, job->name),
+                                  ctx);
+        if (m) {
+            (*m)->setDataLayout(tm->createDataLayout());
+            job->pending->Obj = compile_object(**m, *tm);
+        } else
+            logAllUnhandledErrors(m.takeError(), errs(), "speculate: ");
+
+        job->ready.set_value();
+        jit.addReadyObjects();
+    }
+}
+
+void Speculator::record_prompt(double ms) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    ++latency.definitions;
+    latency.prompt_ms_total += ms;
+    latency.prompt_ms_max = std::max(latency.prompt_ms_max, ms);
+}
+
+Speculation_stats Speculator::stats() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return latency;
+}
+
+void Speculator::print_stats() {
+    Speculation_stats st = stats();
+    if (!st.definitions)
+        return;
+    fprintf(stderr, "Speculation: %u definitions, time to prompt %.3f ms "
+                    "avg, %.3f ms max\n", st.definitions,
+            st.prompt_ms_total / st.definitions, st.prompt_ms_max);
+    if (st.first_calls)
+        fprintf(stderr, "First calls: %u, %u waited for code, %.3f ms avg, "
+                        "%.3f ms max\n", st.first_calls, st.first_calls_waited,
+                st.first_call_wait_ms_total / st.first_calls,
+                st.first_call_wait_ms_max);
+}
@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "stats.h"
+
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+// How many of the most expensive items the summary lists.
+static const size_t summary_items = 10;
+
+static thread_local Item_stats* cur_item = nullptr;
+// The innermost running timer of this thread.
+static thread_local Phase_timer* cur_timer = nullptr;
+
+const char* phase_name(Phase phase) {
+    switch (phase) {
+    case Phase::Lex:
+        return "lex";
+    case Phase::Parse:
+        return "parse";
+    case Phase::Codegen:
+        return "codegen";
+    case Phase::Optimize:
+        return "optimize";
+    case Phase::Machine_codegen:
+        return "machine_codegen";
+    case Phase::Link:
+        return "link";
+    case Phase::Execute:
+        return "execute";
+    }
+    return "unknown";
+}
+
+Item_stats::Item_stats() {
+    std::fill(ms, ms + num_phases, 0.0);
+}
+
+double Item_stats::total_ms() const {
+    double total = 0;
+    for (double t : ms)
+        total += t;
+    return total;
+}
+
+void Item_stats::add(const Item_stats& other) {
+    for (unsigned i = 0; i != num_phases; ++i)
+        ms[i] += other.ms[i];
+    ast_nodes += other.ast_nodes;
+    ir_instructions += other.ir_instructions;
+    modules += other.modules;
+    jit_bytes += other.jit_bytes;
+    modules_freed += other.modules_freed;
+    jit_resident_bytes = std::max(jit_resident_bytes, other.jit_resident_bytes);
+}
+
+Item_stats* current_item() {
+    return cur_item;
+}
+
+Item_scope::Item_scope(Item_stats* item) : prev(cur_item) {
+    cur_item = item;
+}
+
+Item_scope::~Item_scope() {
+    cur_item = prev;
+}
+
+void Phase_timer::start() {
+    parent = cur_timer;
+    cur_timer = this;
+    start_time = std::chrono::steady_clock::now();
+}
+
+void Phase_timer::stop() {
+    std::chrono::duration<double, std::milli> d =
+            std::chrono::steady_clock::now() - start_time;
+    item->ms[static_cast<unsigned>(phase)] += d.count() - nested_ms;
+    if (parent)
+        parent->nested_ms += d.count();
+    cur_timer = parent;
+}
+
+void count_instructions(const Module& m) {
+    Item_stats* item = cur_item;
+    if (!item)
+        return;
+    for (auto& f : m)
+        item->ir_instructions += f.getInstructionCount();
+}
+
+void label_item(const std::string& label) {
+    if (cur_item)
+        cur_item->label = label;
+}
+
+Stats::Stats() {
+    background.label = "(background)";
+}
+
+void Stats::record(const Item_stats& item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    items.push_back(item);
+}
+
+void Stats::notifyObjectLoaded(ObjectKey k, const object::ObjectFile& obj,
+                               const RuntimeDyld::LoadedObjectInfo& info) {
+    uint64_t bytes = 0;
+    for (const auto& section : obj.sections())
+        if (info.getSectionLoadAddress(section))
+            bytes += section.getSize();
+
+    if (Item_stats* item = cur_item) {
+        ++item->modules;
+        item->jit_bytes += bytes;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    ++background.modules;
+    background.jit_bytes += bytes;
+}
+
+void Stats::merge(Stats& other, const std::string& prefix) {
+    std::lock_guard<std::mutex> other_lock(other.mutex);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto item : other.items) {
+        item.label = prefix + item.label;
+        items.push_back(item);
+    }
+    background.add(other.background);
+}
+
+Item_stats Stats::total() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Item_stats total;
+    total.label = "total";
+    for (auto& item : items)
+        total.add(item);
+    total.add(background);
+    return total;
+}
+
+void Stats::notifyFreeingObject(ObjectKey k) {
+    if (Item_stats* item = cur_item) {
+        ++item->modules_freed;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    ++background.modules_freed;
+}
+
+void Stats::write(const Stats_options& options) {
+    Item_stats total = this->total();
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!options.json_file.empty() && !write_json(options.json_file, total))
+        fprintf(stderr, "Could not write %s\n", options.json_file.c_str());
+    if (!options.csv_file.empty() && !write_csv(options.csv_file, total))
+        fprintf(stderr, "Could not write %s\n", options.csv_file.c_str());
+
+    if (options.summary)
+        write_summary(total);
+    else {
+        // Reset the pass timers quietly, LLVM prints them at exit otherwise.
+        raw_null_ostream null;
+        reportAndResetTimings(&null);
+    }
+}
+
+static void print_row(const Item_stats& item) {
+    fprintf(stderr, "%-24.24s", item.label.c_str());
+    for (double t : item.ms)
+        fprintf(stderr, " %9.3f", t);
+    fprintf(stderr, " %8llu %8llu %5llu %9llu %5llu %9llu\n",
+            (unsigned long long)item.ast_nodes,
+            (unsigned long long)item.ir_instructions,
+            (unsigned long long)item.modules,
+            (unsigned long long)item.jit_bytes,
+            (unsigned long long)item.modules_freed,
+            (unsigned long long)item.jit_resident_bytes / 1024);
+}
+
+void Stats::write_summary(const Item_stats& total) {
+    std::vector<const Item_stats*> sorted;
+    for (auto& item : items)
+        sorted.push_back(&item);
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const Item_stats* a, const Item_stats* b) {
+                         return a->total_ms() > b->total_ms();
+                     });
+    if (sorted.size() > summary_items)
+        sorted.resize(summary_items);
+
+    fprintf(stderr, "\nPhase times (ms) of %zu items\n%-24s", items.size(),
+            "item");
+    for (unsigned i = 0; i != num_phases; ++i)
+        fprintf(stderr, " %9.9s", phase_name(static_cast<Phase>(i)));
+    fprintf(stderr, " %8s %8s %5s %9s %5s %9s\n", "ast", "ir", "objs",
+            "jit bytes", "freed", "jit kib");
+    for (auto* item : sorted)
+        print_row(*item);
+    if (background.modules)
+        print_row(background);
+    print_row(total);
+
+    // Then LLVM's table of the time in each pass.
+    fflush(stderr);
+    reportAndResetTimings(&errs());
+}
+
+// json_string - 's' as a quoted JSON string.
+static std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else
+            out += c;
+    }
+    return out + "\"";
+}
+
+static void write_json_item(raw_ostream& os, const Item_stats& item) {
+    os << "{\"label\": " << json_string(item.label);
+    for (unsigned i = 0; i != num_phases; ++i)
+        os << ", \"" << phase_name(static_cast<Phase>(i))
+           << "_ms\": " << format("%.6f", item.ms[i]);
+    os << ", \"ast_nodes\": " << item.ast_nodes
+       << ", \"ir_instructions\": " << item.ir_instructions
+       << ", \"modules\": " << item.modules
+       << ", \"jit_bytes\": " << item.jit_bytes
+       << ", \"modules_freed\": " << item.modules_freed
+       << ", \"jit_resident_bytes\": " << item.jit_resident_bytes << "}";
+}
+
+bool Stats::write_json(const std::string& filename, const Item_stats& total) {
+    std::error_code ec;
+    raw_fd_ostream os(filename, ec, sys::fs::OF_None);
+    if (ec)
+        return false;
+
+    os << "{\n\"items\": [";
+    const char* delim = "\n";
+    for (auto& item : items) {
+        os << delim << "  ";
+        write_json_item(os, item);
+        delim = ",\n";
+    }
+    os << "\n],\n\"background\": ";
+    write_json_item(os, background);
+    os << ",\n\"total\": ";
+    write_json_item(os, total);
+
+    // Every pass timed so far in the process, by every session, not only
+    // this one: LLVM keeps one table.
+    os << ",\n\"passes_scope\": \"process\"";
+    os << ",\n\"passes\": {\n";
+    TimerGroup::printAllJSONValues(os, "");
+    os << "\n}\n}\n";
+    return !os.has_error();
+}
+
+// csv_field - 's' quoted for a CSV file.
+static std::string csv_field(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static void write_csv_item(raw_ostream& os, const Item_stats& item) {
+    os << csv_field(item.label);
+    for (double t : item.ms)
+        os << "," << format("%.6f", t);
+    os << "," << item.ast_nodes << "," << item.ir_instructions << ","
+       << item.modules << "," << item.jit_bytes << "," << item.modules_freed
+       << "," << item.jit_resident_bytes << "\n";
+}
+
+bool Stats::write_csv(const std::string& filename, const Item_stats& total) {
+    std::error_code ec;
+    raw_fd_ostream os(filename, ec, sys::fs::OF_None);
+    if (ec)
+        return false;
+
+    os << "label";
+    for (unsigned i = 0; i != num_phases; ++i)
+        os << "," << phase_name(static_cast<Phase>(i)) << "_ms";
+    os << ",ast_nodes,ir_instructions,modules,jit_bytes,modules_freed,"
+          "jit_resident_bytes\n";
+    for (auto& item : items)
+        write_csv_item(os, item);
+    write_csv_item(os, background);
+    write_csv_item(os, total);
+    return !os.has_error();
+}
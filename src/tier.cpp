@@ -0,0 +1,276 @@
+#include <chrono>
+
+#include "pipeline.h"
+#include "tier.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+// Tier_record - Clean IR and live profile counters of one definition.
+//
+// Counter layout: [0] function entries, then for every loop in preorder its
+// header executions and its back-edges taken. The JIT-ed code bumps them with
+// monotonic atomic adds while the background thread reads them relaxed.
+struct Tier_record {
+    std::string name;
+    unsigned generation;
+    SmallString<0> bitcode;
+    std::unique_ptr<uint64_t[]> counters;
+    unsigned num_loops;
+    bool promoted = false;
+    // The JIT-ed bodies behind the stub, the tier-1 one once swapped in.
+    std::string tier0_name;
+    std::string tier1_name;
+    // Unloaded records keep the stub's target, but are not profiled.
+    bool unloaded = false;
+    // A tier-1 compile is using the record, see Tier_manager::retire.
+    bool compiling = false;
+    bool retired = false;
+};
+
+static void emit_increment(BasicBlock& bb, uint64_t* counter) {
+    IRBuilder<> b(&*bb.getFirstInsertionPt());
+    Type* counter_ty = b.getInt64Ty();
+    Value* ptr = b.CreateIntToPtr(b.getInt64(reinterpret_cast<uintptr_t>(counter)),
+                                  counter_ty->getPointerTo());
+    b.CreateAtomicRMW(AtomicRMWInst::Add, ptr, b.getInt64(1),
+                      AtomicOrdering::Monotonic);
+}
+
+// read_counter - A counter the JIT-ed code may be updating.
+static uint64_t read_counter(const uint64_t& counter) {
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+// instrument - Add entry and loop counters to the tier-0 body.
+static std::unique_ptr<uint64_t[]> instrument(Function& f, unsigned& num_loops) {
+    DominatorTree dt(f);
+    LoopInfo li(dt);
+    auto loops = li.getLoopsInPreorder();
+    num_loops = loops.size();
+
+    auto counters = std::make_unique<uint64_t[]>(1 + 2 * num_loops);
+
+    // Collect the edges first, splitting them invalidates the loop info.
+    std::vector<std::pair<BasicBlock*, BasicBlock*>> back_edges;
+    for (auto* loop : loops)
+        back_edges.emplace_back(loop->getHeader(), loop->getLoopLatch());
+
+    emit_increment(f.getEntryBlock(), &counters[0]);
+    for (unsigned i = 0; i != num_loops; ++i) {
+        BasicBlock* header = back_edges[i].first;
+        BasicBlock* latch = back_edges[i].second;
+
+        emit_increment(*header, &counters[1 + 2 * i]);
+        // Loops with several latches only get their header counted.
+        if (latch)
+            emit_increment(*SplitEdge(latch, header), &counters[2 + 2 * i]);
+    }
+
+    return counters;
+}
+
+static uint64_t hotness(const Tier_record& rec) {
+    uint64_t sum = read_counter(rec.counters[0]);
+    for (unsigned i = 0; i != rec.num_loops; ++i)
+        sum += read_counter(rec.counters[2 + 2 * i]);
+    return sum;
+}
+
+// apply_profile - Turn the counters into an entry count and branch weights on
+// the loop latches of the clean IR. Its loops are enumerated in the same
+// order as when the tier-0 body was instrumented.
+static void apply_profile(Function& f, const Tier_record& rec) {
+    const uint64_t* counters = rec.counters.get();
+    f.setEntryCount(Function::ProfileCount(read_counter(counters[0]),
+                                           Function::PCT_Real));
+
+    DominatorTree dt(f);
+    LoopInfo li(dt);
+    auto loops = li.getLoopsInPreorder();
+    MDBuilder mdb(f.getContext());
+
+    for (unsigned i = 0, e = std::min<unsigned>(loops.size(), rec.num_loops);
+         i != e; ++i) {
+        BasicBlock* latch = loops[i]->getLoopLatch();
+        if (!latch)
+            continue;
+        auto* br = dyn_cast<BranchInst>(latch->getTerminator());
+        if (!br || !br->isConditional())
+            continue;
+
+        uint64_t back = read_counter(counters[2 + 2 * i]);
+        uint64_t header = read_counter(counters[1 + 2 * i]);
+        uint64_t exits = header > back ? header - back : 1;
+
+        // Branch weights are 32 bit.
+        uint64_t scale = std::max(back, exits) / UINT32_MAX + 1;
+        uint32_t back_w = std::max<uint64_t>(back / scale, 1);
+        uint32_t exit_w = std::max<uint64_t>(exits / scale, 1);
+
+        bool back_first = br->getSuccessor(0) == loops[i]->getHeader();
+        br->setMetadata(LLVMContext::MD_prof,
+                        back_first ? mdb.createBranchWeights(back_w, exit_w)
+                                   : mdb.createBranchWeights(exit_w, back_w));
+    }
+}
+
+// compile_tier1 - Build the tier-1 object in a private context, so it can run
+// while the main thread keeps generating code.
+static std::unique_ptr<MemoryBuffer> compile_tier1(const Tier_record& rec,
+                                                   TargetMachine& tm,
+                                                   const std::string& body_name) {
+    LLVMContext ctx;
+    auto m = parseBitcodeFile(MemoryBufferRef(rec.bitcode, rec.name), ctx);
+    if (!m) {
+        logAllUnhandledErrors(m.takeError(), errs(), "tier: ");
+        return nullptr;
+    }
+
+    (*m)->setDataLayout(tm.createDataLayout());
+    Function* f = (*m)->getFunction(rec.name);
+    apply_profile(*f, rec);
+    f->setName(body_name);
+
+    optimize_aggressive(**m, tm);
+    return compile_object(**m, tm);
+}
+
+Tier_manager::Tier_manager(KaleidoscopeJIT& jit, const Tier_options& options)
+    : jit(jit), options(options) {}
+
+Tier_manager::~Tier_manager() {
+    stop();
+}
+
+// promote - Recompile one hot definition and swap it in, unless it was
+// redefined or unloaded in the meantime. Called and returns with 'lock' held.
+void Tier_manager::promote(Tier_record& rec, TargetMachine& tm,
+                           std::unique_lock<std::mutex>& lock) {
+    rec.compiling = true;
+    lock.unlock();
+    std::string body_name = rec.name + ".tier1." + std::to_string(rec.generation);
+    auto object = compile_tier1(rec, tm, body_name);
+    VModuleKey k = 0;
+    JITTargetAddress addr = 0;
+    if (object) {
+        k = jit.addObject(std::move(object));
+        addr = cantFail(jit.findSymbol(body_name).getAddress());
+    }
+    lock.lock();
+    rec.compiling = false;
+
+    if (addr && !rec.retired && !rec.unloaded) {
+        jit.setStub(rec.name, addr);
+        rec.tier1_name = body_name;
+    } else if (addr)
+        jit.removeModule(k);
+
+    if (rec.retired)
+        retire(&rec);
+}
+
+// retire - Free a record whose stub points elsewhere now, and its bodies in
+// the JIT. A record being compiled is freed by promote when it is done.
+void Tier_manager::retire(Tier_record* rec) {
+    rec->retired = true;
+    if (rec->compiling)
+        return;
+    jit.removeSymbol(rec->tier0_name);
+    if (!rec->tier1_name.empty())
+        jit.removeSymbol(rec->tier1_name);
+    for (auto it = records.begin(); it != records.end(); ++it)
+        if (it->get() == rec) {
+            records.erase(it);
+            break;
+        }
+}
+
+void Tier_manager::loop() {
+    auto tm = create_host_target_machine();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        cv.wait_for(lock, std::chrono::milliseconds(options.poll_ms));
+
+        std::vector<Tier_record*> hot;
+        for (auto& live : live_records) {
+            Tier_record* rec = live.second;
+            if (!rec->promoted && !rec->unloaded &&
+                hotness(*rec) >= options.threshold) {
+                rec->promoted = true;
+                hot.push_back(rec);
+            }
+        }
+
+        for (auto* rec : hot) {
+            if (stopping)
+                break;
+            promote(*rec, *tm, lock);
+        }
+    }
+}
+
+void Tier_manager::start() {
+    thread = std::thread(&Tier_manager::loop, this);
+}
+
+void Tier_manager::stop() {
+    if (!thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    thread.join();
+}
+
+void Tier_manager::add_definition(std::unique_ptr<Module> m,
+                                  const std::string& name) {
+    auto rec = std::make_unique<Tier_record>();
+    rec->name = name;
+    rec->generation = next_generation++;
+
+    // Keep the clean, optimized IR for the tier-1 compile.
+    raw_svector_ostream os(rec->bitcode);
+    WriteBitcodeToFile(*m, os);
+
+    Function* f = m->getFunction(name);
+    rec->counters = instrument(*f, rec->num_loops);
+
+    // Route every call, including recursive ones, through the stub so they
+    // reach the tier-1 body once it is swapped in.
+    std::string body_name = name + ".tier0." + std::to_string(rec->generation);
+    rec->tier0_name = body_name;
+    f->setName(body_name);
+    Function* decl = Function::Create(f->getFunctionType(),
+                                      Function::ExternalLinkage, name, m.get());
+    f->replaceAllUsesWith(decl);
+
+    jit.addModule(std::move(m));
+    auto addr = cantFail(jit.findSymbol(body_name).getAddress());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    jit.setStub(name, addr);
+    // Calls no longer reach the bodies of the previous definition.
+    Tier_record*& live = live_records[name];
+    if (live)
+        retire(live);
+    live = rec.get();
+    records.push_back(std::move(rec));
+}
+
+void Tier_manager::remove_definition(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto live = live_records.find(name);
+    if (live != live_records.end())
+        live->second->unloaded = true;
+}
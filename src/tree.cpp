@@ -1,79 +1,296 @@
+#include <cmath>
 #include <cstdint>
 
 #include "tree.h"
+#include "driver.h"
 #include "parser.h"
+#include "fast_math.h"
+#include "math_lib.h"
 
 using namespace llvm;
 using namespace llvm::orc;
 
-LLVMContext the_context;
-std::unique_ptr<Module> the_module;
-IRBuilder<> builder(the_context);
-std::map<std::string, AllocaInst*> named_values;
-std::unique_ptr<legacy::FunctionPassManager> the_fpm;
-std::unique_ptr<KaleidoscopeJIT> the_jit;
-std::map<std::string, std::unique_ptr<Prototype_AST>> function_protos;
-
 Function* get_function(std::string name);
 
 static Value* log_error_v(const char* str) {
-    fprintf(stderr, "log_error: %s\n", str);
+    current_session().error(str);
     return nullptr;
 }
 
 static AllocaInst* create_entry_block_alloca(Function* the_function,
-                                             const std::string& var_name) {
+                                             const std::string& var_name,
+                                             Type* type = nullptr) {
     IRBuilder<> tmp_b(&the_function->getEntryBlock(),
                       the_function->getEntryBlock().begin());
-    return tmp_b.CreateAlloca(Type::getDoubleTy(the_context), 0,
-                              var_name.c_str());
+    if (!type)
+        type = Type::getDoubleTy(the_function->getContext());
+    return tmp_b.CreateAlloca(type, 0, var_name.c_str());
+}
+
+// convertible - Whether convert() accepts these types: any two scalars, a
+// scalar to a vector, or twice the same array or vector type.
+static bool convertible(Type* from, Type* to) {
+    if (from->isPointerTy() || to->isPointerTy() || from->isVectorTy())
+        return from == to;
+    return true;
+}
+
+// convert - 'v' as a value of type 'to'. Doubles, floats and ints convert
+// into each other like in C, a scalar converts to a vector with it in every
+// lane, arrays and vectors do not convert.
+static Value* convert(Value* v, Type* to) {
+    Session& s = current_session();
+    Type* from = v->getType();
+    if (from == to)
+        return v;
+    if (!convertible(from, to))
+        return log_error_v(from->isPointerTy() || to->isPointerTy()
+                                   ? "Invalid conversion of an array."
+                                   : "Invalid conversion of a vector.");
+    if (to->isVectorTy()) {
+        v = convert(v, to->getVectorElementType());
+        return s.builder.CreateVectorSplat(to->getVectorNumElements(), v,
+                                           "splat");
+    }
+    if (from->isIntegerTy())
+        return to->isIntegerTy() ? s.builder.CreateSExtOrTrunc(v, to)
+                                 : s.builder.CreateSIToFP(v, to, "tofp");
+    if (to->isIntegerTy())
+        return s.builder.CreateFPToSI(v, to, "toint");
+    return s.builder.CreateFPCast(v, to, "fpcast");
+}
+
+// to_bool - Compare a scalar non-equal to zero.
+static Value* to_bool(Value* v, const char* name) {
+    Session& s = current_session();
+    if (v->getType()->isVectorTy())
+        return log_error_v("Conditions cannot be vectors.");
+    Value* zero = Constant::getNullValue(v->getType());
+    if (v->getType()->isIntegerTy() || v->getType()->isPointerTy())
+        return s.builder.CreateICmpNE(v, zero, name);
+    return s.builder.CreateFCmpONE(v, zero, name);
+}
+
+// type_rank - Order of the types in promotions: int, float, double, vector.
+static unsigned type_rank(Type* type) {
+    if (type->isIntegerTy())
+        return 0;
+    if (type->isVectorTy())
+        return 3;
+    return type->isFloatTy() ? 1 : 2;
+}
+
+// operator_name - The function defining the operator 'name' for 'operands',
+// see overload_name.
+static std::string operator_name(const std::string& name,
+                                 ArrayRef<Value*> operands) {
+    std::vector<Value_type> types;
+    for (Value* v : operands) {
+        Value_type type;
+        if (!value_type_of(v->getType(), type))
+            return name;
+        types.push_back(type);
+    }
+    return overload_name(name, types);
+}
+
+// literal_fits - Whether the literal 'val' keeps its value as a 'type'.
+static bool literal_fits(double val, Type* type) {
+    if (!type->getScalarType()->isIntegerTy())
+        return true;
+    return val == std::floor(val) && val >= -9223372036854775808.0 &&
+           val < 9223372036854775808.0;
+}
+
+// common_type - The type two operands are converted to. A literal takes the
+// type of the other operand when it converts to it exactly, so 'i + 1' stays
+// an integer add while 'i * 0.5' does not, otherwise the higher ranked type
+// wins.
+static Type* common_type(Value* l, Expr_AST* lhs, Value* r, Expr_AST* rhs) {
+    double l_val, r_val;
+    bool l_literal = lhs->as_constant(l_val);
+    bool r_literal = rhs->as_constant(r_val);
+    if (l_literal && !r_literal && literal_fits(l_val, r->getType()))
+        return r->getType();
+    if (r_literal && !l_literal && literal_fits(r_val, l->getType()))
+        return l->getType();
+    return type_rank(l->getType()) >= type_rank(r->getType()) ? l->getType()
+                                                              : r->getType();
+}
+
+// inline_operator - Expand the body of the user-defined operator 'name' at the
+// insertion point, with its parameters bound to the values in 'args'. Returns
+// nullptr if the body is not available or already being expanded, the caller
+// then emits a call instead.
+static Value* inline_operator(const std::string& name, ArrayRef<Value*> args) {
+    Session& s = current_session();
+    auto it = s.operator_bodies.find(name);
+    if (it == s.operator_bodies.end() || it->second.expanding)
+        return nullptr;
+    Operator_body& op = it->second;
+
+    // Leave type errors to the call.
+    for (uint32_t i = 0, e = op.args.size(); i != e; ++i)
+        if (!convertible(args[i]->getType(),
+                         llvm_type(s.the_context, op.arg_types[i])))
+            return nullptr;
+
+    // Bind the parameters, shadowing any variables of the same name, the way
+    // var/in does.
+    Function* the_function = s.builder.GetInsertBlock()->getParent();
+    std::vector<AllocaInst*> old_bindings;
+    for (uint32_t i = 0, e = op.args.size(); i != e; ++i) {
+        Type* type = llvm_type(s.the_context, op.arg_types[i]);
+        AllocaInst* alloca_var = create_entry_block_alloca(the_function,
+                                                           op.args[i], type);
+        s.builder.CreateStore(convert(args[i], type), alloca_var);
+        old_bindings.push_back(s.named_values[op.args[i]]);
+        s.named_values[op.args[i]] = alloca_var;
+    }
+
+    // The body is not in tail position of the function it is expanded into.
+    BasicBlock* tail_recurse_bb = s.tail_recurse_bb;
+    s.tail_recurse_bb = nullptr;
+    op.expanding = true;
+    Value* val = op.body->codegen();
+    op.expanding = false;
+    s.tail_recurse_bb = tail_recurse_bb;
+
+    // Pop the parameters from scope.
+    for (uint32_t i = 0, e = op.args.size(); i != e; ++i)
+        s.named_values[op.args[i]] = old_bindings[i];
+
+    return val ? convert(val, llvm_type(s.the_context, op.ret_type)) : nullptr;
 }
 
 Value* Number_expr_AST::codegen() {
-    return ConstantFP::get(the_context, APFloat(val));
+    Session& s = current_session();
+    return ConstantFP::get(s.the_context, APFloat(val));
+}
+
+Value* Expr_AST::address() {
+    return log_error_v("Destination of '=' must be a variable or an element.");
+}
+
+Value* Variable_expr_AST::address() {
+    Session& s = current_session();
+    AllocaInst* v = s.named_values[name];
+    if (!v)
+        return log_error_v("Unknown variable name.");
+    return v;
 }
 
 Value* Variable_expr_AST::codegen() {
+    Session& s = current_session();
     // Look this variable up in the function.
-    Value* v = named_values[name];
+    Value* v = s.named_values[name];
     if (!v)
         log_error_v("Unknown variable name.");
 
     // Load the value.
-    return builder.CreateLoad(v, name.c_str());
+    return s.builder.CreateLoad(v, name.c_str());
+}
+
+Value* Index_expr_AST::codegen_index() {
+    Session& s = current_session();
+    // Indexing with the variable of a counted loop uses its integer counter.
+    if (const std::string* var = index->as_variable()) {
+        auto counter = s.loop_counters.find(s.named_values[*var]);
+        if (counter != s.loop_counters.end())
+            return s.builder.CreateLoad(counter->second, "iv");
+    }
+
+    Value* idx = index->codegen();
+    if (!idx)
+        return nullptr;
+    return convert(idx, Type::getInt64Ty(s.the_context));
+}
+
+Value* Index_expr_AST::address() {
+    Session& s = current_session();
+    AllocaInst* v = s.named_values[name];
+    if (!v)
+        return log_error_v("Unknown variable name.");
+    Type* type = v->getAllocatedType();
+    if (!type->isPointerTy() && !type->isVectorTy())
+        return log_error_v("Only arrays and vectors can be indexed.");
+
+    Value* idx = codegen_index();
+    if (!idx)
+        return nullptr;
+
+    // A lane of a vector variable.
+    if (type->isVectorTy()) {
+        Value* lane[] = {ConstantInt::get(idx->getType(), 0), idx};
+        return s.builder.CreateInBoundsGEP(v, lane, name + ".addr");
+    }
+
+    Value* base = s.builder.CreateLoad(v, name.c_str());
+    return s.builder.CreateInBoundsGEP(base, idx, name + ".addr");
+}
+
+Value* Index_expr_AST::codegen() {
+    Session& s = current_session();
+    // A lane is extracted from the vector value.
+    AllocaInst* v = s.named_values[name];
+    if (v && v->getAllocatedType()->isVectorTy()) {
+        Value* idx = codegen_index();
+        if (!idx)
+            return nullptr;
+        Value* vec = s.builder.CreateLoad(v, name.c_str());
+        return s.builder.CreateExtractElement(vec, idx, name + ".lane");
+    }
+
+    Value* ptr = address();
+    if (!ptr)
+        return nullptr;
+    return s.builder.CreateLoad(ptr, name + ".elt");
 }
 
 Value* Unary_expr_AST::codegen() {
+    Session& s = current_session();
     Value* operand_v = operand->codegen();
     if (!operand_v)
         return nullptr;
 
-    Function* f = get_function(std::string("unary") + opcode);
+    // Prefer an overload for the operand type.
+    std::string name = std::string("unary") + opcode;
+    std::string overload = operator_name(name, operand_v);
+    if (overload != name &&
+        (s.operator_bodies.count(overload) || get_function(overload)))
+        name = overload;
+    if (Value* v = inline_operator(name, operand_v))
+        return v;
+
+    Function* f = get_function(name);
     if (!f)
         return log_error_v("Unknown unary operator.");
 
-    return builder.CreateCall(f, operand_v, "unop");
+    operand_v = convert(operand_v, f->getFunctionType()->getParamType(0));
+    if (!operand_v)
+        return nullptr;
+    return s.builder.CreateCall(f, operand_v, "unop");
 }
 
 Value* Binary_expr_AST::codegen() {
+    Session& s = current_session();
     // Special case '=', because we don't want to emit the LHS as an expression.
     if (op == '=') {
-        // Assignment requires the LHS to be an identifier.
-        Variable_expr_AST* lhse = (Variable_expr_AST*)lhs.get();
-        if (!lhse)
-            return log_error_v("Destination of '=' must be a variable.");
-
         // Codegen the RHS.
         Value* val = rhs->codegen();
         if (!val)
             return nullptr;
 
-        // Look up the name.
-        Value* variable = named_values[lhse->get_name()];
-        if (!variable)
-            return log_error_v("Unknown variable name.");
+        // Assignment requires the LHS to be a variable or an array element.
+        Value* ptr = lhs->address();
+        if (!ptr)
+            return nullptr;
 
-        builder.CreateStore(val, variable);
+        // The value takes the type of the destination.
+        val = convert(val, ptr->getType()->getPointerElementType());
+        if (!val)
+            return nullptr;
+        s.builder.CreateStore(val, ptr);
         return val;
     }
 
@@ -83,134 +300,304 @@ Value* Binary_expr_AST::codegen() {
     if (!l || !r)
         return nullptr;
 
+    // The builtin operators work on operands of one type. They apply lane by
+    // lane to vectors, a scalar operand is used in every lane.
+    Type* type = common_type(l, lhs.get(), r, rhs.get());
+    bool is_int = type->isIntegerTy();
+    if (op == '+' || op == '-' || op == '*' || op == '<') {
+        if (type->isPointerTy())
+            return log_error_v("Arrays can only be indexed.");
+        l = convert(l, type);
+        r = convert(r, type);
+        if (!l || !r)
+            return nullptr;
+    }
+
     switch (op) {
     case '+':
-        return builder.CreateFAdd(l, r, "addtmp");
+        if (is_int)
+            return s.builder.CreateAdd(l, r, "addtmp");
+        return s.builder.CreateFAdd(l, r, "addtmp");
     case '-':
-        return builder.CreateFSub(l, r, "subtmp");
+        if (is_int)
+            return s.builder.CreateSub(l, r, "subtmp");
+        return s.builder.CreateFSub(l, r, "subtmp");
     case '*':
-        return builder.CreateFMul(l, r, "multmp");
+        if (is_int)
+            return s.builder.CreateMul(l, r, "multmp");
+        return s.builder.CreateFMul(l, r, "multmp");
     case '<':
-        l = builder.CreateFCmpULT(l, r, "cmptmp");
-        // Convert bool 0/1 to double 0.0 or 1.0.
-        return builder.CreateUIToFP(l, Type::getDoubleTy(the_context),
-                                    "booltmp");
+        // Convert bool 0/1 to 0 or 1 of the operand type.
+        if (is_int) {
+            l = s.builder.CreateICmpSLT(l, r, "cmptmp");
+            return s.builder.CreateZExt(l, type, "booltmp");
+        }
+        l = s.builder.CreateFCmpULT(l, r, "cmptmp");
+        return s.builder.CreateUIToFP(l, type, "booltmp");
     default:
         break;
     }
 
-    // If it wasn't a builtin binary operator, it must be a user defined one.
-    // Emit a call to it.
-    Function* f = get_function(std::string("binary") + op);
-    assert(f && "binary operator not found!");
-
+    // If it wasn't a builtin binary operator, it must be a user defined one,
+    // overloaded for the operand types or not. Expand its body here, or emit a
+    // call to it.
+    std::string name = std::string("binary") + op;
     Value* ops[2] = { l, r };
-    return builder.CreateCall(f, ops, "binop");
+    std::string overload = operator_name(name, ops);
+    if (overload != name &&
+        (s.operator_bodies.count(overload) || get_function(overload)))
+        name = overload;
+    if (Value* v = inline_operator(name, ops))
+        return v;
+
+    // Only overloads for other operand types may exist.
+    Function* f = get_function(name);
+    if (!f)
+        return log_error_v("Unknown binary operator.");
+
+    for (unsigned i = 0; i < 2; ++i) {
+        ops[i] = convert(ops[i], f->getFunctionType()->getParamType(i));
+        if (!ops[i])
+            return nullptr;
+    }
+    return s.builder.CreateCall(f, ops, "binop");
 }
 
 Value* If_expr_AST::codegen() {
+    Session& s = current_session();
     Value* cond_v = cond->codegen();
     if (!cond_v)
         return nullptr;
 
-    // Convert condition to a bool by comparing non-equal to 0.0.
-    cond_v = builder.CreateFCmpONE(cond_v,
-                                   ConstantFP::get(the_context, APFloat(0.0)),
-                                   "ifcond");
+    // Convert condition to a bool by comparing non-equal to 0.
+    cond_v = to_bool(cond_v, "ifcond");
+    if (!cond_v)
+        return nullptr;
 
-    Function* the_function = builder.GetInsertBlock()->getParent();
+    Function* the_function = s.builder.GetInsertBlock()->getParent();
 
     // Create blocks for the then and else cases. Insert the 'then' block at
     // the end of the function.
-    BasicBlock* then_bb = BasicBlock::Create(the_context, "then", the_function);
-    BasicBlock* else_bb = BasicBlock::Create(the_context, "else");
-    BasicBlock* merge_bb = BasicBlock::Create(the_context, "ifcont");
+    BasicBlock* then_bb = BasicBlock::Create(s.the_context, "then", the_function);
+    BasicBlock* else_bb = BasicBlock::Create(s.the_context, "else");
+    BasicBlock* merge_bb = BasicBlock::Create(s.the_context, "ifcont");
 
-    builder.CreateCondBr(cond_v, then_bb, else_bb);
+    s.builder.CreateCondBr(cond_v, then_bb, else_bb);
 
     // Emit then value.
-    builder.SetInsertPoint(then_bb);
+    s.builder.SetInsertPoint(then_bb);
 
     Value* then_v = then->codegen();
     if (!then_v)
         return nullptr;
 
-    builder.CreateBr(merge_bb);
     // Codegen of 'then' can change the current block, update then_bb
-    // for the PHI.
-    then_bb = builder.GetInsertBlock();
+    // for the PHI. Its branch waits until the type of the result is known.
+    then_bb = s.builder.GetInsertBlock();
 
     // Emit else block.
     the_function->getBasicBlockList().push_back(else_bb);
-    builder.SetInsertPoint(else_bb);
+    s.builder.SetInsertPoint(else_bb);
 
     Value* else_v = elze->codegen();
     if (!else_v)
         return nullptr;
 
-    builder.CreateBr(merge_bb);
+    // Both arms end converting to the common type.
+    Type* type = common_type(then_v, then.get(), else_v, elze.get());
+    else_v = convert(else_v, type);
+    if (!else_v)
+        return nullptr;
+    s.builder.CreateBr(merge_bb);
     // Codege of 'else' can change the current block, update else_bb
     // for the PHI.
-    else_bb = builder.GetInsertBlock();
+    else_bb = s.builder.GetInsertBlock();
+
+    s.builder.SetInsertPoint(then_bb);
+    then_v = convert(then_v, type);
+    if (!then_v)
+        return nullptr;
+    s.builder.CreateBr(merge_bb);
 
     // Emit merge block.
     the_function->getBasicBlockList().push_back(merge_bb);
-    builder.SetInsertPoint(merge_bb);
-    PHINode* pn = builder.CreatePHI(Type::getDoubleTy(the_context), 2, "iftmp");
+    s.builder.SetInsertPoint(merge_bb);
+    PHINode* pn = s.builder.CreatePHI(type, 2, "iftmp");
     pn->addIncoming(then_v, then_bb);
     pn->addIncoming(else_v, else_bb);
 
     return pn;
 }
 
-// Output for-loop as:
-//  var = alloca double
-//  ...
-//  start = startexpr
-//  store start -> var
-//  goto loop
-// loop:
-//  ...
-//  bodyexpr
-//  ...
-// loopend:
-//  step = stepexpr
-//  endcond = endexpr
-//
-//  curvar = load var
-//  nextvar = curvar + step
-//  store nextvar -> va
-//  br endcond, loop, endloop
-// endloop:
-//  ...
+// is_counted - Whether this is 'for i = a, i < e, s in ...' with integral a,
+// integral s > 0, an e the body cannot change and a body that does not assign
+// i. Such a loop can count with an integer induction variable.
+bool For_expr_AST::is_counted(double& start_val, double& step_val,
+                              Expr_AST*& bound) {
+    // Doubles hold every integer up to 2^53 exactly.
+    const double max_exact = 9007199254740992.0;
+    if (!start->as_constant(start_val) || start_val != std::floor(start_val) ||
+        std::fabs(start_val) >= max_exact)
+        return false;
+
+    step_val = 1.0;
+    if (step && !step->as_constant(step_val))
+        return false;
+    if (step_val <= 0 || step_val != std::floor(step_val) ||
+        step_val >= max_exact)
+        return false;
+
+    Expr_AST* lhs;
+    if (!end->as_less_than(lhs, bound))
+        return false;
+    const std::string* var = lhs->as_variable();
+    if (!var || *var != var_name)
+        return false;
+
+    double bound_val;
+    if (!bound->as_constant(bound_val)) {
+        const std::string* name = bound->as_variable();
+        if (!name || *name == var_name || body->assigns(*name))
+            return false;
+    }
+
+    return !body->assigns(var_name);
+}
+
+// integral_bound - For a double e, the i64 n with i < n exactly when i < e
+// (the unordered compare of '<') for every integer i. NaN, which keeps the
+// loop going, and values out of range saturate.
+static Value* integral_bound(Value* e) {
+    Session& s = current_session();
+    Type* double_ty = Type::getDoubleTy(s.the_context);
+    // Far beyond any trip count, and exact in both types.
+    Value* limit = ConstantFP::get(double_ty, 4611686018427387904.0);
+    Value* neg_limit = ConstantFP::get(double_ty, -4611686018427387904.0);
+
+    Function* ceil_f = Intrinsic::getDeclaration(
+            s.builder.GetInsertBlock()->getModule(), Intrinsic::ceil, double_ty);
+    Value* n = s.builder.CreateCall(ceil_f, e, "bound");
+    n = s.builder.CreateSelect(s.builder.CreateFCmpUGE(n, limit), limit, n);
+    n = s.builder.CreateSelect(s.builder.CreateFCmpOLT(n, neg_limit),
+                               neg_limit, n);
+    return s.builder.CreateFPToSI(n, Type::getInt64Ty(s.the_context), "bound");
+}
+
+// loop_metadata - The llvm.loop node carrying 'hints', null if there are
+// none.
+static MDNode* loop_metadata(LLVMContext& ctx, const Loop_hints& hints) {
+    auto hint = [&](const char* name, Type* type, unsigned val) -> Metadata* {
+        return MDNode::get(ctx, {MDString::get(ctx, name),
+                                 ConstantAsMetadata::get(
+                                         ConstantInt::get(type, val))});
+    };
+    Type* i1 = Type::getInt1Ty(ctx);
+    Type* i32 = Type::getInt32Ty(ctx);
+
+    SmallVector<Metadata*, 5> ops;
+    // The node refers to itself, filled in below.
+    ops.push_back(nullptr);
+    if (hints.vectorize) {
+        ops.push_back(hint("llvm.loop.vectorize.width", i32, hints.vectorize));
+        ops.push_back(hint("llvm.loop.vectorize.enable", i1,
+                           hints.vectorize > 1));
+    }
+    if (hints.interleave)
+        ops.push_back(hint("llvm.loop.interleave.count", i32,
+                           hints.interleave));
+    if (hints.unroll == 1)
+        ops.push_back(MDNode::get(ctx,
+                                  MDString::get(ctx, "llvm.loop.unroll.disable")));
+    else if (hints.unroll)
+        ops.push_back(hint("llvm.loop.unroll.count", i32, hints.unroll));
+
+    if (ops.size() == 1)
+        return nullptr;
+    MDNode* loop_id = MDNode::getDistinct(ctx, ops);
+    loop_id->replaceOperandWith(0, loop_id);
+    return loop_id;
+}
+
+// The loop is emitted in the rotated form the loop passes expect: the block
+// before it is the preheader, 'loop' is the header and 'loop.latch' holds the
+// step and the exit test, so the body still runs once before the end
+// condition is checked:
+//   preheader:
+//     store start -> var      (counted loops: store start -> var.iv)
+//     br loop
+//   loop:
+//     (counted loops: store var.iv converted -> var)
+//     bodyexpr
+//     br loop.latch
+//   loop.latch:
+//     endcond = endexpr       (counted loops: var.iv < bound)
+//     store var + step -> var (counted loops: var.iv + step -> var.iv)
+//     br endcond, loop, afterloop
+//   afterloop:
 Value* For_expr_AST::codegen() {
-    Function* the_function = builder.GetInsertBlock()->getParent();
+    Session& s = current_session();
+    Function* the_function = s.builder.GetInsertBlock()->getParent();
 
     // Create an alloca for the variable in the entry block.
-    AllocaInst* alloca_var = create_entry_block_alloca(the_function, var_name);
+    Type* var_ty = llvm_type(s.the_context, var_type);
+    AllocaInst* alloca_var = create_entry_block_alloca(the_function, var_name,
+                                                       var_ty);
 
     // Emit the start code first, without 'variable' in scope.
     Value* start_val = start->codegen();
+    if (start_val)
+        start_val = convert(start_val, var_ty);
     if (!start_val)
         return nullptr;
 
     // Store the value into the alloca.
-    builder.CreateStore(start_val, alloca_var);
+    s.builder.CreateStore(start_val, alloca_var);
+
+    // A counted loop steps an integer copy of the variable, which the loop
+    // passes can compute trip counts from. Its bound is evaluated once.
+    double start_c, step_c;
+    Expr_AST* bound = nullptr;
+    bool counted = is_counted(start_c, step_c, bound);
+    Type* i64 = Type::getInt64Ty(s.the_context);
+    AllocaInst* iv_var = nullptr;
+    Value* bound_val = nullptr;
+    if (counted) {
+        Value* bound_v = bound->codegen();
+        if (!bound_v)
+            return nullptr;
+        if (!bound_v->getType()->isIntegerTy()) {
+            bound_v = convert(bound_v, Type::getDoubleTy(s.the_context));
+            if (!bound_v)
+                return nullptr;
+            bound_v = integral_bound(bound_v);
+        }
+        bound_val = bound_v;
+
+        iv_var = create_entry_block_alloca(the_function, var_name + ".iv", i64);
+        s.builder.CreateStore(ConstantInt::get(i64, (int64_t)start_c), iv_var);
+        s.loop_counters[alloca_var] = iv_var;
+    }
 
     // Make the new basic block for the loop header, inserting after current
     // block.
-    BasicBlock* loop_bb = BasicBlock::Create(the_context, "loop", the_function);
+    BasicBlock* loop_bb = BasicBlock::Create(s.the_context, "loop", the_function);
 
     // Insert an explicit fall through from the current block to the loop_bb.
-    builder.CreateBr(loop_bb);
+    s.builder.CreateBr(loop_bb);
 
     // Start insertion in loop_bb;
-    builder.SetInsertPoint(loop_bb);
+    s.builder.SetInsertPoint(loop_bb);
+
+    // The body sees the counter in the type of the variable.
+    if (counted) {
+        Value* iv = s.builder.CreateLoad(iv_var, "iv");
+        s.builder.CreateStore(convert(iv, var_ty), alloca_var);
+    }
 
     // Within the loop, the variable is defined equal to the PHI node. If it
     // shadows an existing variable, we have to restore it, so save it now.
-    AllocaInst* old_val = named_values[var_name];
-    named_values[var_name] = alloca_var;
+    AllocaInst* old_val = s.named_values[var_name];
+    s.named_values[var_name] = alloca_var;
 
     // Emit the body of the loop. This, like any other expr, can change the
     // current BB. Note that we ignore the value computed by the body, but
@@ -218,72 +605,379 @@ Value* For_expr_AST::codegen() {
     if (!body->codegen())
         return nullptr;
 
-    // Emit the step value.
-    Value* step_val = nullptr;
-    if (step) {
-        step_val = step->codegen();
+    // The latch: step the variable and test the end condition.
+    BasicBlock* latch_bb =
+            BasicBlock::Create(s.the_context, "loop.latch", the_function);
+    s.builder.CreateBr(latch_bb);
+    s.builder.SetInsertPoint(latch_bb);
+
+    Value* end_cond = nullptr;
+    if (counted) {
+        // The condition tests the value before the step, as below.
+        Value* iv = s.builder.CreateLoad(iv_var, "iv");
+        end_cond = s.builder.CreateICmpSLT(iv, bound_val, "loopcond");
+        Value* next_iv = s.builder.CreateNSWAdd(iv,
+                                                ConstantInt::get(i64, (int64_t)step_c),
+                                                "nextiv");
+        s.builder.CreateStore(next_iv, iv_var);
+    } else {
+        // Emit the step value.
+        Value* step_val = nullptr;
+        if (step) {
+            step_val = step->codegen();
+            if (!step_val)
+                return nullptr;
+        } else
+            // If not specified, use 1.0.
+            step_val = ConstantFP::get(s.the_context, APFloat(1.0));
+        step_val = convert(step_val, var_ty);
         if (!step_val)
             return nullptr;
-    } else
-        // If not specified, use 1.0.
-        step_val = ConstantFP::get(the_context, APFloat(1.0));
-
-    // Compute the end condition.
-    Value* end_cond = end->codegen();
-    if (!end_cond)
-        return nullptr;
 
-    // Reload, increment and restore the alloca. This handles the case where the
-    // body of the loop mutates the variable.
-    Value* cur_var = builder.CreateLoad(alloca_var, var_name.c_str());
-    Value* next_var = builder.CreateFAdd(cur_var, step_val, "nextvar");
-    builder.CreateStore(next_var, alloca_var);
+        // Compute the end condition.
+        end_cond = end->codegen();
+        if (!end_cond)
+            return nullptr;
 
-    // Convert condition to a bool by comparing non-equal to 0.0.
-    end_cond = builder.CreateFCmpONE(end_cond,
-                                     ConstantFP::get(the_context, APFloat(0.0)),
-                                     "loopcond");
+        // Reload, increment and restore the alloca. This handles the case
+        // where the body of the loop mutates the variable.
+        Value* cur_var = s.builder.CreateLoad(alloca_var, var_name.c_str());
+        Value* next_var = var_ty->isIntegerTy()
+                ? s.builder.CreateAdd(cur_var, step_val, "nextvar")
+                : s.builder.CreateFAdd(cur_var, step_val, "nextvar");
+        s.builder.CreateStore(next_var, alloca_var);
+
+        // Convert condition to a bool by comparing non-equal to 0.
+        end_cond = to_bool(end_cond, "loopcond");
+        if (!end_cond)
+            return nullptr;
+    }
 
     // Create the "after loop" block and insert it.
     BasicBlock* after_bb =
-            BasicBlock::Create(the_context, "afterloop", the_function);
+            BasicBlock::Create(s.the_context, "afterloop", the_function);
 
-    // Insert the conditional branch into the end of loop_end_bb;
-    builder.CreateCondBr(end_cond, loop_bb, after_bb);
+    // Insert the conditional branch into the end of the latch, carrying the
+    // hints for the loop passes.
+    BranchInst* latch_br = s.builder.CreateCondBr(end_cond, loop_bb, after_bb);
+    if (MDNode* loop_id = loop_metadata(s.the_context, hints))
+        latch_br->setMetadata(LLVMContext::MD_loop, loop_id);
 
     // Any new code will be inserted inf after_bb.
-    builder.SetInsertPoint(after_bb);
+    s.builder.SetInsertPoint(after_bb);
 
     // Restore the unshadowed variable.
     if (old_val)
-        named_values[var_name] = old_val;
+        s.named_values[var_name] = old_val;
     else
-        named_values.erase(var_name);
+        s.named_values.erase(var_name);
 
     // For expr always returns 0.0.
-    return Constant::getNullValue(Type::getDoubleTy(the_context));
+    return Constant::getNullValue(Type::getDoubleTy(s.the_context));
+}
+
+// outline - Emit the body of the loop as
+//   double parent.parfor.N(i8* env, i64 begin, i64 end)
+// which copies the captured variables out of 'env', runs the iterations
+// [begin, end) and returns the sum of the body, or 0 if the loop is not a
+// reduction. The builder is left where it was.
+Function* Parfor_expr_AST::outline(StructType* env_type,
+                                   const std::vector<std::string>& captured) {
+    Session& s = current_session();
+    Function* parent = s.builder.GetInsertBlock()->getParent();
+    Type* i64 = Type::getInt64Ty(s.the_context);
+    Type* double_ty = Type::getDoubleTy(s.the_context);
+
+    FunctionType* ft = FunctionType::get(
+            double_ty, {Type::getInt8PtrTy(s.the_context), i64, i64}, false);
+    Function* f = Function::Create(ft, Function::InternalLinkage,
+                                   parent->getName() + ".parfor." +
+                                           std::to_string(s.parfor_count++),
+                                   s.the_module.get());
+    // The builder still carries the fast-math flags of the parent.
+    set_fast_math_attributes(*f, s.builder.getFastMathFlags());
+    if (s.options.frame_pointers)
+        f->addFnAttr("frame-pointer", "all");
+    auto arg = f->arg_begin();
+    Value* env_arg = &*arg++;
+    Value* begin_arg = &*arg++;
+    Value* end_arg = &*arg;
+    env_arg->setName("env");
+    begin_arg->setName("begin");
+    end_arg->setName("end");
+
+    // The body has its own scope, holding the copies.
+    IRBuilderBase::InsertPoint parent_ip = s.builder.saveIP();
+    std::map<std::string, AllocaInst*> parent_values = s.named_values;
+    auto restore = [&] {
+        s.named_values = parent_values;
+        s.builder.restoreIP(parent_ip);
+    };
+    s.named_values.clear();
+
+    BasicBlock* entry_bb = BasicBlock::Create(s.the_context, "entry", f);
+    s.builder.SetInsertPoint(entry_bb);
+    Value* env = s.builder.CreateBitCast(env_arg, env_type->getPointerTo());
+    for (unsigned i = 0; i < captured.size(); ++i) {
+        AllocaInst* copy = create_entry_block_alloca(
+                f, captured[i], env_type->getElementType(i));
+        Value* val = s.builder.CreateLoad(
+                s.builder.CreateStructGEP(env_type, env, i), captured[i]);
+        s.builder.CreateStore(val, copy);
+        s.named_values[captured[i]] = copy;
+    }
+
+    Type* var_ty = llvm_type(s.the_context, var_type);
+    AllocaInst* alloca_var = create_entry_block_alloca(f, var_name, var_ty);
+    AllocaInst* iv_var = create_entry_block_alloca(f, var_name + ".iv", i64);
+    AllocaInst* sum_var = create_entry_block_alloca(f, "sum", double_ty);
+    s.builder.CreateStore(begin_arg, iv_var);
+    s.builder.CreateStore(ConstantFP::get(double_ty, 0.0), sum_var);
+    s.named_values[var_name] = alloca_var;
+    if (!body->assigns(var_name))
+        s.loop_counters[alloca_var] = iv_var;
+
+    // Same shape as a counted for loop, guarded since the range may be
+    // empty.
+    BasicBlock* loop_bb = BasicBlock::Create(s.the_context, "loop", f);
+    BasicBlock* after_bb = BasicBlock::Create(s.the_context, "afterloop");
+    s.builder.CreateCondBr(s.builder.CreateICmpSLT(begin_arg, end_arg),
+                           loop_bb, after_bb);
+    s.builder.SetInsertPoint(loop_bb);
+    Value* iv = s.builder.CreateLoad(iv_var, "iv");
+    s.builder.CreateStore(convert(iv, var_ty), alloca_var);
+
+    Value* body_val = body->codegen();
+    if (body_val && is_sum)
+        body_val = convert(body_val, double_ty);
+    if (!body_val) {
+        restore();
+        f->eraseFromParent();
+        return nullptr;
+    }
+    if (is_sum) {
+        Value* sum = s.builder.CreateLoad(sum_var, "sum");
+        s.builder.CreateStore(s.builder.CreateFAdd(sum, body_val, "addsum"),
+                              sum_var);
+    }
+
+    BasicBlock* latch_bb = BasicBlock::Create(s.the_context, "loop.latch", f);
+    s.builder.CreateBr(latch_bb);
+    s.builder.SetInsertPoint(latch_bb);
+    iv = s.builder.CreateLoad(iv_var, "iv");
+    Value* next_iv = s.builder.CreateNSWAdd(iv, ConstantInt::get(i64, 1),
+                                            "nextiv");
+    s.builder.CreateStore(next_iv, iv_var);
+    BranchInst* latch_br = s.builder.CreateCondBr(
+            s.builder.CreateICmpSLT(next_iv, end_arg, "loopcond"), loop_bb,
+            after_bb);
+    if (MDNode* loop_id = loop_metadata(s.the_context, hints))
+        latch_br->setMetadata(LLVMContext::MD_loop, loop_id);
+
+    f->getBasicBlockList().push_back(after_bb);
+    s.builder.SetInsertPoint(after_bb);
+    s.builder.CreateRet(s.builder.CreateLoad(sum_var, "sum"));
+
+    restore();
+    verifyFunction(*f);
+    inline_callees(*f);
+    {
+        Phase_timer timer(Phase::Optimize);
+        optimize_function(*f);
+    }
+    return f;
+}
+
+// The variables in scope are copied into an environment on the stack, the
+// body is outlined into a function over a range of iterations and the
+// runtime runs it on chunks of [start, end) in parallel.
+Value* Parfor_expr_AST::codegen() {
+    Session& s = current_session();
+    Function* the_function = s.builder.GetInsertBlock()->getParent();
+    Type* i64 = Type::getInt64Ty(s.the_context);
+    Type* i8_ptr = Type::getInt8PtrTy(s.the_context);
+
+    // The bounds are evaluated once, as integers.
+    Value* start_val = start->codegen();
+    if (start_val)
+        start_val = convert(start_val, i64);
+    if (!start_val)
+        return nullptr;
+    Value* end_val = end->codegen();
+    if (end_val)
+        end_val = convert(end_val, i64);
+    if (!end_val)
+        return nullptr;
+
+    std::vector<std::string> captured;
+    std::vector<Type*> field_types;
+    for (auto& var : s.named_values) {
+        if (!var.second)
+            continue;
+        captured.push_back(var.first);
+        field_types.push_back(var.second->getAllocatedType());
+    }
+    StructType* env_type = StructType::get(s.the_context, field_types);
+    AllocaInst* env = create_entry_block_alloca(the_function, "parfor.env",
+                                                env_type);
+    for (unsigned i = 0; i < captured.size(); ++i) {
+        Value* val = s.builder.CreateLoad(s.named_values[captured[i]],
+                                          captured[i]);
+        s.builder.CreateStore(val, s.builder.CreateStructGEP(env_type, env, i));
+    }
+
+    Function* body_f = outline(env_type, captured);
+    if (!body_f)
+        return nullptr;
+
+    // double kaleidoscope_parfor(body, env, begin, end, grain)
+    FunctionCallee runtime = s.the_module->getOrInsertFunction(
+            "kaleidoscope_parfor",
+            FunctionType::get(Type::getDoubleTy(s.the_context),
+                              {body_f->getType(), i8_ptr, i64, i64, i64},
+                              false));
+    Value* args[] = {body_f, s.builder.CreateBitCast(env, i8_ptr), start_val,
+                     end_val, ConstantInt::get(i64, hints.grain)};
+    return s.builder.CreateCall(runtime, args, "parfor");
 }
 
 Function* get_function(std::string name) {
+    Session& s = current_session();
     // First, see if the function has already been added to the current module.
-    if (auto* f = the_module->getFunction(name))
+    if (auto* f = s.the_module->getFunction(name))
         return f;
 
     // If not, check whether we can codegen the declaration from some existing
     // prototype.
-    auto fi = function_protos.find(name);
-    if (fi != function_protos.end())
+    auto fi = s.function_protos.find(name);
+    if (fi != s.function_protos.end())
         return fi->second->codegen();
 
     // If no existing prototype exists, return null.
     return nullptr;
 }
 
+// reduce_lanes - Combine the lanes of the vector 'v' pairwise with 'combine'
+// down to one, halving the vector each step.
+static Value* reduce_lanes(Value* v,
+                           function_ref<Value*(Value*, Value*)> combine) {
+    Session& s = current_session();
+    Value* undef = UndefValue::get(v->getType());
+    for (unsigned n = v->getType()->getVectorNumElements() / 2; n; n /= 2) {
+        SmallVector<uint32_t, 8> low, high;
+        for (unsigned i = 0; i < n; ++i) {
+            low.push_back(i);
+            high.push_back(i + n);
+        }
+        v = combine(s.builder.CreateShuffleVector(v, undef, low, "low"),
+                    s.builder.CreateShuffleVector(v, undef, high, "high"));
+    }
+    return s.builder.CreateExtractElement(v, uint64_t(0), "reduced");
+}
+
+// vector_builtin - The built-in functions on vectors: 'vec4(x)' has x in
+// every lane, 'vec4(x, y, z, w)' the given lanes, and 'hsum', 'hprod',
+// 'hmin' and 'hmax' reduce the lanes of a vector to a double. Sets
+// 'is_builtin' to whether 'callee' is one of them.
+static Value* vector_builtin(const std::string& callee,
+                             ArrayRef<std::unique_ptr<Expr_AST>> args,
+                             bool& is_builtin) {
+    Session& s = current_session();
+    Type* double_ty = Type::getDoubleTy(s.the_context);
+    Value_type type;
+    is_builtin = (type_from_name(callee, type) && is_vector(type)) ||
+                 callee == "hsum" || callee == "hprod" || callee == "hmin" ||
+                 callee == "hmax";
+    if (!is_builtin)
+        return nullptr;
+
+    std::vector<Value*> args_v;
+    for (auto& arg : args) {
+        args_v.push_back(arg->codegen());
+        if (!args_v.back())
+            return nullptr;
+    }
+
+    if (is_vector(type)) {
+        Type* vec_ty = llvm_type(s.the_context, type);
+        unsigned lanes = vec_ty->getVectorNumElements();
+        if (args_v.size() == 1)
+            return convert(args_v[0], vec_ty);
+        if (args_v.size() != lanes)
+            return log_error_v("Incorrect number of lanes passed.");
+
+        Value* v = UndefValue::get(vec_ty);
+        for (unsigned i = 0; i < lanes; ++i) {
+            Value* lane = convert(args_v[i], double_ty);
+            if (!lane)
+                return nullptr;
+            v = s.builder.CreateInsertElement(v, lane, uint64_t(i), "vec");
+        }
+        return v;
+    }
+
+    if (args_v.size() != 1)
+        return log_error_v("Incorrect number of arguments passed.");
+    if (!args_v[0]->getType()->isVectorTy())
+        return log_error_v("Expected a vector.");
+
+    Module* module = s.builder.GetInsertBlock()->getModule();
+    Intrinsic::ID id = callee == "hmin" ? Intrinsic::minnum : Intrinsic::maxnum;
+    return reduce_lanes(args_v[0], [&](Value* a, Value* b) -> Value* {
+        if (callee == "hsum")
+            return s.builder.CreateFAdd(a, b, "addtmp");
+        if (callee == "hprod")
+            return s.builder.CreateFMul(a, b, "multmp");
+        Function* f = Intrinsic::getDeclaration(module, id, a->getType());
+        return s.builder.CreateCall(f, {a, b}, "calltmp");
+    });
+}
+
+// math_call - Call the math function 'name', lowered to the intrinsic 'id'.
+// With a vector argument it applies lane by lane, calling the libmvec
+// variant if the host has one for the width.
+static Value* math_call(const std::string& name, Intrinsic::ID id,
+                        std::vector<Value*>& args) {
+    Session& s = current_session();
+    Module* module = s.builder.GetInsertBlock()->getModule();
+    Type* type = Type::getDoubleTy(s.the_context);
+    for (Value* arg : args)
+        if (arg->getType()->isVectorTy())
+            type = arg->getType();
+    for (Value*& arg : args) {
+        arg = convert(arg, type);
+        if (!arg)
+            return nullptr;
+    }
+
+    if (type->isVectorTy()) {
+        StringRef variant = vector_math_function(
+                s.the_jit->getTargetMachine(), name,
+                type->getVectorNumElements());
+        if (!variant.empty()) {
+            std::vector<Type*> params(args.size(), type);
+            FunctionCallee f = module->getOrInsertFunction(
+                    variant, FunctionType::get(type, params, false));
+            return s.builder.CreateCall(f, args, "calltmp");
+        }
+    }
+
+    Function* f = Intrinsic::getDeclaration(module, id, type);
+    return s.builder.CreateCall(f, args, "calltmp");
+}
+
 Value* Call_expr_AST::codegen() {
-    // Look up the name in the global module table.
+    Session& s = current_session();
+    // Look up the name in the global module table, a definition of a
+    // built-in name replaces it.
     Function* callee_f = get_function(callee);
-    if (!callee_f)
+    if (!callee_f) {
+        bool is_builtin;
+        Value* v = vector_builtin(callee, args, is_builtin);
+        if (is_builtin)
+            return v;
         return log_error_v("Unknown function referenced.");
+    }
 
     // If argument mismatch error.
     if (callee_f->arg_size() != args.size())
@@ -296,66 +990,159 @@ Value* Call_expr_AST::codegen() {
             return nullptr;
     }
 
-    return builder.CreateCall(callee_f, args_v, "calltmp");
+    // Well-known math externs become intrinsics, which constant fold and
+    // vectorize. A definition of the same name replaces the extern.
+    auto proto = s.function_protos.find(callee);
+    if (proto != s.function_protos.end() && proto->second->is_external() &&
+        proto->second->is_all_double()) {
+        Intrinsic::ID id = math_intrinsic(callee, args.size());
+        if (id != Intrinsic::not_intrinsic)
+            return math_call(callee, id, args_v);
+    }
+
+    for (uint32_t i = 0, e = args_v.size(); i != e; ++i) {
+        args_v[i] = convert(args_v[i],
+                            callee_f->getFunctionType()->getParamType(i));
+        if (!args_v[i])
+            return nullptr;
+    }
+
+    // A self call in tail position becomes a jump back to the top of the
+    // function, so tail recursion runs in constant stack.
+    Function* the_function = s.builder.GetInsertBlock()->getParent();
+    if (is_tail && callee_f == the_function && s.tail_recurse_bb) {
+        for (uint32_t i = 0, e = args_v.size(); i != e; ++i)
+            s.builder.CreateStore(args_v[i], s.tail_recurse_args[i]);
+        s.builder.CreateBr(s.tail_recurse_bb);
+
+        // Anything emitted after the jump is unreachable and the value is
+        // never used, CFG simplification removes the block.
+        BasicBlock* dead_bb =
+                BasicBlock::Create(s.the_context, "tailcont", the_function);
+        s.builder.SetInsertPoint(dead_bb);
+        return UndefValue::get(the_function->getReturnType());
+    }
+
+    CallInst* call = s.builder.CreateCall(callee_f, args_v, "calltmp");
+    // Other tail calls are left to TailCallElim and the backend.
+    if (is_tail)
+        call->setTailCall();
+    return call;
 }
 
 Function* Prototype_AST::codegen() {
-    // Make the function type: double(double, double) etc.
-    std::vector<Type*> doubles(args.size(), Type::getDoubleTy(the_context));
+    Session& s = current_session();
+    // Make the function type: double(double, double) etc., or the annotated
+    // types.
+    std::vector<Type*> arg_tys;
+    for (size_t i = 0; i < args.size(); ++i)
+        arg_tys.push_back(llvm_type(s.the_context, get_arg_type(i)));
     FunctionType* ft =
-            FunctionType::get(Type::getDoubleTy(the_context), doubles, false);
+            FunctionType::get(llvm_type(s.the_context, ret_type), arg_tys, false);
     Function* f =
-            Function::Create(ft, Function::ExternalLinkage, name, the_module.get());
+            Function::Create(ft, Function::ExternalLinkage, name, s.the_module.get());
 
-    // Set the names for all arguments.
+    // Set the names for all arguments. Arrays passed in never overlap, which
+    // lets loops over them vectorize.
     uint32_t idx = 0;
-    for (auto& arg : f->args())
+    for (auto& arg : f->args()) {
+        if (arg.getType()->isPointerTy())
+            arg.addAttr(Attribute::NoAlias);
         arg.setName(args[idx++]);
+    }
 
     return f;
 }
 
 Function* Function_AST::codegen() {
+    Session& s = current_session();
     // Transfer ownership of the prototype to te function_protos map, but keep a
     // reference to it for use below.
     auto& p = *proto;
-    function_protos[proto->get_name()] = std::move(proto);
+    s.function_protos[proto->get_name()] = std::move(proto);
     Function* the_function = get_function(p.get_name());
 
     if (!the_function)
         return nullptr;
 
-    // If this is an operator, install it.
-    if (p.is_binary_op())
-        binop_precedence[p.get_operator_name()] = p.get_binary_precedence();
+    // An earlier declaration in this module may disagree with the prototype.
+    if (the_function->arg_size() != p.get_args().size()) {
+        log_error_v("Definition does not match the declaration's arguments.");
+        return nullptr;
+    }
+
+    // Floating point operations may be relaxed as far as the definition asks.
+    s.builder.setFastMathFlags(fast_math);
+    set_fast_math_attributes(*the_function, fast_math);
+    if (s.options.frame_pointers)
+        the_function->addFnAttr("frame-pointer", "all");
 
     // Create a new basic block to start insertion into.
-    BasicBlock* bb = BasicBlock::Create(the_context, "entry", the_function);
-    builder.SetInsertPoint(bb);
+    BasicBlock* bb = BasicBlock::Create(s.the_context, "entry", the_function);
+    s.builder.SetInsertPoint(bb);
 
     // Record the function arguments in the named_values map.
-    named_values.clear();
+    s.named_values.clear();
+    s.tail_recurse_args.clear();
+    s.loop_counters.clear();
+    // Names come from the prototype, the context may discard those of the
+    // IR arguments.
+    const auto& arg_names = p.get_args();
+    uint32_t idx = 0;
     for (auto& arg : the_function->args()) {
+        const std::string& arg_name = arg_names[idx++];
         // Create an alloca for this variable.
         AllocaInst* alloca_var = create_entry_block_alloca(the_function,
-                                                           arg.getName());
+                                                           arg_name,
+                                                           arg.getType());
 
         // Store the initial value into the alloca.
-        builder.CreateStore(&arg, alloca_var);
+        s.builder.CreateStore(&arg, alloca_var);
 
         // Add argument to the variable symbol table.
-        named_values[arg.getName()] = alloca_var;
+        s.named_values[arg_name] = alloca_var;
+        s.tail_recurse_args.push_back(alloca_var);
     }
 
-    if (Value* ret_val = body->codegen()) {
+    // Self tail calls jump to this block instead of recursing.
+    s.tail_recurse_bb =
+            BasicBlock::Create(s.the_context, "tailrecurse", the_function);
+    s.builder.CreateBr(s.tail_recurse_bb);
+    s.builder.SetInsertPoint(s.tail_recurse_bb);
+
+    body->mark_tail();
+    Value* ret_val = body->codegen();
+    s.tail_recurse_bb = nullptr;
+    if (ret_val)
+        ret_val = convert(ret_val, the_function->getReturnType());
+
+    if (ret_val) {
         // Finish off the function.
-        builder.CreateRet(ret_val);
+        s.builder.CreateRet(ret_val);
 
         // Validate the generated code, checking for consistency.
         verifyFunction(*the_function);
 
+        // Pull in small functions from earlier modules.
+        inline_callees(*the_function);
+
         // Optimize the function.
-        the_fpm->run(*the_function);
+        {
+            Phase_timer timer(Phase::Optimize);
+            optimize_function(*the_function);
+        }
+
+        // Keep the body of an operator for expansion at its uses, the
+        // function stays as the fallback for recursive uses.
+        if (p.is_unary_op() || p.is_binary_op()) {
+            Operator_body& op = s.operator_bodies[p.get_name()];
+            op.args = p.get_args();
+            op.arg_types.clear();
+            for (size_t i = 0; i < op.args.size(); ++i)
+                op.arg_types.push_back(p.get_arg_type(i));
+            op.ret_type = p.get_ret_type();
+            op.body = std::move(body);
+        }
 
         return the_function;
     }
@@ -366,15 +1153,18 @@ Function* Function_AST::codegen() {
 }
 
 Value* Var_expr_AST::codegen() {
+    Session& s = current_session();
     std::vector<AllocaInst*> old_bindings;
 
-    Function* the_function = builder.GetInsertBlock()->getParent();
+    Function* the_function = s.builder.GetInsertBlock()->getParent();
 
     // Register all variables and emit their initializer.
     for (uint32_t i = 0, e = var_names.size(); i != e; i++) {
         const std::string& var_name = var_names[i].first;
         Expr_AST* init = var_names[i].second.get();
 
+        Type* type = llvm_type(s.the_context, var_types[i]);
+
         // Emit the initializer before adding the variable to scope, this
         // prevents the initializer from referencing the variable itself.
         Value* init_val;
@@ -383,19 +1173,23 @@ Value* Var_expr_AST::codegen() {
             if (!init_val)
                 return nullptr;
         } else
-            // If not specifier, use 0.0.
-            init_val = ConstantFP::get(the_context, APFloat(0.0));
+            // If not specifier, use 0.
+            init_val = Constant::getNullValue(type);
+
+        init_val = convert(init_val, type);
+        if (!init_val)
+            return nullptr;
 
         AllocaInst* alloca_var = create_entry_block_alloca(the_function,
-                                                           var_name);
-        builder.CreateStore(init_val, alloca_var);
+                                                           var_name, type);
+        s.builder.CreateStore(init_val, alloca_var);
 
         // Remember the old variable binding so that we can restore the
         // binding when we unrecurse.
-        old_bindings.push_back(named_values[var_name]);
+        old_bindings.push_back(s.named_values[var_name]);
 
         // Remember this binding.
-        named_values[var_name] = alloca_var;
+        s.named_values[var_name] = alloca_var;
     }
 
     // Codegen the body.
@@ -405,31 +1199,8 @@ Value* Var_expr_AST::codegen() {
 
     // Pop all our variables from scope.
     for (uint32_t i = 0, e = var_names.size(); i != e; i++)
-        named_values[var_names[i].first] = old_bindings[i];
+        s.named_values[var_names[i].first] = old_bindings[i];
 
     // Return the body computation.
     return body_val;
 }
-
-//===----------------------------------------------------------------------===//
-// "Library" functions that can be "extern'd" from user code.
-//===----------------------------------------------------------------------===//
-
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
-
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
-  return 0;
-}
-
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
-  return 0;
-}
-
@@ -0,0 +1,115 @@
+#include "types.h"
+
+bool type_from_name(const std::string& name, Value_type& type) {
+    if (name == "double")
+        type = Value_type::Double;
+    else if (name == "float")
+        type = Value_type::Float;
+    else if (name == "int")
+        type = Value_type::Int;
+    else if (name == "vec2")
+        type = Value_type::Vec2;
+    else if (name == "vec4")
+        type = Value_type::Vec4;
+    else if (name == "vec8")
+        type = Value_type::Vec8;
+    else
+        return false;
+    return true;
+}
+
+std::string type_name(Value_type type) {
+    switch (type) {
+    case Value_type::Float:
+        return "float";
+    case Value_type::Int:
+        return "int";
+    case Value_type::Double_array:
+        return "double[]";
+    case Value_type::Float_array:
+        return "float[]";
+    case Value_type::Int_array:
+        return "int[]";
+    case Value_type::Vec2:
+        return "vec2";
+    case Value_type::Vec4:
+        return "vec4";
+    case Value_type::Vec8:
+        return "vec8";
+    default:
+        return "double";
+    }
+}
+
+bool value_type_of(Type* type, Value_type& result) {
+    const Value_type all[] = {
+        Value_type::Double, Value_type::Float, Value_type::Int,
+        Value_type::Double_array, Value_type::Float_array,
+        Value_type::Int_array, Value_type::Vec2, Value_type::Vec4,
+        Value_type::Vec8
+    };
+    for (Value_type t : all)
+        if (llvm_type(type->getContext(), t) == type) {
+            result = t;
+            return true;
+        }
+    return false;
+}
+
+Value_type array_of(Value_type type) {
+    switch (type) {
+    case Value_type::Float:
+        return Value_type::Float_array;
+    case Value_type::Int:
+        return Value_type::Int_array;
+    default:
+        return Value_type::Double_array;
+    }
+}
+
+bool is_array(Value_type type) {
+    return type == Value_type::Double_array ||
+           type == Value_type::Float_array || type == Value_type::Int_array;
+}
+
+bool is_vector(Value_type type) {
+    return type == Value_type::Vec2 || type == Value_type::Vec4 ||
+           type == Value_type::Vec8;
+}
+
+std::string overload_name(const std::string& name,
+                          ArrayRef<Value_type> types) {
+    bool overloaded = false;
+    for (Value_type type : types)
+        overloaded |= is_vector(type);
+    if (!overloaded)
+        return name;
+
+    std::string result = name;
+    for (Value_type type : types)
+        result += "." + type_name(type);
+    return result;
+}
+
+Type* llvm_type(LLVMContext& ctx, Value_type type) {
+    switch (type) {
+    case Value_type::Float:
+        return Type::getFloatTy(ctx);
+    case Value_type::Int:
+        return Type::getInt64Ty(ctx);
+    case Value_type::Double_array:
+        return Type::getDoublePtrTy(ctx);
+    case Value_type::Float_array:
+        return Type::getFloatPtrTy(ctx);
+    case Value_type::Int_array:
+        return Type::getInt64PtrTy(ctx);
+    case Value_type::Vec2:
+        return VectorType::get(Type::getDoubleTy(ctx), 2);
+    case Value_type::Vec4:
+        return VectorType::get(Type::getDoubleTy(ctx), 4);
+    case Value_type::Vec8:
+        return VectorType::get(Type::getDoubleTy(ctx), 8);
+    default:
+        return Type::getDoubleTy(ctx);
+    }
+}
@@ -0,0 +1,55 @@
+// Self tail calls run in constant stack: a million deep tail recursion on a
+// thread whose stack holds a few thousand frames at most.
+
+#include <pthread.h>
+#include <cstdio>
+
+#include "session.h"
+
+typedef double Loop_fn(double, double);
+
+// Bytes of stack of the thread running the recursion.
+static const size_t stack_size = 64 * 1024;
+static const double depth = 1000000;
+
+static Loop_fn* loop_fn;
+static double result;
+
+static void* run_loop(void*) {
+    result = loop_fn(depth, 0);
+    return nullptr;
+}
+
+int main() {
+    Session_options options;
+    options.buffer_diagnostics = true;
+    Session s(options);
+    if (!s.compile("def loop(n acc) if n < 1 then acc else loop(n-1, acc+1);")) {
+        fprintf(stderr, "tail_call: compile error\n%s", s.diagnostics.c_str());
+        return 1;
+    }
+    loop_fn = s.lookup<Loop_fn>("loop");
+    if (!loop_fn) {
+        fprintf(stderr, "tail_call: loop not found\n");
+        return 1;
+    }
+
+    // A call per level would overflow the stack and crash here.
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, run_loop, nullptr) ||
+        pthread_join(thread, nullptr)) {
+        fprintf(stderr, "tail_call: could not start a thread\n");
+        return 1;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (result != depth) {
+        fprintf(stderr, "tail_call: loop(%.0f, 0) returned %f\n", depth,
+                result);
+        return 1;
+    }
+    return 0;
+}
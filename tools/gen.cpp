@@ -0,0 +1,55 @@
+// kaleidoscope_gen - Write a synthetic program for scaling tests, see
+// generator.h. The same options always write the same program.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "generator.h"
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [--functions=<n>] [--depth=<n>] [--width=<n>] "
+                    "[--call-density=<p>] [--loop-nesting=<n>] "
+                    "[--operators=<n>] [--seed=<n>] [--output=<file>]\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    Generator_options options;
+    std::string output;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+
+        if (!strncmp(arg, "--functions=", 12))
+            options.functions = strtoul(arg + 12, nullptr, 10);
+        else if (!strncmp(arg, "--depth=", 8))
+            options.depth = strtoul(arg + 8, nullptr, 10);
+        else if (!strncmp(arg, "--width=", 8))
+            options.width = strtoul(arg + 8, nullptr, 10);
+        else if (!strncmp(arg, "--call-density=", 15))
+            options.call_density = strtod(arg + 15, nullptr);
+        else if (!strncmp(arg, "--loop-nesting=", 15))
+            options.loop_nesting = strtoul(arg + 15, nullptr, 10);
+        else if (!strncmp(arg, "--operators=", 12))
+            options.operators = strtoul(arg + 12, nullptr, 10);
+        else if (!strncmp(arg, "--seed=", 7))
+            options.seed = strtoull(arg + 7, nullptr, 10);
+        else if (!strncmp(arg, "--output=", 9))
+            output = arg + 9;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    FILE* out = output.empty() ? stdout : fopen(output.c_str(), "w");
+    if (!out) {
+        fprintf(stderr, "Could not write %s\n", output.c_str());
+        return 1;
+    }
+    std::string program = generate_program(options);
+    bool ok = fwrite(program.data(), 1, program.size(), out) == program.size();
+    ok = (out == stdout ? fflush(out) : fclose(out)) == 0 && ok;
+    return ok ? 0 : 1;
+}